@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+// Float maths for the core. Nothing on the audio path calls the C maths
+// library, whose results differ in the last bit between platforms: only
+// + - * /, std::sqrt (which IEEE 754 rounds exactly) and bit manipulation.
+// Built without FP contraction, the core then gives the same output bit for
+// bit on any IEEE single-precision target, a host or the module's
+// Cortex-M7.
+namespace resynth
+{
+
+// sin (2 pi phase) for phase in [-0.5, 0.5): folded into a quarter period and
+// evaluated as an odd polynomial, as the plugin's OscillatorBank does. Max
+// error about 4e-6.
+inline float fastSin (float phase)
+{
+    constexpr float twoPi = 6.283185307f;
+    constexpr float c1 = twoPi;
+    constexpr float c3 = -c1 * twoPi * twoPi / 6.0f;
+    constexpr float c5 = -c3 * twoPi * twoPi / 20.0f;
+    constexpr float c7 = -c5 * twoPi * twoPi / 42.0f;
+    constexpr float c9 = -c7 * twoPi * twoPi / 72.0f;
+
+    auto folded = phase > 0.25f ? 0.5f - phase : (phase < -0.25f ? -0.5f - phase : phase);
+    auto squared = folded * folded;
+    return folded * (c1 + squared * (c3 + squared * (c5 + squared * (c7 + squared * c9))));
+}
+
+// The largest whole number not above x, for |x| < 2^31
+inline float floorToFloat (float x)
+{
+    auto truncated = (float) (int32_t) x;
+    return truncated > x ? truncated - 1.0f : truncated;
+}
+
+// sin (2 pi phase) for any phase, to a float's precision, for the tables
+// built at init: the same fold, with the series taken to x^15.
+inline float sinCycles (float phase)
+{
+    constexpr float twoPi = 6.283185307f;
+
+    phase -= floorToFloat (phase + 0.5f);
+    auto folded = phase > 0.25f ? 0.5f - phase : (phase < -0.25f ? -0.5f - phase : phase);
+    auto x = folded * twoPi;
+    auto squared = x * x;
+    auto sum = 1.0f;
+
+    for (int n = 15; n > 1; n -= 2)
+        sum = 1.0f - sum * squared / (float) (n * (n - 1));
+
+    return x * sum;
+}
+
+inline float cosCycles (float phase)
+{
+    return sinCycles (phase + 0.25f);
+}
+
+// 2^x, to within about 2e-7 relative: the nearest whole power goes in the
+// exponent bits and the remaining [-0.5, 0.5] octave is a polynomial.
+inline float exp2 (float x)
+{
+    constexpr float ln2 = 0.693147181f;
+
+    x = x < -126.0f ? -126.0f : (x > 127.0f ? 127.0f : x);
+
+    auto whole = floorToFloat (x + 0.5f);
+    auto fraction = (x - whole) * ln2;
+    auto sum = 1.0f;
+
+    for (int n = 8; n > 0; --n)
+        sum = 1.0f + sum * fraction / (float) n;
+
+    auto bits = (uint32_t) ((int32_t) whole + 127) << 23;
+    float scale;
+    std::memcpy (&scale, &bits, sizeof (scale));
+    return sum * scale;
+}
+
+// e^x, through exp2()
+inline float exp (float x)
+{
+    constexpr float log2e = 1.44269504f;
+    return exp2 (x * log2e);
+}
+
+} // namespace resynth
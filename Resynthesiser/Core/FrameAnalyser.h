@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include "CoreMath.h"
+#include "RealFft.h"
+
+namespace resynth
+{
+
+// One analysis frame, reduced to what the synth plays: its strongest
+// partials, lowest frequency first, the fundamental they imply and the
+// input's level.
+template <int MaxPartials>
+struct AnalysisFrame
+{
+    struct Partial
+    {
+        float frequency = 0.0f; // Hz
+        float amplitude = 0.0f; // linear, 1 for a full-scale sine
+    };
+
+    float fundamental = 0.0f;   // Hz, 0 if none was found
+    float level = 0.0f;         // RMS of the frame's input
+    int numPartials = 0;
+    std::array<Partial, MaxPartials> partials {};
+};
+
+// Short-time analysis of a mono input at a fixed frame size of 2^FftOrder
+// samples: Hann window, FFT, magnitude peaks with parabolic interpolation,
+// and a harmonic-sum fundamental over the peaks. The core's counterpart of
+// the plugin's SpectralAnalyser and PeakExtractor, without the threads,
+// tiers and choice of estimators.
+//
+// Input goes into a ring the size of a frame; analyse() reads the latest
+// frame from it whenever the caller's hop comes round. Every buffer is a
+// member sized by the template arguments, so nothing allocates.
+template <int FftOrder, int MaxPartials>
+class FrameAnalyser
+{
+public:
+    static constexpr int fftSize = 1 << FftOrder;
+    static constexpr int numBins = fftSize / 2 + 1;
+
+    using Frame = AnalysisFrame<MaxPartials>;
+
+    void init (float newSampleRate)
+    {
+        sampleRate = newSampleRate;
+
+        // Symmetric Hann, sin^2 (pi n / N), scaled so a sine's peak reads its amplitude
+        auto sum = 0.0f;
+
+        for (int i = 0; i < fftSize; ++i)
+        {
+            auto value = sinCycles ((float) i / (float) (2 * fftSize));
+            window[(size_t) i] = value * value;
+            sum += window[(size_t) i];
+        }
+
+        amplitudeScale = 2.0f / sum;
+        reset();
+    }
+
+    void reset()
+    {
+        history.fill (0.0f);
+        writePosition = 0;
+    }
+
+    // Appends numSamples of input to the frame
+    void write (const float* input, int numSamples)
+    {
+        for (int i = 0; i < numSamples; ++i)
+        {
+            history[(size_t) writePosition] = input[i];
+            writePosition = (writePosition + 1) & (fftSize - 1);
+        }
+    }
+
+    // Analyses the last fftSize samples written, oldest first
+    void analyse (Frame& frame)
+    {
+        auto sumOfSquares = 0.0f;
+
+        for (int i = 0; i < fftSize; ++i)
+        {
+            auto sample = history[(size_t) ((writePosition + i) & (fftSize - 1))];
+            sumOfSquares += sample * sample;
+            windowed[(size_t) i] = sample * window[(size_t) i];
+        }
+
+        fft.forward (windowed.data(), spectrum.data());
+        fft.getMagnitudes (spectrum.data(), magnitudes.data());
+
+        frame.level = std::sqrt (sumOfSquares / (float) fftSize);
+        findPeaks (frame);
+        frame.fundamental = findFundamental (frame);
+    }
+
+    // The frame's centre trails the newest sample by this much
+    static constexpr int getLatency()  { return fftSize / 2; }
+
+private:
+    static constexpr float minAmplitude = 1.0e-4f;                  // -80 dB, anything quieter is noise
+    static constexpr float minFundamental = 30.0f, maxFundamental = 2000.0f;
+    static constexpr int maxSubharmonic = 4;                        // candidates down to a quarter of a peak
+    static constexpr int maxCandidates = 16;                        // the loudest peaks tried as harmonics
+    static constexpr float harmonicTolerance = 0.1f;                // of the fundamental, either side of a harmonic
+    static constexpr int maxCandidatePeaks = numBins / 2;           // local maxima can't be any denser
+
+    RealFft<FftOrder> fft;
+    std::array<float, fftSize> history {}, window {}, windowed {};
+    std::array<float, fftSize + 2> spectrum {};
+    std::array<float, numBins> magnitudes {};
+    std::array<typename Frame::Partial, maxCandidatePeaks> candidates {};
+    std::array<int, MaxPartials> order {};
+    int writePosition = 0;
+    float sampleRate = 48000.0f;
+    float amplitudeScale = 0.0f;
+
+    // Every local maximum above the floor, interpolated, then the loudest
+    // MaxPartials of them in order of frequency
+    void findPeaks (Frame& frame)
+    {
+        auto binWidth = sampleRate / (float) fftSize;
+        auto lastBin = numBins - 2;
+        auto threshold = minAmplitude / amplitudeScale;
+        auto numCandidates = 0;
+
+        for (int bin = 2; bin <= lastBin && numCandidates < maxCandidatePeaks; ++bin)
+        {
+            auto left = magnitudes[(size_t) bin - 1], centre = magnitudes[(size_t) bin], right = magnitudes[(size_t) bin + 1];
+
+            if (centre <= threshold || centre <= left || centre < right)
+                continue;
+
+            // Vertex of the parabola through the three bins
+            auto curvature = left - 2.0f * centre + right;
+            auto offset = curvature < 0.0f ? 0.5f * (left - right) / curvature : 0.0f;
+
+            auto& peak = candidates[(size_t) numCandidates++];
+            peak.frequency = ((float) bin + offset) * binWidth;
+            peak.amplitude = (centre - 0.25f * (left - right) * offset) * amplitudeScale;
+        }
+
+        frame.numPartials = std::min (numCandidates, MaxPartials);
+
+        // Ties broken by frequency, which peaks never share, so every standard
+        // library picks the same ones
+        std::partial_sort (candidates.begin(), candidates.begin() + frame.numPartials, candidates.begin() + numCandidates,
+                           [] (const typename Frame::Partial& a, const typename Frame::Partial& b)
+                           {
+                               return a.amplitude > b.amplitude || (a.amplitude == b.amplitude && a.frequency < b.frequency);
+                           });
+        std::sort (candidates.begin(), candidates.begin() + frame.numPartials,
+                   [] (const typename Frame::Partial& a, const typename Frame::Partial& b) { return a.frequency < b.frequency; });
+        std::copy (candidates.begin(), candidates.begin() + frame.numPartials, frame.partials.begin());
+    }
+
+    // Tries each of the loudest peaks as the first to fourth harmonic, and
+    // keeps the candidate whose harmonics, weighted 1/k, hold the most
+    // amplitude. The weighting is what keeps a subharmonic, which matches
+    // every harmonic of the true fundamental, from beating it.
+    float findFundamental (const Frame& frame)
+    {
+        auto numLoudest = std::min (frame.numPartials, maxCandidates);
+
+        for (int i = 0; i < frame.numPartials; ++i)
+            order[(size_t) i] = i;
+
+        std::partial_sort (order.begin(), order.begin() + numLoudest, order.begin() + frame.numPartials,
+                           [&frame] (int a, int b)
+                           {
+                               auto& partials = frame.partials;
+                               return partials[(size_t) a].amplitude > partials[(size_t) b].amplitude
+                                   || (partials[(size_t) a].amplitude == partials[(size_t) b].amplitude && a < b);
+                           });
+
+        auto best = 0.0f, bestScore = 0.0f;
+
+        for (int i = 0; i < numLoudest; ++i)
+        {
+            for (int harmonic = 1; harmonic <= maxSubharmonic; ++harmonic)
+            {
+                auto candidate = frame.partials[(size_t) order[(size_t) i]].frequency / (float) harmonic;
+
+                if (candidate < minFundamental || candidate > maxFundamental)
+                    continue;
+
+                auto score = getHarmonicScore (frame, candidate);
+
+                if (score > bestScore)
+                {
+                    best = candidate;
+                    bestScore = score;
+                }
+            }
+        }
+
+        return best;
+    }
+
+    static float getHarmonicScore (const Frame& frame, float fundamental)
+    {
+        auto score = 0.0f;
+        auto inverse = 1.0f / fundamental;
+
+        for (int i = 0; i < frame.numPartials; ++i)
+        {
+            auto ratio = frame.partials[(size_t) i].frequency * inverse;
+            auto harmonic = floorToFloat (ratio + 0.5f);
+
+            if (harmonic >= 1.0f && std::abs (ratio - harmonic) < harmonicTolerance)
+                score += frame.partials[(size_t) i].amplitude / harmonic;
+        }
+
+        return score;
+    }
+};
+
+} // namespace resynth
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include "CoreMath.h"
+
+namespace resynth
+{
+
+// Granular sine resynthesis, as the plugin's GrainEngine does it, from a
+// pool of MaxGrains fixed at compile time: sounding grains on an active
+// list and the rest on a free list, both intrusive, so spawning and
+// retiring are O(1) and render() only walks the grains that sound. When the
+// pool is empty, new grains are skipped.
+//
+// Grain onsets are counted in whole samples and the parameters and target
+// only change at setParameters() and setTarget(), which the core calls on
+// frame boundaries, so the output is the same whatever size of blocks
+// render() is called with.
+template <int MaxGrains>
+class GrainCloud
+{
+public:
+    enum WindowShape
+    {
+        triangle = 0,
+        hann,
+        expodec,
+        numWindowShapes
+    };
+
+    void init (float newSampleRate)
+    {
+        sampleRate = newSampleRate;
+
+        for (int shape = 0; shape < numWindowShapes; ++shape)
+            fillWindow ((WindowShape) shape, windows[(size_t) shape]);
+
+        reset();
+    }
+
+    // Retires every grain at once, and stays silent until the next target
+    void reset()
+    {
+        frequency = 0.0f;
+        level = 0.0f;
+        freeList = nullptr;
+        activeList = nullptr;
+        numActive = 0;
+
+        for (auto& grain : pool)
+        {
+            grain.next = freeList;
+            freeList = &grain;
+        }
+
+        samplesUntilNextGrain = 0;
+        randomState = 0x9e3779b9u;
+    }
+
+    // All three are 0..1, as the plugin's parameters are. A density of zero
+    // stops new grains from being spawned.
+    void setParameters (float newDensity, float newWindow, float newSize)
+    {
+        density = newDensity;
+        windowShape = std::clamp ((int) (newWindow * (float) (numWindowShapes - 1) + 0.5f), 0, numWindowShapes - 1);
+        lengthInSamples = std::max (1.0f, minGrainSeconds * exp2 (newSize * log2SizeRange) * sampleRate);
+    }
+
+    // What new grains play. Grains already sounding keep their pitch.
+    void setTarget (float frequencyHz, float amplitude)
+    {
+        frequency = frequencyHz;
+        level = amplitude;
+    }
+
+    int getNumActive() const  { return numActive; }
+
+    // Adds numSamples of output, spawning grains on their exact samples
+    void render (float* output, int numSamples)
+    {
+        spawnGrains (numSamples);
+
+        Grain* previous = nullptr;
+
+        for (auto* grain = activeList; grain != nullptr;)
+        {
+            auto* next = grain->next;
+
+            if (renderGrain (*grain, output, numSamples))
+            {
+                previous = grain;
+            }
+            else
+            {
+                (previous != nullptr ? previous->next : activeList) = next;
+                grain->next = freeList;
+                freeList = grain;
+                --numActive;
+            }
+
+            grain = next;
+        }
+    }
+
+private:
+    static constexpr int windowSize = 512;
+    static constexpr int idleSpawnInterval = 32;
+    static constexpr float minGrainsPerSecond = 1.0f;
+    static constexpr float log2DensityRange = 11.9657843f;  // log2 (4000 / 1) grains per second
+    static constexpr float minGrainSeconds = 0.005f;
+    static constexpr float log2SizeRange = 6.64385619f;     // log2 (0.5 / 0.005) seconds
+
+    struct Grain
+    {
+        Grain* next = nullptr;
+        const float* window = nullptr;
+        float phase = 0.0f;        // normalised, -0.5..0.5
+        float increment = 0.0f;    // cycles per sample
+        float windowPosition = 0.0f;
+        float windowIncrement = 0.0f;
+        float amplitude = 0.0f;
+        int startOffset = 0;       // where in the current block it starts sounding
+    };
+
+    std::array<Grain, MaxGrains> pool {};
+    Grain* freeList = nullptr;
+    Grain* activeList = nullptr;
+    int numActive = 0;
+
+    // One guard point so interpolation can read one past the end
+    std::array<std::array<float, windowSize + 1>, numWindowShapes> windows {};
+
+    float sampleRate = 48000.0f;
+    int samplesUntilNextGrain = 0;
+    float density = 0.0f;
+    int windowShape = hann;
+    float lengthInSamples = 1.0f;
+    float frequency = 0.0f;
+    float level = 0.0f;
+    uint32_t randomState = 0x9e3779b9u;
+
+    static void fillWindow (WindowShape shape, std::array<float, windowSize + 1>& table)
+    {
+        for (int i = 0; i <= windowSize; ++i)
+        {
+            auto x = (float) i / (float) windowSize;
+            auto& value = table[(size_t) i];
+
+            switch (shape)
+            {
+                case triangle:  value = 1.0f - std::abs (2.0f * x - 1.0f); break;
+                case hann:      value = 0.5f - 0.5f * cosCycles (x); break;
+                case expodec:   value = std::min (1.0f, x * 50.0f) * exp (-5.0f * x); break;
+                case numWindowShapes:
+                default:        value = 0.0f; break;
+            }
+        }
+    }
+
+    // xorshift32, for jittering grain onsets so dense clouds don't comb
+    float nextRandom()
+    {
+        randomState ^= randomState << 13;
+        randomState ^= randomState >> 17;
+        randomState ^= randomState << 5;
+        return (float) (randomState >> 8) * (1.0f / 16777216.0f);
+    }
+
+    void spawnGrains (int numSamples)
+    {
+        if (frequency <= 0.0f)
+        {
+            samplesUntilNextGrain = std::max (0, samplesUntilNextGrain - numSamples);
+            return;
+        }
+
+        while (samplesUntilNextGrain < numSamples)
+        {
+            if (density <= 0.0f)
+            {
+                samplesUntilNextGrain += idleSpawnInterval;
+                continue;
+            }
+
+            auto meanInterval = sampleRate / (minGrainsPerSecond * exp2 (density * log2DensityRange));
+
+            // Keep the cloud's level roughly independent of how many grains overlap
+            auto overlap = std::max (1.0f, lengthInSamples / meanInterval);
+
+            if (freeList != nullptr)
+            {
+                auto* grain = freeList;
+                freeList = grain->next;
+
+                grain->window = windows[(size_t) windowShape].data();
+                grain->phase = 0.0f;
+                grain->increment = std::min (frequency / sampleRate, 0.49f);
+                grain->windowPosition = 0.0f;
+                grain->windowIncrement = (float) windowSize / lengthInSamples;
+                grain->amplitude = level / std::sqrt (overlap);
+                grain->startOffset = samplesUntilNextGrain;
+
+                grain->next = activeList;
+                activeList = grain;
+                ++numActive;
+            }
+
+            samplesUntilNextGrain += std::max (1, (int) (meanInterval * (0.5f + nextRandom())));
+        }
+
+        samplesUntilNextGrain -= numSamples;
+    }
+
+    // Returns false once the grain has played its whole window
+    static bool renderGrain (Grain& grain, float* output, int numSamples)
+    {
+        auto phase = grain.phase;
+        auto position = grain.windowPosition;
+        auto start = grain.startOffset;
+        auto end = numSamples;
+        auto finished = false;
+
+        for (int i = start; i < end; ++i)
+        {
+            if (position >= (float) windowSize)
+            {
+                finished = true;
+                break;
+            }
+
+            auto index = (int) position;
+            auto fraction = position - (float) index;
+            auto gain = grain.window[index] + fraction * (grain.window[index + 1] - grain.window[index]);
+
+            output[i] += fastSin (phase) * gain * grain.amplitude;
+
+            phase += grain.increment;
+            phase -= phase >= 0.5f ? 1.0f : 0.0f;
+            position += grain.windowIncrement;
+        }
+
+        grain.phase = phase;
+        grain.windowPosition = position;
+        grain.startOffset = 0;
+
+        return ! finished && position < (float) windowSize;
+    }
+};
+
+} // namespace resynth
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include "CoreMath.h"
+
+namespace resynth
+{
+
+// Resynthesis by partial tracking, as the plugin's PartialTracker does it:
+// up to MaxPartials persistent sine oscillators following the analysed
+// peaks. Each frame's partials are matched, loudest first, to the nearest
+// live track within a semitone; a partial with no track starts one from
+// silence, and a track left unmatched for deathFrames frames fades out and
+// is freed at a later frame.
+//
+// Frequency and amplitude glide to their targets by a one-pole step every
+// sample, and the tracks only change at addFrame(), so the output is the
+// same whatever size of blocks render() is called with. The tracks are kept
+// dense at the front of the arrays, so render() only touches the live ones.
+template <int MaxPartials>
+class PartialSynth
+{
+public:
+    void init (float newSampleRate)
+    {
+        sampleRate = newSampleRate;
+        amplitudeCoefficient = 1.0f - exp (-1.0f / (sampleRate * amplitudeSeconds));
+        setParameters (1.0f, 0.0f);
+        reset();
+    }
+
+    // Silences and frees every track at once
+    void reset()
+    {
+        tracks.fill ({});
+        numActive = 0;
+    }
+
+    // pitchRatio scales every frequency played, from the next frame on. drag
+    // (0..1) sets the glide time, up to maxGlideSeconds; at 0 tracks jump
+    // straight to each partial.
+    void setParameters (float newPitchRatio, float drag)
+    {
+        pitchRatio = newPitchRatio;
+        glideCoefficient = drag > 0.0f ? 1.0f - exp (-1.0f / (sampleRate * drag * maxGlideSeconds)) : 1.0f;
+    }
+
+    // Matches one frame's partials (anything with frequency and amplitude
+    // members, in Hz and linear gain) to the tracks
+    template <typename Partial>
+    void addFrame (const Partial* partials, int numPartials)
+    {
+        // Tracks that have faded out since the last frame make room first
+        for (int i = numActive; --i >= 0;)
+            if (tracks[(size_t) i].dying && tracks[(size_t) i].amplitude < silence)
+                tracks[(size_t) i] = tracks[(size_t) --numActive];
+
+        for (int i = 0; i < numActive; ++i)
+            tracks[(size_t) i].matched = false;
+
+        numPartials = std::min (numPartials, MaxPartials);
+
+        for (int i = 0; i < numPartials; ++i)
+            order[(size_t) i] = i;
+
+        std::sort (order.begin(), order.begin() + numPartials,
+                   [partials] (int a, int b)
+                   {
+                       // Ties in index order, so every standard library picks the same
+                       return partials[a].amplitude > partials[b].amplitude
+                           || (partials[a].amplitude == partials[b].amplitude && a < b);
+                   });
+
+        for (int i = 0; i < numPartials; ++i)
+        {
+            auto& partial = partials[order[(size_t) i]];
+
+            if (partial.frequency <= 0.0f || partial.amplitude <= 0.0f)
+                continue;
+
+            auto increment = getIncrement (partial.frequency);
+
+            if (auto* track = findNearestTrack (increment))
+            {
+                track->targetIncrement = increment;
+                track->targetAmplitude = partial.amplitude;
+                track->framesUnmatched = 0;
+                track->matched = true;
+            }
+            else if (numActive < MaxPartials)
+            {
+                auto& newTrack = tracks[(size_t) numActive++];
+                newTrack = {};
+                newTrack.increment = newTrack.targetIncrement = increment;
+                newTrack.targetAmplitude = partial.amplitude;
+                newTrack.matched = true;
+            }
+        }
+
+        for (int i = 0; i < numActive; ++i)
+        {
+            auto& track = tracks[(size_t) i];
+
+            if (! track.matched && ! track.dying && ++track.framesUnmatched >= deathFrames)
+            {
+                track.dying = true;
+                track.targetAmplitude = 0.0f;
+            }
+        }
+    }
+
+    // Adds every track to output
+    void render (float* output, int numSamples)
+    {
+        for (int t = 0; t < numActive; ++t)
+        {
+            auto& track = tracks[(size_t) t];
+            auto phase = track.phase, increment = track.increment, amplitude = track.amplitude;
+
+            for (int i = 0; i < numSamples; ++i)
+            {
+                increment += (track.targetIncrement - increment) * glideCoefficient;
+                amplitude += (track.targetAmplitude - amplitude) * amplitudeCoefficient;
+                phase += increment;
+                phase -= phase >= 0.5f ? 1.0f : 0.0f;
+                output[i] += fastSin (phase) * amplitude;
+            }
+
+            track.phase = phase;
+            track.increment = increment;
+            track.amplitude = amplitude;
+        }
+    }
+
+    int getNumActive() const  { return numActive; }
+
+private:
+    static constexpr float maxGlideSeconds = 0.5f;
+    static constexpr float amplitudeSeconds = 0.01f;
+    static constexpr float maxJumpRatio = 1.0594631f; // a semitone; further than this is a new note
+    static constexpr int deathFrames = 3;
+    static constexpr float silence = 1.0e-4f;
+
+    struct Track
+    {
+        float phase = 0.0f;        // normalised, -0.5..0.5
+        float increment = 0.0f, targetIncrement = 0.0f; // cycles per sample
+        float amplitude = 0.0f, targetAmplitude = 0.0f;
+        int framesUnmatched = 0;
+        bool matched = false;
+        bool dying = false;
+    };
+
+    std::array<Track, MaxPartials> tracks {};
+    std::array<int, MaxPartials> order {};
+    int numActive = 0;
+    float sampleRate = 48000.0f;
+    float pitchRatio = 1.0f;
+    float glideCoefficient = 1.0f;
+    float amplitudeCoefficient = 1.0f;
+
+    float getIncrement (float frequency) const
+    {
+        // Keep clear of Nyquist, where the sine would alias
+        return std::min (frequency * pitchRatio / sampleRate, 0.49f);
+    }
+
+    Track* findNearestTrack (float increment)
+    {
+        // Compared as ratios above 1, which order the same as cents
+        Track* nearest = nullptr;
+        auto nearestRatio = maxJumpRatio;
+
+        for (int i = 0; i < numActive; ++i)
+        {
+            auto& track = tracks[(size_t) i];
+
+            if (track.matched || track.dying)
+                continue;
+
+            auto ratio = increment > track.targetIncrement ? increment / track.targetIncrement
+                                                           : track.targetIncrement / increment;
+
+            if (ratio < nearestRatio)
+            {
+                nearest = &track;
+                nearestRatio = ratio;
+            }
+        }
+
+        return nearest;
+    }
+};
+
+} // namespace resynth
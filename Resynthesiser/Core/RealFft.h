@@ -0,0 +1,133 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include "CoreMath.h"
+
+namespace resynth
+{
+
+// Forward FFT of 2^Order real samples, for the core's analysis, in place of
+// juce::dsp::FFT. The real input is packed into a complex FFT of half the
+// size, which runs iteratively (radix 2, decimation in time) and is then
+// split into the real signal's spectrum. Every table is a member built by
+// the constructor, so an instance is all the memory it needs.
+template <int Order>
+class RealFft
+{
+public:
+    static_assert (Order >= 3 && Order <= 16, "RealFft sizes run from 8 to 65536");
+
+    static constexpr int size = 1 << Order;
+    static constexpr int numBins = size / 2 + 1;
+
+    RealFft()
+    {
+        for (int k = 0; k < half; ++k)
+        {
+            cosTable[(size_t) k] = cosCycles ((float) k / (float) size);
+            sinTable[(size_t) k] = sinCycles ((float) k / (float) size);
+        }
+
+        for (int i = 0; i < half; ++i)
+        {
+            auto reversed = 0;
+
+            for (int bit = 1, from = i; bit < half; bit <<= 1, from >>= 1)
+                reversed = (reversed << 1) | (from & 1);
+
+            bitReversed[(size_t) i] = (uint16_t) reversed;
+        }
+    }
+
+    // Transforms size samples of input into numBins complex bins, written to
+    // spectrum as interleaved real and imaginary parts (size + 2 floats).
+    // Unscaled, like juce::dsp::FFT. input and spectrum must not overlap.
+    void forward (const float* input, float* spectrum) const
+    {
+        // Even samples as the real parts, odd as the imaginary
+        for (int i = 0; i < half; ++i)
+        {
+            auto to = 2 * (int) bitReversed[(size_t) i];
+            spectrum[to] = input[2 * i];
+            spectrum[to + 1] = input[2 * i + 1];
+        }
+
+        for (int length = 2; length <= half; length <<= 1)
+        {
+            auto stride = 2 * (half / length); // into the size-point tables
+
+            for (int start = 0; start < half; start += length)
+            {
+                for (int j = 0; j < length / 2; ++j)
+                {
+                    auto c = cosTable[(size_t) (j * stride)];
+                    auto s = sinTable[(size_t) (j * stride)];
+                    auto* a = spectrum + 2 * (start + j);
+                    auto* b = spectrum + 2 * (start + j + length / 2);
+
+                    // b times e^(-i theta)
+                    auto real = b[0] * c + b[1] * s;
+                    auto imag = b[1] * c - b[0] * s;
+
+                    b[0] = a[0] - real;
+                    b[1] = a[1] - imag;
+                    a[0] += real;
+                    a[1] += imag;
+                }
+            }
+        }
+
+        split (spectrum);
+    }
+
+    // The magnitude of each bin of forward()'s output
+    static void getMagnitudes (const float* spectrum, float* magnitudes)
+    {
+        for (int k = 0; k < numBins; ++k)
+            magnitudes[k] = std::sqrt (spectrum[2 * k] * spectrum[2 * k] + spectrum[2 * k + 1] * spectrum[2 * k + 1]);
+    }
+
+private:
+    static constexpr int half = size / 2;
+
+    std::array<float, half> cosTable, sinTable; // of 2 pi k / size
+    std::array<uint16_t, half> bitReversed;
+
+    // Turns the half-size transform Z of the packed input into the real
+    // spectrum X, a pair of bins k and half - k at a time:
+    // X[k] = E + W^k O, X[half - k] = conj (E - W^k O), where
+    // E = (Z[k] + conj Z[half - k]) / 2 and O = (Z[k] - conj Z[half - k]) / 2i.
+    void split (float* spectrum) const
+    {
+        auto real0 = spectrum[0], imag0 = spectrum[1];
+        spectrum[0] = real0 + imag0;
+        spectrum[1] = 0.0f;
+        spectrum[2 * half] = real0 - imag0;
+        spectrum[2 * half + 1] = 0.0f;
+
+        for (int k = 1; k <= half / 2; ++k)
+        {
+            auto* a = spectrum + 2 * k;
+            auto* b = spectrum + 2 * (half - k);
+
+            auto evenReal = 0.5f * (a[0] + b[0]);
+            auto evenImag = 0.5f * (a[1] - b[1]);
+            auto oddReal = 0.5f * (a[1] + b[1]);
+            auto oddImag = -0.5f * (a[0] - b[0]);
+
+            auto c = cosTable[(size_t) k], s = sinTable[(size_t) k];
+            auto twiddledReal = c * oddReal + s * oddImag;
+            auto twiddledImag = c * oddImag - s * oddReal;
+
+            // Same bin when k is half / 2, where the first is the one kept
+            b[0] = evenReal - twiddledReal;
+            b[1] = twiddledImag - evenImag;
+            a[0] = evenReal + twiddledReal;
+            a[1] = evenImag + twiddledImag;
+        }
+    }
+};
+
+} // namespace resynth
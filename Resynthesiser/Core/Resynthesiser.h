@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include "FrameAnalyser.h"
+#include "GrainCloud.h"
+#include "PartialSynth.h"
+
+// The portable resynthesis core: the analysis and the partial and grain
+// synths with no JUCE, no threads, no allocation, no exceptions and no
+// virtual calls, for the Eurorack module as well as the plugin.
+//
+// Every buffer is a member whose size is fixed at compile time by the
+// template arguments, so the memory a configuration needs is
+// sizeof (Resynthesiser<...>): put it in static storage (or SDRAM) on the
+// module. init() builds the tables and is the only slow call; process() is
+// real-time safe from then on. The maths is float only and never calls the
+// C maths library (see CoreMath.h).
+namespace resynth
+{
+
+// Everything the core plays from, as the plugin's parameters give it
+struct Parameters
+{
+    float pitchRatio = 1.0f;   // applied to every partial
+    float drag = 0.5f;         // 0..1, the partials' glide time
+    float range = 1.0f;        // 0..1, the partials kept, from the first harmonic of the fundamental to all of them
+    float partialLevel = 1.0f;
+    float grainDensity = 0.0f; // 0..1, none at 0
+    float grainWindow = 0.5f;  // 0..1
+    float grainSize = 0.5f;    // 0..1
+};
+
+// Analyses frames of 2^FftOrder samples every hop, follows up to
+// MaxPartials of each frame's partials with the partial synth, and plays the
+// fundamental with up to MaxGrains grains.
+//
+// process() splits its block at every frame boundary, and the synths only
+// change there, so the output is the same bit for bit whatever the block
+// size (as long as the grain pool never runs out). Parameters are taken up
+// at the next frame for the same reason.
+template <int FftOrder, int MaxPartials, int MaxGrains>
+class Resynthesiser
+{
+public:
+    using Analyser = FrameAnalyser<FftOrder, MaxPartials>;
+
+    static constexpr int fftSize = Analyser::fftSize;
+
+    // Not real-time safe. hopSize is clamped to 1..fftSize.
+    void init (float newSampleRate, int newHopSize)
+    {
+        hopSize = std::clamp (newHopSize, 1, fftSize);
+        analyser.init (newSampleRate);
+        partials.init (newSampleRate);
+        grains.init (newSampleRate);
+        reset();
+    }
+
+    // Back to silence, with the first frame a hop away
+    void reset()
+    {
+        analyser.reset();
+        partials.reset();
+        grains.reset();
+        frame = {};
+        samplesUntilFrame = hopSize;
+        applyParameters();
+    }
+
+    // Taken up at the next frame
+    void setParameters (const Parameters& newParameters)
+    {
+        pending = newParameters;
+    }
+
+    // Writes numSamples of resynthesis of input to output, which may be the
+    // same buffer
+    void process (const float* input, float* output, int numSamples)
+    {
+        for (int position = 0; position < numSamples;)
+        {
+            auto count = std::min (numSamples - position, samplesUntilFrame);
+
+            analyser.write (input + position, count);
+
+            std::fill (output + position, output + position + count, 0.0f);
+            partials.render (output + position, count);
+
+            for (int i = position; i < position + count; ++i)
+                output[i] *= parameters.partialLevel;
+
+            grains.render (output + position, count);
+
+            position += count;
+            samplesUntilFrame -= count;
+
+            if (samplesUntilFrame == 0)
+            {
+                analyseFrame();
+                samplesUntilFrame = hopSize;
+            }
+        }
+    }
+
+    // The frame's centre, which the synths follow, trails the input by this much
+    static constexpr int getLatency()  { return Analyser::getLatency(); }
+
+    int getHopSize() const                      { return hopSize; }
+    int getNumActivePartials() const            { return partials.getNumActive(); }
+    int getNumActiveGrains() const              { return grains.getNumActive(); }
+    const typename Analyser::Frame& getLastFrame() const  { return frame; }
+
+private:
+    // The top of range, in harmonics, as the plugin's maxHarmonics
+    static constexpr int maxHarmonics = 64;
+
+    Analyser analyser;
+    PartialSynth<MaxPartials> partials;
+    GrainCloud<MaxGrains> grains;
+    typename Analyser::Frame frame;
+    Parameters parameters, pending;
+    int hopSize = fftSize / 4;
+    int samplesUntilFrame = fftSize / 4;
+
+    void applyParameters()
+    {
+        parameters = pending;
+        partials.setParameters (parameters.pitchRatio, parameters.drag);
+        grains.setParameters (parameters.grainDensity, parameters.grainWindow, parameters.grainSize);
+    }
+
+    void analyseFrame()
+    {
+        applyParameters();
+        analyser.analyse (frame);
+
+        // range keeps the first 1 to maxHarmonics harmonics of the fundamental,
+        // or everything at 1 or when no fundamental was found
+        auto numPartials = frame.numPartials;
+
+        if (parameters.range < 1.0f && frame.fundamental > 0.0f)
+        {
+            auto highest = (1.5f + parameters.range * (float) (maxHarmonics - 1)) * frame.fundamental;
+
+            while (numPartials > 0 && frame.partials[(size_t) numPartials - 1].frequency > highest)
+                --numPartials;
+        }
+
+        partials.addFrame (frame.partials.data(), numPartials);
+        grains.setTarget (frame.fundamental * parameters.pitchRatio, frame.level);
+    }
+};
+
+// The configuration the module is built for, and the plugin's "Core" engine
+// plays: 2048-point frames, 64 partials and 64 grains
+using ModuleResynthesiser = Resynthesiser<11, 64, 64>;
+
+} // namespace resynth
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Linear ADSR with the same shape as juce::ADSR, but rendered a block at a
+// time: each segment is written as one ramp, so there is no per-sample
+// state machine and no per-sample isActive() test. A sustain level of zero
+// counts as finished, since the note can no longer be heard.
+class BlockEnvelope
+{
+public:
+    struct Parameters
+    {
+        float attack = 0.1f, decay = 0.1f, sustain = 1.0f, release = 0.1f; // seconds, level
+    };
+
+    void setParameters (const Parameters& newParameters)
+    {
+        parameters = newParameters;
+        recalculateRates();
+    }
+
+    void setSampleRate (double newSampleRate)
+    {
+        sampleRate = newSampleRate;
+        recalculateRates();
+    }
+
+    void reset()
+    {
+        state = State::idle;
+        level = 0.0f;
+    }
+
+    void noteOn()
+    {
+        state = State::attack;
+    }
+
+    void noteOff()
+    {
+        if (state == State::idle)
+            return;
+
+        // Nothing to release from silence (a note off before any render), and
+        // a zero rate would never reach the end of the ramp
+        if (parameters.release > 0.0f && level > 0.0f)
+        {
+            releaseRate = level / (float) (parameters.release * sampleRate);
+            state = State::release;
+        }
+        else
+        {
+            reset();
+        }
+    }
+
+    // Where the last render() left off, 0-1
+    float getLevel() const
+    {
+        return level;
+    }
+
+    bool isActive() const
+    {
+        return state != State::idle && ! (state == State::sustain && level <= 0.0f);
+    }
+
+    // Writes numSamples gains to gains[0], gains[stride], ... and returns
+    // whether the envelope is still sounding at the end of the block.
+    bool render (float* gains, int numSamples, int stride = 1)
+    {
+        int i = 0;
+
+        while (i < numSamples)
+        {
+            switch (state)
+            {
+                case State::attack:   i = ramp (gains, i, numSamples, stride, attackRate, 1.0f, State::decay); break;
+                case State::decay:    i = ramp (gains, i, numSamples, stride, -decayRate, parameters.sustain, State::sustain); break;
+                case State::release:  i = ramp (gains, i, numSamples, stride, -releaseRate, 0.0f, State::idle); break;
+                case State::sustain:
+                case State::idle:
+                default:
+                    fill (gains, i, numSamples, stride, state == State::idle ? 0.0f : level);
+                    i = numSamples;
+                    break;
+            }
+        }
+
+        return isActive();
+    }
+
+private:
+    enum class State { idle, attack, decay, sustain, release };
+
+    State state = State::idle;
+    Parameters parameters;
+    double sampleRate = 44100.0;
+    float level = 0.0f;
+    float attackRate = 0.0f, decayRate = 0.0f, releaseRate = 0.0f;
+
+    void recalculateRates()
+    {
+        // Zero-length segments get an infinite rate and are skipped in one step
+        auto rate = [this] (float distance, float seconds)
+        {
+            return seconds > 0.0f && distance > 0.0f ? distance / (float) (seconds * sampleRate)
+                                                     : std::numeric_limits<float>::infinity();
+        };
+
+        attackRate = rate (1.0f, parameters.attack);
+        decayRate = rate (1.0f - parameters.sustain, parameters.decay);
+    }
+
+    // Ramps from the current level towards target at rate per sample, and
+    // moves to next once it gets there. Returns the first unwritten index.
+    int ramp (float* gains, int start, int numSamples, int stride, float rate, float target, State next)
+    {
+        auto samplesToTarget = std::ceil ((target - level) / rate);
+        auto remaining = samplesToTarget <= (float) numSamples ? std::max (0, (int) samplesToTarget) : numSamples + 1;
+        auto count = std::min (remaining, numSamples - start);
+        auto startLevel = level;
+
+        for (int i = 0; i < count; ++i)
+            gains[(start + i) * stride] = startLevel + rate * (float) (i + 1);
+
+        level = startLevel + rate * (float) count;
+
+        if (count == remaining)
+        {
+            level = target;
+            state = next;
+
+            if (count > 0)
+                gains[(start + count - 1) * stride] = target;
+        }
+
+        return start + count;
+    }
+
+    static void fill (float* gains, int start, int numSamples, int stride, float value)
+    {
+        for (int i = start; i < numSamples; ++i)
+            gains[i * stride] = value;
+    }
+};
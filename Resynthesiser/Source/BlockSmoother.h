@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Parameter smoothing rendered a block at a time. render() returns the
+// values for the next numSamples as an array, so the DSP reads a smoothed
+// parameter the same way it reads an audio buffer.
+//
+// Both shapes are written in closed form from a table built in prepare()
+// (the sample index for linear ramps, powers of the pole for exponential
+// ones), so the inner loop carries no dependency from one sample to the next
+// and vectorises. Once the target is reached the array is filled once and
+// handed back as is on every following block.
+class BlockSmoother
+{
+public:
+    enum Shape
+    {
+        linear = 0,  // reaches the target in exactly rampSeconds
+        exponential  // one-pole, within 1% of the target after rampSeconds
+    };
+
+    // Not real-time safe: sizes the ramp and its table.
+    void prepare (double sampleRate, int newMaxBlockSize, double rampSeconds, Shape newShape)
+    {
+        shape = newShape;
+        rampLength = std::max (1, (int) std::lround (rampSeconds * sampleRate));
+
+        auto pole = std::pow (0.01, 1.0 / rampLength);
+
+        ramp.assign ((size_t) newMaxBlockSize, 0.0f);
+        steps.resize ((size_t) newMaxBlockSize);
+
+        for (size_t i = 0; i < steps.size(); ++i)
+            steps[i] = shape == linear ? (float) (i + 1) : (float) std::pow (pole, (double) (i + 1));
+
+        reset (target);
+    }
+
+    // Jumps straight to value.
+    void reset (float value)
+    {
+        current = target = value;
+        samplesToTarget = 0;
+        numSettled = 0;
+    }
+
+    void setTarget (float newTarget)
+    {
+        if (newTarget == target)
+            return;
+
+        target = newTarget;
+        samplesToTarget = rampLength;
+        step = (target - current) / (float) rampLength;
+    }
+
+    bool isSmoothing() const       { return samplesToTarget > 0; }
+    float getCurrentValue() const  { return current; }
+    float getTargetValue() const   { return target; }
+    int getMaxBlockSize() const    { return (int) ramp.size(); }
+
+    // Advances by numSamples (no more than the prepared block size) and
+    // returns their values. The array stays valid until the next call.
+    const float* render (int numSamples)
+    {
+        auto* values = ramp.data();
+
+        if (! isSmoothing())
+        {
+            if (numSettled < numSamples)
+            {
+                std::fill (values, values + numSamples, current);
+                numSettled = numSamples;
+            }
+
+            return values;
+        }
+
+        numSettled = 0;
+
+        if (shape == linear)
+        {
+            auto count = std::min (numSamples, samplesToTarget);
+            auto start = current;
+
+            for (int i = 0; i < count; ++i)
+                values[i] = start + step * steps[(size_t) i];
+
+            samplesToTarget -= count;
+            current = samplesToTarget == 0 ? target : start + step * (float) count;
+            std::fill (values + count, values + numSamples, current);
+        }
+        else if (numSamples > 0)
+        {
+            auto distance = current - target;
+
+            for (int i = 0; i < numSamples; ++i)
+                values[i] = target + distance * steps[(size_t) i];
+
+            current = values[numSamples - 1];
+
+            if (std::abs (current - target) <= settledDistance)
+            {
+                current = target;
+                samplesToTarget = 0;
+            }
+        }
+
+        return values;
+    }
+
+    // Advances by numSamples, any number of them, without writing their
+    // values, and returns where that leaves the smoother. For parameters the
+    // DSP only reads once per block.
+    float skip (int numSamples)
+    {
+        while (isSmoothing() && numSamples > 0)
+        {
+            auto count = std::min (numSamples, getMaxBlockSize());
+
+            if (shape == linear)
+            {
+                count = std::min (count, samplesToTarget);
+                samplesToTarget -= count;
+                current = samplesToTarget == 0 ? target : current + step * (float) count;
+            }
+            else
+            {
+                current = target + (current - target) * steps[(size_t) count - 1];
+
+                if (std::abs (current - target) <= settledDistance)
+                {
+                    current = target;
+                    samplesToTarget = 0;
+                }
+            }
+
+            numSamples -= count;
+            numSettled = 0;
+        }
+
+        return current;
+    }
+
+private:
+    static constexpr float settledDistance = 1.0e-5f;
+
+    Shape shape = linear;
+    int rampLength = 1;
+    int samplesToTarget = 0;
+    int numSettled = 0;
+    float current = 0.0f, target = 0.0f, step = 0.0f;
+    std::vector<float> ramp, steps;
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#if defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+ #include <immintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+ #include <arm_neon.h>
+#endif
+
+// Lowpass FIR and downsampler by 2, 4 or 8, for analysing the low register
+// at a lower rate.
+//
+// The filter is a Blackman-windowed sinc, tapsPerPhase * factor taps long,
+// with its half-amplitude point at the new Nyquist. It passes everything up
+// to about 80% of the new Nyquist and is nearly 80 dB down by the frequency
+// that would alias onto it. Only every factor-th output is computed (the
+// polyphase form of the filter), so each input sample costs tapsPerPhase
+// multiply-adds whatever the factor. The dot products are vectorised with
+// SSE2 or NEON, otherwise plain scalar code.
+//
+// Nothing allocates. prepare() does the trig to design the filter, so call
+// it up front rather than per block.
+class Decimator
+{
+public:
+    static constexpr int tapsPerPhase = 32;
+    static constexpr int maxFactor = 8;
+    static constexpr int maxTaps = tapsPerPhase * maxFactor;
+
+    void prepare (int newFactor)
+    {
+        factor = std::clamp (newFactor, 1, maxFactor);
+        numTaps = tapsPerPhase * factor;
+
+        auto cutoff = 0.5 / factor; // cycles per input sample
+        auto centre = 0.5 * (numTaps - 1);
+        auto sum = 0.0;
+
+        for (int i = 0; i < numTaps; ++i)
+        {
+            auto t = i - centre;
+            auto sinc = 2.0 * cutoff * (t == 0.0 ? 1.0 : std::sin (twoPi * cutoff * t) / (twoPi * cutoff * t));
+            auto phase = twoPi * i / (numTaps - 1);
+            auto window = 0.42 - 0.5 * std::cos (phase) + 0.08 * std::cos (2.0 * phase);
+
+            // Reversed, so the dot product runs forwards over the input
+            taps[(size_t) (numTaps - 1 - i)] = (float) (sinc * window);
+            sum += sinc * window;
+        }
+
+        // Unity gain at DC
+        for (int i = 0; i < numTaps; ++i)
+            taps[(size_t) i] = (float) (taps[(size_t) i] / sum);
+
+        reset();
+    }
+
+    void reset()
+    {
+        history.fill (0.0f);
+        phase = 0;
+    }
+
+    int getFactor() const  { return factor; }
+
+    // Input samples between a sample going in and its filtered value coming out
+    int getLatency() const  { return numTaps / 2; }
+
+    // Filters numSamples of input and writes one output for every factor
+    // inputs, carrying the remainder over to the next call. Returns the
+    // number of outputs written, at most (numSamples + factor - 1) / factor.
+    int process (const float* input, int numSamples, float* output)
+    {
+        int numOutputs = 0;
+
+        while (numSamples > 0)
+        {
+            auto count = std::min (numSamples, blockSize);
+            std::copy (input, input + count, history.begin() + numTaps - 1);
+
+            // The window for an output ends on the input sample it falls on
+            for (int i = factor - 1 - phase; i < count; i += factor)
+                output[numOutputs++] = dotProduct (history.data() + i, taps.data(), numTaps);
+
+            phase = (phase + count) % factor;
+
+            std::copy (history.begin() + count, history.begin() + count + numTaps - 1, history.begin());
+            input += count;
+            numSamples -= count;
+        }
+
+        return numOutputs;
+    }
+
+    static float dotProduct (const float* x, const float* y, int n)
+    {
+        int i = 0;
+        auto sum = 0.0f;
+
+       #if defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+        auto acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+
+        for (; i + 8 <= n; i += 8)
+        {
+            acc0 = _mm_add_ps (acc0, _mm_mul_ps (_mm_loadu_ps (x + i),     _mm_loadu_ps (y + i)));
+            acc1 = _mm_add_ps (acc1, _mm_mul_ps (_mm_loadu_ps (x + i + 4), _mm_loadu_ps (y + i + 4)));
+        }
+
+        alignas (16) float lanes[4];
+        _mm_store_ps (lanes, _mm_add_ps (acc0, acc1));
+        sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+       #elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+        auto acc0 = vdupq_n_f32 (0.0f), acc1 = vdupq_n_f32 (0.0f);
+
+        for (; i + 8 <= n; i += 8)
+        {
+            acc0 = vmlaq_f32 (acc0, vld1q_f32 (x + i),     vld1q_f32 (y + i));
+            acc1 = vmlaq_f32 (acc1, vld1q_f32 (x + i + 4), vld1q_f32 (y + i + 4));
+        }
+
+        auto acc = vaddq_f32 (acc0, acc1);
+        sum = (vgetq_lane_f32 (acc, 0) + vgetq_lane_f32 (acc, 1)) + (vgetq_lane_f32 (acc, 2) + vgetq_lane_f32 (acc, 3));
+       #endif
+
+        for (; i < n; ++i)
+            sum += x[i] * y[i];
+
+        return sum;
+    }
+
+private:
+    static constexpr double twoPi = 6.283185307179586;
+    static constexpr int blockSize = 1024;
+
+    int factor = 1;
+    int numTaps = tapsPerPhase;
+    int phase = 0; // inputs since the last output
+    std::array<float, maxTaps> taps {};
+
+    // The last numTaps - 1 inputs, followed by up to blockSize new ones
+    std::array<float, maxTaps - 1 + blockSize> history {};
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Anything that happens at a given sample within a block.
+struct ScheduledEvent
+{
+    enum Type : uint8_t
+    {
+        noteOn = 0,   // host MIDI; the note played is taken from the analysis
+        noteOff,      // host MIDI
+        onset,        // detected in the input, played at the analysed fundamental
+        midi          // any other host MIDI, handed to the synth unchanged
+    };
+
+    Type type = noteOn;
+    uint8_t note = 0;
+    float velocity = 0.0f;  // 0-1
+    int sampleOffset = 0;   // within the block
+    std::array<uint8_t, 3> midiData {}; // raw bytes, midi events only
+    uint8_t midiSize = 0;
+};
+
+// A block's events, kept ordered by sample offset as they are added. Events
+// at the same offset stay in the order they were added, so host MIDI keeps
+// its order. Storage is fixed: add() never allocates, and an event that
+// doesn't fit is dropped and counted.
+class EventScheduler
+{
+public:
+    static constexpr size_t capacity = 1024;
+
+    void clear()  { numEvents = 0; }
+
+    bool add (const ScheduledEvent& event)
+    {
+        if (numEvents == capacity)
+        {
+            ++dropped;
+            return false;
+        }
+
+        // Nearly always an append: host MIDI arrives in order and generated
+        // events are few
+        auto index = numEvents++;
+
+        for (; index > 0 && events[index - 1].sampleOffset > event.sampleOffset; --index)
+            events[index] = events[index - 1];
+
+        events[index] = event;
+        return true;
+    }
+
+    const ScheduledEvent* begin() const  { return events.data(); }
+    const ScheduledEvent* end() const    { return events.data() + numEvents; }
+    size_t size() const                  { return numEvents; }
+
+    uint32_t getNumDropped() const       { return dropped; }
+
+private:
+    std::array<ScheduledEvent, capacity> events;
+    size_t numEvents = 0;
+    uint32_t dropped = 0;
+};
+
+// Holds a stream of events back by a fixed number of samples, so the notes
+// come out in step with the latency reported to the host, and by then the
+// analysis has seen them. Events go in with the block they arrived in and
+// come back out, at their new offsets, in the block they fall due in.
+//
+// A ring of fixed size, nothing allocated. An event that doesn't fit is
+// dropped and counted. When the delay changes, everything still held is
+// released at the start of the block the change arrives in, rather than
+// reordered.
+class EventDelayLine
+{
+public:
+    static constexpr size_t capacity = 1024;
+
+    void clear()  { readIndex = writeIndex = 0; }
+
+    // Moves the block's events, which start at blockStart (in samples since
+    // prepare), into the line, then puts back the ones due in this block.
+    void process (EventScheduler& events, uint64_t blockStart, int numSamples, int newDelay)
+    {
+        // Whatever is held under the old delay goes out first
+        auto flushEnd = newDelay != delay ? writeIndex : readIndex;
+        delay = newDelay;
+
+        for (auto& event : events)
+        {
+            if (writeIndex - readIndex == capacity)
+            {
+                ++dropped;
+                continue;
+            }
+
+            pending[writeIndex++ % capacity] = { blockStart + (uint64_t) event.sampleOffset + (uint64_t) delay, event };
+        }
+
+        events.clear();
+
+        // The delay is the same for everything held, so they fall due in order
+        auto blockEnd = blockStart + (uint64_t) numSamples;
+
+        for (; readIndex != writeIndex; ++readIndex)
+        {
+            auto& entry = pending[readIndex % capacity];
+            auto flushed = readIndex < flushEnd;
+
+            if (entry.due >= blockEnd && ! flushed)
+                break;
+
+            auto event = entry.event;
+            event.sampleOffset = flushed || entry.due <= blockStart ? 0 : (int) (entry.due - blockStart);
+            events.add (event);
+        }
+    }
+
+    uint32_t getNumDropped() const  { return dropped; }
+
+private:
+    struct Entry
+    {
+        uint64_t due = 0; // sample position it is played at
+        ScheduledEvent event;
+    };
+
+    std::array<Entry, capacity> pending;
+    size_t readIndex = 0, writeIndex = 0;
+    int delay = 0;
+    uint32_t dropped = 0;
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "OscillatorBank.h"
+
+// Granular sine resynthesis driven by the grainDensity, grainWindow and
+// grainSize parameters.
+//
+// Every grain lives in a fixed pool sized in prepare(). Free grains are kept
+// on an intrusive singly linked free list and sounding grains on an active
+// list, so spawning and retiring a grain are both O(1) pointer swaps and
+// render() only ever walks the grains that are sounding. Window shapes are
+// precomputed tables. Nothing on the audio thread allocates.
+class GrainEngine
+{
+public:
+    enum WindowShape
+    {
+        triangle = 0,
+        hann,
+        gaussian,
+        tukey,
+        expodec,
+        numWindowShapes
+    };
+
+    static constexpr int defaultMaxGrains = 4096;
+
+    // Not real-time safe: sizes the pool and builds the window tables.
+    void prepare (double newSampleRate, int newMaxGrains = defaultMaxGrains)
+    {
+        sampleRate = newSampleRate;
+        pool.assign ((size_t) newMaxGrains, Grain {});
+
+        for (int shape = 0; shape < numWindowShapes; ++shape)
+            fillWindow ((WindowShape) shape, windows[(size_t) shape]);
+
+        reset();
+    }
+
+    // Retires every grain at once.
+    void reset()
+    {
+        freeList = nullptr;
+        activeList = nullptr;
+        numActive = 0;
+
+        for (auto& grain : pool)
+        {
+            grain.next = freeList;
+            freeList = &grain;
+        }
+
+        samplesUntilNextGrain = 0.0;
+    }
+
+    // All three are 0..1 as they come from the parameters, and hold for
+    // every render() that isn't given curves. A density of zero stops new
+    // grains from being spawned.
+    void setParameters (float density, float window, float size)
+    {
+        densityValue = density;
+        windowValue = window;
+        sizeValue = size;
+    }
+
+    // What new grains should play. Grains already sounding keep their pitch.
+    void setTarget (float frequencyHz, float amplitude)
+    {
+        frequency = frequencyHz;
+        level = amplitude;
+    }
+
+    int getNumActive() const  { return numActive; }
+
+    // Adds numSamples of output, spawning grains at their exact sample offsets.
+    void render (float* output, int numSamples)
+    {
+        render (output, numSamples, &densityValue, &windowValue, &sizeValue, 0);
+    }
+
+    // The same, with the parameters given per sample (e.g. smoothing ramps).
+    // Each grain takes its shape and size from the curves at its onset.
+    void render (float* output, int numSamples, const float* density, const float* window, const float* size)
+    {
+        render (output, numSamples, density, window, size, 1);
+    }
+
+private:
+    static constexpr int windowSize = 1024;
+    static constexpr int idleSpawnInterval = 32;
+    static constexpr float minGrainsPerSecond = 1.0f, maxGrainsPerSecond = 4000.0f;
+    static constexpr float minGrainSeconds = 0.005f, maxGrainSeconds = 0.5f;
+
+    struct Grain
+    {
+        Grain* next = nullptr;
+        const float* window = nullptr;
+        float phase = 0.0f;        // normalised, -0.5..0.5
+        float increment = 0.0f;    // cycles per sample
+        float windowPosition = 0.0f;
+        float windowIncrement = 0.0f;
+        float amplitude = 0.0f;
+        int startOffset = 0;       // where in the current block it starts sounding
+    };
+
+    std::vector<Grain> pool;
+    Grain* freeList = nullptr;
+    Grain* activeList = nullptr;
+    int numActive = 0;
+
+    // One guard point so interpolation can read one past the end
+    std::array<std::array<float, windowSize + 1>, numWindowShapes> windows {};
+
+    double sampleRate = 44100.0;
+    double samplesUntilNextGrain = 0.0;
+    float densityValue = 0.5f, windowValue = 0.5f, sizeValue = 0.5f;
+    float frequency = 0.0f;
+    float level = 0.0f;
+    uint32_t randomState = 0x9e3779b9u;
+
+    // A stride of 0 reads the same value for every sample
+    void render (float* output, int numSamples, const float* density, const float* window, const float* size, int stride)
+    {
+        spawnGrains (numSamples, density, window, size, stride);
+
+        Grain* previous = nullptr;
+
+        for (auto* grain = activeList; grain != nullptr;)
+        {
+            auto* next = grain->next;
+
+            if (renderGrain (*grain, output, numSamples))
+            {
+                previous = grain;
+            }
+            else
+            {
+                // Retire: unlink from the active list, push onto the free list
+                (previous != nullptr ? previous->next : activeList) = next;
+                grain->next = freeList;
+                freeList = grain;
+                --numActive;
+            }
+
+            grain = next;
+        }
+    }
+
+    static void fillWindow (WindowShape shape, std::array<float, windowSize + 1>& table)
+    {
+        const auto pi = 3.14159265f;
+
+        for (int i = 0; i <= windowSize; ++i)
+        {
+            auto x = (float) i / windowSize;
+            auto& value = table[(size_t) i];
+
+            switch (shape)
+            {
+                case triangle:  value = 1.0f - std::abs (2.0f * x - 1.0f); break;
+                case hann:      value = 0.5f - 0.5f * std::cos (2.0f * pi * x); break;
+                case gaussian:  value = std::exp (-0.5f * std::pow ((x - 0.5f) / 0.15f, 2.0f)); break;
+                case tukey:     value = x < 0.25f ? 0.5f - 0.5f * std::cos (4.0f * pi * x)
+                                      : x > 0.75f ? 0.5f - 0.5f * std::cos (4.0f * pi * (1.0f - x)) : 1.0f; break;
+                case expodec:   value = std::min (1.0f, x * 50.0f) * std::exp (-5.0f * x); break;
+                case numWindowShapes:
+                default:        value = 0.0f; break;
+            }
+        }
+    }
+
+    // xorshift32, for jittering grain onsets so dense clouds don't comb
+    float nextRandom()
+    {
+        randomState ^= randomState << 13;
+        randomState ^= randomState >> 17;
+        randomState ^= randomState << 5;
+        return (float) (randomState >> 8) * (1.0f / 16777216.0f);
+    }
+
+    void spawnGrains (int numSamples, const float* density, const float* window, const float* size, int stride)
+    {
+        if (frequency <= 0.0f)
+        {
+            samplesUntilNextGrain = std::max (0.0, samplesUntilNextGrain - numSamples);
+            return;
+        }
+
+        while (samplesUntilNextGrain < numSamples)
+        {
+            auto onset = (int) samplesUntilNextGrain * stride;
+
+            // Switched off here: look again a little later
+            if (density[onset] <= 0.0f)
+            {
+                samplesUntilNextGrain = std::floor (samplesUntilNextGrain) + idleSpawnInterval;
+                continue;
+            }
+
+            auto grainsPerSecond = minGrainsPerSecond * std::pow (maxGrainsPerSecond / minGrainsPerSecond, density[onset]);
+            auto meanInterval = sampleRate / grainsPerSecond;
+            auto lengthInSamples = std::max (1.0f, minGrainSeconds * std::pow (maxGrainSeconds / minGrainSeconds, size[onset]) * (float) sampleRate);
+            auto windowShape = std::clamp ((int) std::lround (window[onset] * (numWindowShapes - 1)), 0, numWindowShapes - 1);
+
+            // Keep the cloud's level roughly independent of how many grains overlap
+            auto overlap = std::max (1.0f, lengthInSamples / (float) meanInterval);
+            auto amplitude = level / std::sqrt (overlap);
+
+            if (freeList != nullptr)
+            {
+                auto* grain = freeList;
+                freeList = grain->next;
+
+                grain->window = windows[(size_t) windowShape].data();
+                grain->phase = 0.0f;
+                grain->increment = (float) (frequency / sampleRate);
+                grain->windowPosition = 0.0f;
+                grain->windowIncrement = (float) windowSize / lengthInSamples;
+                grain->amplitude = amplitude;
+                grain->startOffset = (int) samplesUntilNextGrain;
+
+                grain->next = activeList;
+                activeList = grain;
+                ++numActive;
+            }
+
+            samplesUntilNextGrain += meanInterval * (0.5 + nextRandom());
+        }
+
+        samplesUntilNextGrain -= numSamples;
+    }
+
+    // Returns false once the grain has played its whole window.
+    static bool renderGrain (Grain& grain, float* output, int numSamples)
+    {
+        auto phase = grain.phase;
+        auto position = grain.windowPosition;
+        auto remaining = (int) std::ceil (((float) windowSize - position) / grain.windowIncrement);
+        auto start = grain.startOffset;
+        auto end = std::min (numSamples, start + remaining);
+
+        for (int i = start; i < end; ++i)
+        {
+            auto index = std::min ((int) position, windowSize - 1);
+            auto fraction = position - (float) index;
+            auto gain = grain.window[index] + fraction * (grain.window[index + 1] - grain.window[index]);
+
+            output[i] += OscillatorBank::fastSin (phase) * gain * grain.amplitude;
+
+            phase += grain.increment;
+            phase -= phase >= 0.5f ? 1.0f : 0.0f;
+            position += grain.windowIncrement;
+        }
+
+        grain.phase = phase;
+        grain.windowPosition = position;
+        grain.startOffset = 0;
+
+        return end - start < remaining;
+    }
+};
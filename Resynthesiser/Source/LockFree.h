@@ -0,0 +1,156 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Single-producer / single-consumer ring with a fixed, power-of-two capacity.
+// Both sides are wait-free: push and pop are a couple of atomic loads and one
+// release store, with no locks and no allocation, so the audio thread can be
+// either end of it.
+template <typename T, size_t Capacity>
+class SpscRing
+{
+    static_assert ((Capacity & (Capacity - 1)) == 0, "SpscRing capacity must be a power of two");
+
+public:
+    // Copies an item in. Returns false (and leaves the ring untouched) when full.
+    bool push (const T& item)
+    {
+        if (auto* slot = beginWrite())
+        {
+            *slot = item;
+            finishWrite();
+            return true;
+        }
+
+        return false;
+    }
+
+    // Copies the oldest item out. Returns false when empty.
+    bool pop (T& item)
+    {
+        if (auto* slot = beginRead())
+        {
+            item = *slot;
+            finishRead();
+            return true;
+        }
+
+        return false;
+    }
+
+    // In-place access for large items: the producer fills the slot returned by
+    // beginWrite() and publishes it with finishWrite(); the consumer reads the
+    // slot from beginRead() and hands it back with finishRead().
+    T* beginWrite()
+    {
+        auto write = writeIndex.load (std::memory_order_relaxed);
+
+        if (write - readIndex.load (std::memory_order_acquire) == Capacity)
+            return nullptr;
+
+        return &items[write & (Capacity - 1)];
+    }
+
+    void finishWrite()
+    {
+        writeIndex.store (writeIndex.load (std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    const T* beginRead() const
+    {
+        auto read = readIndex.load (std::memory_order_relaxed);
+
+        if (read == writeIndex.load (std::memory_order_acquire))
+            return nullptr;
+
+        return &items[read & (Capacity - 1)];
+    }
+
+    void finishRead()
+    {
+        readIndex.store (readIndex.load (std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    size_t getNumReady() const
+    {
+        return writeIndex.load (std::memory_order_acquire) - readIndex.load (std::memory_order_acquire);
+    }
+
+    // Only safe while neither side is running.
+    void reset()
+    {
+        writeIndex.store (0);
+        readIndex.store (0);
+    }
+
+    static constexpr size_t capacity = Capacity;
+
+private:
+    std::array<T, Capacity> items {};
+    alignas (64) std::atomic<size_t> writeIndex { 0 };
+    alignas (64) std::atomic<size_t> readIndex { 0 };
+};
+
+// Publishes a small trivially-copyable snapshot from one writer to any number
+// of readers. The writer never waits; readers retry if they raced a store,
+// so neither side can block the other. The payload is held as atomic words
+// so a torn read is detected rather than being a data race.
+template <typename T>
+class Seqlock
+{
+    static_assert (std::is_trivially_copyable<T>::value, "Seqlock payload must be trivially copyable");
+
+public:
+    Seqlock()
+    {
+        store (T {});
+    }
+
+    void store (const T& value)
+    {
+        std::array<uint32_t, numWords> words {};
+        std::memcpy (words.data(), &value, sizeof (T));
+
+        auto seq = sequence.load (std::memory_order_relaxed);
+        sequence.store (seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_release);
+
+        for (size_t i = 0; i < numWords; ++i)
+            data[i].store (words[i], std::memory_order_relaxed);
+
+        sequence.store (seq + 2, std::memory_order_release);
+    }
+
+    T load() const
+    {
+        std::array<uint32_t, numWords> words {};
+        uint32_t before, after;
+
+        do
+        {
+            before = sequence.load (std::memory_order_acquire);
+
+            for (size_t i = 0; i < numWords; ++i)
+                words[i] = data[i].load (std::memory_order_relaxed);
+
+            std::atomic_thread_fence (std::memory_order_acquire);
+            after = sequence.load (std::memory_order_relaxed);
+        }
+        while ((before & 1) != 0 || before != after);
+
+        T value;
+        std::memcpy (static_cast<void*> (&value), words.data(), sizeof (T));
+        return value;
+    }
+
+private:
+    static constexpr size_t numWords = (sizeof (T) + sizeof (uint32_t) - 1) / sizeof (uint32_t);
+
+    std::atomic<uint32_t> sequence { 0 };
+    std::array<std::atomic<uint32_t>, numWords> data;
+};
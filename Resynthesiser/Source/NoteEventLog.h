@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include "LockFree.h"
+
+// One note the processor played or released, as plain data so it can be
+// recorded on the audio thread without building any strings.
+struct NoteEvent
+{
+    enum Type : uint8_t
+    {
+        noteOn = 0,     // from incoming MIDI
+        noteOff,
+        onset           // triggered by an onset detected in the input
+    };
+
+    Type type = noteOn;
+    uint8_t note = 0;         // the note actually played (noteOn: the analysed note, not the one received)
+    uint8_t velocity = 0;     // 0-127; onsets scale the input level to the same range
+    int32_t sampleOffset = 0; // within the block the event happened in
+    float frequency = 0.0f;   // analysed fundamental when the event happened, in Hz
+    uint64_t blockPosition = 0; // input samples processed before that block
+    uint8_t channel = 0;      // input channel analysed, or 0 for the downmix
+};
+
+// Audio thread pushes, message thread pops. When the editor is closed or
+// slow the newest events are dropped and counted rather than blocking.
+class NoteEventLog
+{
+public:
+    void push (const NoteEvent& event)
+    {
+        if (! events.push (event))
+            dropped.fetch_add (1, std::memory_order_relaxed);
+    }
+
+    // Message thread only.
+    bool pop (NoteEvent& event)  { return events.pop (event); }
+
+    uint32_t getNumDropped() const  { return dropped.load (std::memory_order_relaxed); }
+
+private:
+    SpscRing<NoteEvent, 512> events;
+    std::atomic<uint32_t> dropped { 0 };
+};
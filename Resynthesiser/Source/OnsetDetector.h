@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#if defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+ #include <immintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+ #include <arm_neon.h>
+#endif
+
+// Streaming onset detector for the audio thread.
+//
+// Two detection functions feed it. The energy envelope is computed here, in
+// sub-frames of 64 samples: an onset is a rise in level, in dB, between
+// successive sub-frames that clears an adaptive threshold. Its position is
+// then refined to the first sample of the sub-frame that reaches half its
+// peak. Spectral flux comes from the analyser, which already has each
+// frame's magnitudes (see spectralFlux()). It catches the changes of note
+// that don't change the level, but arrives a frame late, so its onsets are
+// placed at the start of the next block.
+//
+// Each function has its own threshold: a floor, or the running mean plus a
+// couple of mean deviations of recent values, whichever is higher. After an
+// onset, nothing fires again for 50 ms.
+//
+// The kernels are the only per-sample work, vectorised with SSE2 or NEON,
+// otherwise plain scalar code. No allocation, no locks.
+class OnsetDetector
+{
+public:
+    static constexpr int subFrameSize = 64;
+
+    struct Onset
+    {
+        int sampleOffset = 0;  // within the block passed to process()
+        float level = 0.0f;    // RMS of the sub-frame that triggered it
+    };
+
+    void prepare (double sampleRate)
+    {
+        refractorySamples = (int64_t) (sampleRate * refractorySeconds);
+
+        // Thresholds follow roughly the last half second of sub-frames
+        energyThreshold.smoothing = 1.0f - std::exp (-(float) subFrameSize / (float) (sampleRate * thresholdSeconds));
+        fluxThreshold.smoothing = 0.1f;
+
+        reset();
+    }
+
+    void reset()
+    {
+        subFrameEnergy = 0.0f;
+        subFrameFill = 0;
+        previousLevelDb = silenceDb;
+        lastRms = 0.0f;
+        position = 0;
+        lastOnsetPosition = -refractorySamples;
+        fluxOnsetPending = false;
+        energyThreshold.reset();
+        fluxThreshold.reset();
+    }
+
+    // One spectral flux value per analysed frame, in order, as popped by the
+    // audio thread. An onset it detects is reported by the next process().
+    void addSpectralFlux (float flux)
+    {
+        if (previousLevelDb > gateDb && fluxThreshold.isExceededBy (flux, minimumFlux))
+            fluxOnsetPending = true;
+
+        fluxThreshold.update (flux);
+    }
+
+    // Scans the next block of input and writes up to maxOnsets onsets, in
+    // order. Returns how many were written.
+    int process (const float* input, int numSamples, Onset* onsets, int maxOnsets)
+    {
+        int numOnsets = 0;
+
+        if (fluxOnsetPending && canTrigger (0) && numOnsets < maxOnsets)
+        {
+            onsets[numOnsets++] = { 0, lastRms };
+            lastOnsetPosition = position;
+        }
+
+        fluxOnsetPending = false;
+
+        for (int i = 0; i < numSamples;)
+        {
+            auto count = std::min (subFrameSize - subFrameFill, numSamples - i);
+            subFrameEnergy += sumOfSquares (input + i, count);
+            subFrameFill += count;
+            i += count;
+
+            if (subFrameFill < subFrameSize)
+                break;
+
+            auto meanSquare = subFrameEnergy / (float) subFrameSize;
+            auto levelDb = 10.0f * std::log10 (meanSquare + 1.0e-12f);
+            auto rise = std::max (0.0f, levelDb - previousLevelDb);
+
+            subFrameEnergy = 0.0f;
+            subFrameFill = 0;
+            previousLevelDb = levelDb;
+            lastRms = std::sqrt (meanSquare);
+
+            if (levelDb > gateDb && energyThreshold.isExceededBy (rise, minimumRiseDb) && numOnsets < maxOnsets)
+            {
+                // The part of the sub-frame that fell in an earlier block is
+                // already gone, so the onset can't land before this block
+                auto start = std::max (0, i - subFrameSize);
+                auto offset = start + findAttack (input + start, i - start);
+
+                if (canTrigger (offset))
+                {
+                    onsets[numOnsets++] = { offset, lastRms };
+                    lastOnsetPosition = position + offset;
+                }
+            }
+
+            energyThreshold.update (rise);
+        }
+
+        position += numSamples;
+        return numOnsets;
+    }
+
+    // Sum of the squares of n samples
+    static float sumOfSquares (const float* x, int n)
+    {
+        int i = 0;
+        auto sum = 0.0f;
+
+       #if defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+        auto acc = _mm_setzero_ps();
+
+        for (; i + 4 <= n; i += 4)
+        {
+            auto v = _mm_loadu_ps (x + i);
+            acc = _mm_add_ps (acc, _mm_mul_ps (v, v));
+        }
+
+        sum = horizontalSum (acc);
+       #elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+        auto acc = vdupq_n_f32 (0.0f);
+
+        for (; i + 4 <= n; i += 4)
+        {
+            auto v = vld1q_f32 (x + i);
+            acc = vmlaq_f32 (acc, v, v);
+        }
+
+        sum = horizontalSum (acc);
+       #endif
+
+        for (; i < n; ++i)
+            sum += x[i] * x[i];
+
+        return sum;
+    }
+
+    // Half-wave rectified spectral flux between two magnitude spectra,
+    // normalised by the current frame's total magnitude so it doesn't
+    // depend on level: 0 for a steady spectrum, towards 1 when everything
+    // in the frame is new.
+    static float spectralFlux (const float* magnitudes, const float* previousMagnitudes, int numBins)
+    {
+        int i = 0;
+        auto rise = 0.0f, total = 0.0f;
+
+       #if defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+        auto riseAcc = _mm_setzero_ps(), totalAcc = _mm_setzero_ps();
+        const auto zero = _mm_setzero_ps();
+
+        for (; i + 4 <= numBins; i += 4)
+        {
+            auto current = _mm_loadu_ps (magnitudes + i);
+            riseAcc = _mm_add_ps (riseAcc, _mm_max_ps (_mm_sub_ps (current, _mm_loadu_ps (previousMagnitudes + i)), zero));
+            totalAcc = _mm_add_ps (totalAcc, current);
+        }
+
+        rise = horizontalSum (riseAcc);
+        total = horizontalSum (totalAcc);
+       #elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+        auto riseAcc = vdupq_n_f32 (0.0f), totalAcc = vdupq_n_f32 (0.0f);
+        const auto zero = vdupq_n_f32 (0.0f);
+
+        for (; i + 4 <= numBins; i += 4)
+        {
+            auto current = vld1q_f32 (magnitudes + i);
+            riseAcc = vaddq_f32 (riseAcc, vmaxq_f32 (vsubq_f32 (current, vld1q_f32 (previousMagnitudes + i)), zero));
+            totalAcc = vaddq_f32 (totalAcc, current);
+        }
+
+        rise = horizontalSum (riseAcc);
+        total = horizontalSum (totalAcc);
+       #endif
+
+        for (; i < numBins; ++i)
+        {
+            rise += std::max (0.0f, magnitudes[i] - previousMagnitudes[i]);
+            total += magnitudes[i];
+        }
+
+        return total > 1.0e-6f ? rise / total : 0.0f;
+    }
+
+private:
+    static constexpr double refractorySeconds = 0.05;
+    static constexpr double thresholdSeconds = 0.5;
+    static constexpr float silenceDb = -120.0f;
+    static constexpr float gateDb = -60.0f;      // nothing quieter than this starts a note
+    static constexpr float minimumRiseDb = 6.0f; // per sub-frame
+    static constexpr float minimumFlux = 0.15f;
+    static constexpr float sensitivity = 2.0f;   // mean deviations above the mean
+
+    // Running mean and mean absolute deviation of a detection function
+    struct AdaptiveThreshold
+    {
+        float smoothing = 0.1f;
+        float mean = 0.0f, deviation = 0.0f;
+
+        void reset()  { mean = deviation = 0.0f; }
+
+        bool isExceededBy (float value, float floor) const
+        {
+            return value > std::max (floor, mean + sensitivity * deviation);
+        }
+
+        void update (float value)
+        {
+            mean += smoothing * (value - mean);
+            deviation += smoothing * (std::abs (value - mean) - deviation);
+        }
+    };
+
+    int64_t refractorySamples = 0;
+    AdaptiveThreshold energyThreshold, fluxThreshold;
+
+    float subFrameEnergy = 0.0f;
+    int subFrameFill = 0;
+    float previousLevelDb = silenceDb;
+    float lastRms = 0.0f;
+    int64_t position = 0;          // samples processed before the current block
+    int64_t lastOnsetPosition = 0;
+    bool fluxOnsetPending = false;
+
+    bool canTrigger (int offset) const
+    {
+        return position + offset - lastOnsetPosition >= refractorySamples;
+    }
+
+    // First sample that reaches half the peak of the run
+    static int findAttack (const float* x, int n)
+    {
+        auto peak = 0.0f;
+
+        for (int i = 0; i < n; ++i)
+            peak = std::max (peak, std::abs (x[i]));
+
+        for (int i = 0; i < n; ++i)
+            if (std::abs (x[i]) >= 0.5f * peak)
+                return i;
+
+        return 0;
+    }
+
+   #if defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+    static float horizontalSum (__m128 v)
+    {
+        alignas (16) float lanes[4];
+        _mm_store_ps (lanes, v);
+        return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    }
+   #elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+    static float horizontalSum (float32x4_t v)
+    {
+        return (vgetq_lane_f32 (v, 0) + vgetq_lane_f32 (v, 1)) + (vgetq_lane_f32 (v, 2) + vgetq_lane_f32 (v, 3));
+    }
+   #endif
+};
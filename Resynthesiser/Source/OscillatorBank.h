@@ -0,0 +1,468 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#if defined (__AVX512F__) || defined (__AVX__) || defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+ #include <immintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+ #include <arm_neon.h>
+#endif
+
+// Additive bank of sine partials, stored as structure-of-arrays and
+// rendered several partials per instruction.
+//
+// Phases are kept normalised to [-0.5, 0.5) cycles and turned into a sine
+// by folding into a quarter period and evaluating an odd polynomial, so
+// there is no table, no std::sin and no per-partial branch. The vector
+// width is chosen at compile time: 16 lanes with AVX-512, 8 with AVX, 4
+// with SSE2 or NEON, otherwise plain scalar code.
+//
+// Partials live in a dense prefix of the arrays so render() only touches
+// the ones that are sounding. Callers hold a stable handle; removing a
+// partial moves the last one into its place and fixes up the handle map.
+class OscillatorBank
+{
+public:
+    // Size all arrays up front. Not real-time safe, everything else is.
+    void prepare (int newMaxPartials)
+    {
+        maxPartials = newMaxPartials;
+        auto paddedSize = (size_t) ((maxPartials + lanes - 1) / lanes * lanes);
+
+        for (auto* array : { &phases, &increments, &targetIncrements, &amplitudes, &targetAmplitudes })
+            array->assign (paddedSize, 0.0f);
+
+        unitGains.assign (paddedSize, 1.0f);
+
+        slotForHandle.assign ((size_t) maxPartials, -1);
+        handleForSlot.assign ((size_t) maxPartials, -1);
+        freeHandles.resize ((size_t) maxPartials);
+
+        for (int i = 0; i < maxPartials; ++i)
+            freeHandles[(size_t) i] = maxPartials - 1 - i;
+
+        numFreeHandles = maxPartials;
+        numActive = 0;
+    }
+
+    // Starts a silent partial. increment is in cycles per sample, i.e.
+    // frequency / sampleRate. Returns -1 if the bank is full.
+    int addPartial (float increment, float initialPhase = 0.0f)
+    {
+        if (numFreeHandles == 0)
+            return -1;
+
+        auto handle = freeHandles[(size_t) --numFreeHandles];
+        auto slot = (size_t) numActive++;
+
+        phases[slot] = initialPhase - std::floor (initialPhase + 0.5f);
+        increments[slot] = increment;
+        targetIncrements[slot] = increment;
+        amplitudes[slot] = 0.0f;
+        targetAmplitudes[slot] = 0.0f;
+
+        slotForHandle[(size_t) handle] = (int) slot;
+        handleForSlot[slot] = handle;
+        return handle;
+    }
+
+    void removePartial (int handle)
+    {
+        auto slot = slotForHandle[(size_t) handle];
+        auto last = --numActive;
+
+        if (slot != last)
+        {
+            phases[(size_t) slot] = phases[(size_t) last];
+            increments[(size_t) slot] = increments[(size_t) last];
+            targetIncrements[(size_t) slot] = targetIncrements[(size_t) last];
+            amplitudes[(size_t) slot] = amplitudes[(size_t) last];
+            targetAmplitudes[(size_t) slot] = targetAmplitudes[(size_t) last];
+
+            auto movedHandle = handleForSlot[(size_t) last];
+            handleForSlot[(size_t) slot] = movedHandle;
+            slotForHandle[(size_t) movedHandle] = slot;
+        }
+
+        // Keep the padding lanes silent
+        amplitudes[(size_t) last] = 0.0f;
+        targetAmplitudes[(size_t) last] = 0.0f;
+        increments[(size_t) last] = 0.0f;
+        targetIncrements[(size_t) last] = 0.0f;
+
+        slotForHandle[(size_t) handle] = -1;
+        handleForSlot[(size_t) last] = -1;
+        freeHandles[(size_t) numFreeHandles++] = handle;
+    }
+
+    // Jumps straight to an increment, without a ramp.
+    void setIncrement (int handle, float increment)
+    {
+        auto slot = (size_t) slotForHandle[(size_t) handle];
+        increments[slot] = increment;
+        targetIncrements[slot] = increment;
+    }
+
+    // The increment ramps linearly to its target over the next render()
+    // call, so the frequency glides sample by sample.
+    void setTargetIncrement (int handle, float increment)
+    {
+        targetIncrements[(size_t) slotForHandle[(size_t) handle]] = increment;
+    }
+
+    float getIncrement (int handle) const
+    {
+        return increments[(size_t) slotForHandle[(size_t) handle]];
+    }
+
+    // The amplitude ramps linearly to its target over the next render() call.
+    void setTargetAmplitude (int handle, float amplitude)
+    {
+        targetAmplitudes[(size_t) slotForHandle[(size_t) handle]] = amplitude;
+    }
+
+    // Jumps straight to an amplitude, without a ramp.
+    void setAmplitude (int handle, float amplitude)
+    {
+        auto slot = (size_t) slotForHandle[(size_t) handle];
+        amplitudes[slot] = amplitude;
+        targetAmplitudes[slot] = amplitude;
+    }
+
+    float getAmplitude (int handle) const
+    {
+        return amplitudes[(size_t) slotForHandle[(size_t) handle]];
+    }
+
+    // Where a partial currently sits in the arrays. Stable until the next
+    // removePartial(), so it can index a per-block gain matrix.
+    int getSlot (int handle) const  { return slotForHandle[(size_t) handle]; }
+
+    int getNumActive() const        { return numActive; }
+    int getMaxPartials() const      { return maxPartials; }
+
+    // Length of the arrays once padded to a whole number of vectors. A gain
+    // matrix row passed to render() needs at least this many columns.
+    int getCapacity() const         { return (int) phases.size(); }
+
+    // Adds the sum of all active partials to output.
+    //
+    // If gains is given, each partial is also multiplied by a per-sample gain
+    // read from gains[sample * gainStride + slot], which lets envelopes be
+    // applied exactly while still rendering all partials together.
+    void render (float* output, int numSamples, const float* gains = nullptr, int gainStride = 0)
+    {
+        renderSlots (output, numSamples, gains, gainStride, 0, numActive, scratch);
+        finishRender();
+    }
+
+    // Per-sample partial sums, one vector per sample, reduced once per chunk.
+    // Each thread rendering with renderSlots() needs its own.
+    struct Scratch
+    {
+        alignas (64) std::array<float, 256 * 16> laneSums {};
+    };
+
+    // A run of slots passed to renderSlots() starts on a multiple of this,
+    // so it starts on a vector whatever the vector width
+    static constexpr int slotAlignment = 16;
+
+    // Adds the sum of the active partials in slots [firstSlot, endSlot) to
+    // output, as render() does. Disjoint runs can be rendered on different
+    // threads at the same time, each with its own scratch; once every run
+    // has been, call finishRender() once.
+    void renderSlots (float* output, int numSamples, const float* gains, int gainStride,
+                      int firstSlot, int endSlot, Scratch& threadScratch)
+    {
+        if (gains == nullptr)
+        {
+            gains = unitGains.data();
+            gainStride = 0;
+        }
+
+        auto firstGroup = firstSlot / lanes;
+        auto endGroup = (std::min (endSlot, numActive) + lanes - 1) / lanes;
+        auto* laneSums = threadScratch.laneSums.data();
+
+        if (firstGroup >= endGroup || numSamples <= 0)
+            return;
+
+        for (int start = 0; start < numSamples; start += chunkSize)
+        {
+            auto chunk = std::min (chunkSize, numSamples - start);
+            auto rampScale = 1.0f / (float) (numSamples - start);
+            std::fill (laneSums, laneSums + chunk * lanes, 0.0f);
+
+            for (int group = firstGroup; group < endGroup; ++group)
+                renderGroup (laneSums, group * lanes, chunk, rampScale, gains + start * gainStride, gainStride);
+
+            reduceLanes (laneSums, output + start, chunk);
+        }
+    }
+
+    // Land exactly on the targets, whatever rounding the ramp picked up
+    void finishRender()
+    {
+        finishSlots (0, numActive);
+    }
+
+    // As finishRender(), for the slots in [firstSlot, endSlot) only, so each
+    // thread can land the run it rendered
+    void finishSlots (int firstSlot, int endSlot)
+    {
+        auto first = firstSlot / lanes * lanes;
+        auto end = (std::min (endSlot, numActive) + lanes - 1) / lanes * lanes;
+
+        if (first >= end)
+            return;
+
+        std::copy (targetAmplitudes.begin() + first, targetAmplitudes.begin() + end, amplitudes.begin() + first);
+        std::copy (targetIncrements.begin() + first, targetIncrements.begin() + end, increments.begin() + first);
+    }
+
+    // Both targets of the partial in a slot, for a thread rendering a run of
+    // slots without the handles
+    void setSlotTargets (int slot, float increment, float amplitude)
+    {
+        targetIncrements[(size_t) slot] = increment;
+        targetAmplitudes[(size_t) slot] = amplitude;
+    }
+
+    // The sine used by render(), for one normalised phase in [-0.5, 0.5).
+    static float fastSin (float phase)
+    {
+        auto folded = phase > 0.25f ? 0.5f - phase : (phase < -0.25f ? -0.5f - phase : phase);
+        auto squared = folded * folded;
+        return folded * (c1 + squared * (c3 + squared * (c5 + squared * (c7 + squared * c9))));
+    }
+
+private:
+   #if defined (__AVX512F__)
+    static constexpr int lanes = 16;
+   #elif defined (__AVX__)
+    static constexpr int lanes = 8;
+   #elif defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP) || defined (__ARM_NEON) || defined (__ARM_NEON__)
+    static constexpr int lanes = 4;
+   #else
+    static constexpr int lanes = 1;
+   #endif
+
+    static constexpr int chunkSize = 256;
+    static_assert (chunkSize * lanes <= (int) std::tuple_size<decltype (Scratch::laneSums)>::value, "Scratch too small");
+    static_assert (slotAlignment % lanes == 0, "Slot runs must start on a vector");
+
+    // Taylor series of sin (2 pi x) to x^9, max error about 4e-6 over a quarter period
+    static constexpr float twoPi = 6.283185307f;
+    static constexpr float c1 = twoPi;
+    static constexpr float c3 = -c1 * twoPi * twoPi / 6.0f;
+    static constexpr float c5 = -c3 * twoPi * twoPi / 20.0f;
+    static constexpr float c7 = -c5 * twoPi * twoPi / 42.0f;
+    static constexpr float c9 = -c7 * twoPi * twoPi / 72.0f;
+
+    int maxPartials = 0;
+    int numActive = 0;
+    int numFreeHandles = 0;
+
+    std::vector<float> phases, increments, targetIncrements, amplitudes, targetAmplitudes, unitGains;
+    std::vector<int> slotForHandle, handleForSlot, freeHandles;
+
+    Scratch scratch;
+
+    static void reduceLanes (const float* laneSums, float* output, int numSamples)
+    {
+        for (int i = 0; i < numSamples; ++i)
+        {
+            auto sum = 0.0f;
+
+            for (int lane = 0; lane < lanes; ++lane)
+                sum += laneSums[i * lanes + lane];
+
+            output[i] += sum;
+        }
+    }
+
+   #if defined (__AVX512F__)
+    void renderGroup (float* laneSums, int first, int numSamples, float rampScale, const float* gains, int gainStride)
+    {
+        auto phase = _mm512_loadu_ps (phases.data() + first);
+        auto increment = _mm512_loadu_ps (increments.data() + first);
+        auto amplitude = _mm512_loadu_ps (amplitudes.data() + first);
+        auto step = _mm512_mul_ps (_mm512_sub_ps (_mm512_loadu_ps (targetAmplitudes.data() + first), amplitude), _mm512_set1_ps (rampScale));
+        auto incrementStep = _mm512_mul_ps (_mm512_sub_ps (_mm512_loadu_ps (targetIncrements.data() + first), increment), _mm512_set1_ps (rampScale));
+
+        const auto half = _mm512_set1_ps (0.5f), quarter = _mm512_set1_ps (0.25f), one = _mm512_set1_ps (1.0f);
+        const auto signMask = _mm512_set1_epi32 ((int) 0x80000000);
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            auto sign = _mm512_and_si512 (_mm512_castps_si512 (phase), signMask);
+            auto absolute = _mm512_abs_ps (phase);
+            auto mirrored = _mm512_sub_ps (_mm512_castsi512_ps (_mm512_or_si512 (sign, _mm512_castps_si512 (half))), phase);
+            auto folded = _mm512_mask_blend_ps (_mm512_cmp_ps_mask (absolute, quarter, _CMP_GT_OQ), phase, mirrored);
+
+            auto squared = _mm512_mul_ps (folded, folded);
+            auto poly = _mm512_fmadd_ps (squared, _mm512_set1_ps (c9), _mm512_set1_ps (c7));
+            poly = _mm512_fmadd_ps (squared, poly, _mm512_set1_ps (c5));
+            poly = _mm512_fmadd_ps (squared, poly, _mm512_set1_ps (c3));
+            poly = _mm512_fmadd_ps (squared, poly, _mm512_set1_ps (c1));
+
+            auto* sums = laneSums + i * lanes;
+            auto gain = _mm512_loadu_ps (gains + i * gainStride + first);
+            _mm512_store_ps (sums, _mm512_fmadd_ps (_mm512_mul_ps (folded, poly), _mm512_mul_ps (amplitude, gain), _mm512_load_ps (sums)));
+
+            amplitude = _mm512_add_ps (amplitude, step);
+            phase = _mm512_add_ps (phase, increment);
+            increment = _mm512_add_ps (increment, incrementStep);
+            phase = _mm512_mask_sub_ps (phase, _mm512_cmp_ps_mask (phase, half, _CMP_GE_OQ), phase, one);
+        }
+
+        _mm512_storeu_ps (phases.data() + first, phase);
+        _mm512_storeu_ps (amplitudes.data() + first, amplitude);
+        _mm512_storeu_ps (increments.data() + first, increment);
+    }
+   #elif defined (__AVX__)
+    void renderGroup (float* laneSums, int first, int numSamples, float rampScale, const float* gains, int gainStride)
+    {
+        auto phase = _mm256_loadu_ps (phases.data() + first);
+        auto increment = _mm256_loadu_ps (increments.data() + first);
+        auto amplitude = _mm256_loadu_ps (amplitudes.data() + first);
+        auto step = _mm256_mul_ps (_mm256_sub_ps (_mm256_loadu_ps (targetAmplitudes.data() + first), amplitude), _mm256_set1_ps (rampScale));
+        auto incrementStep = _mm256_mul_ps (_mm256_sub_ps (_mm256_loadu_ps (targetIncrements.data() + first), increment), _mm256_set1_ps (rampScale));
+
+        const auto half = _mm256_set1_ps (0.5f), quarter = _mm256_set1_ps (0.25f), one = _mm256_set1_ps (1.0f);
+        const auto signMask = _mm256_set1_ps (-0.0f);
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            auto sign = _mm256_and_ps (phase, signMask);
+            auto absolute = _mm256_andnot_ps (signMask, phase);
+            auto mirrored = _mm256_sub_ps (_mm256_or_ps (sign, half), phase);
+            auto folded = _mm256_blendv_ps (phase, mirrored, _mm256_cmp_ps (absolute, quarter, _CMP_GT_OQ));
+
+            auto squared = _mm256_mul_ps (folded, folded);
+            auto poly = _mm256_add_ps (_mm256_mul_ps (squared, _mm256_set1_ps (c9)), _mm256_set1_ps (c7));
+            poly = _mm256_add_ps (_mm256_mul_ps (squared, poly), _mm256_set1_ps (c5));
+            poly = _mm256_add_ps (_mm256_mul_ps (squared, poly), _mm256_set1_ps (c3));
+            poly = _mm256_add_ps (_mm256_mul_ps (squared, poly), _mm256_set1_ps (c1));
+
+            auto* sums = laneSums + i * lanes;
+            auto gain = _mm256_loadu_ps (gains + i * gainStride + first);
+            _mm256_store_ps (sums, _mm256_add_ps (_mm256_load_ps (sums), _mm256_mul_ps (_mm256_mul_ps (folded, poly), _mm256_mul_ps (amplitude, gain))));
+
+            amplitude = _mm256_add_ps (amplitude, step);
+            phase = _mm256_add_ps (phase, increment);
+            increment = _mm256_add_ps (increment, incrementStep);
+            phase = _mm256_sub_ps (phase, _mm256_and_ps (_mm256_cmp_ps (phase, half, _CMP_GE_OQ), one));
+        }
+
+        _mm256_storeu_ps (phases.data() + first, phase);
+        _mm256_storeu_ps (amplitudes.data() + first, amplitude);
+        _mm256_storeu_ps (increments.data() + first, increment);
+    }
+   #elif defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+    void renderGroup (float* laneSums, int first, int numSamples, float rampScale, const float* gains, int gainStride)
+    {
+        auto phase = _mm_loadu_ps (phases.data() + first);
+        auto increment = _mm_loadu_ps (increments.data() + first);
+        auto amplitude = _mm_loadu_ps (amplitudes.data() + first);
+        auto step = _mm_mul_ps (_mm_sub_ps (_mm_loadu_ps (targetAmplitudes.data() + first), amplitude), _mm_set1_ps (rampScale));
+        auto incrementStep = _mm_mul_ps (_mm_sub_ps (_mm_loadu_ps (targetIncrements.data() + first), increment), _mm_set1_ps (rampScale));
+
+        const auto half = _mm_set1_ps (0.5f), quarter = _mm_set1_ps (0.25f), one = _mm_set1_ps (1.0f);
+        const auto signMask = _mm_set1_ps (-0.0f);
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            auto sign = _mm_and_ps (phase, signMask);
+            auto absolute = _mm_andnot_ps (signMask, phase);
+            auto mirrored = _mm_sub_ps (_mm_or_ps (sign, half), phase);
+            auto fold = _mm_cmpgt_ps (absolute, quarter);
+            auto folded = _mm_or_ps (_mm_and_ps (fold, mirrored), _mm_andnot_ps (fold, phase));
+
+            auto squared = _mm_mul_ps (folded, folded);
+            auto poly = _mm_add_ps (_mm_mul_ps (squared, _mm_set1_ps (c9)), _mm_set1_ps (c7));
+            poly = _mm_add_ps (_mm_mul_ps (squared, poly), _mm_set1_ps (c5));
+            poly = _mm_add_ps (_mm_mul_ps (squared, poly), _mm_set1_ps (c3));
+            poly = _mm_add_ps (_mm_mul_ps (squared, poly), _mm_set1_ps (c1));
+
+            auto* sums = laneSums + i * lanes;
+            auto gain = _mm_loadu_ps (gains + i * gainStride + first);
+            _mm_store_ps (sums, _mm_add_ps (_mm_load_ps (sums), _mm_mul_ps (_mm_mul_ps (folded, poly), _mm_mul_ps (amplitude, gain))));
+
+            amplitude = _mm_add_ps (amplitude, step);
+            phase = _mm_add_ps (phase, increment);
+            increment = _mm_add_ps (increment, incrementStep);
+            phase = _mm_sub_ps (phase, _mm_and_ps (_mm_cmpge_ps (phase, half), one));
+        }
+
+        _mm_storeu_ps (phases.data() + first, phase);
+        _mm_storeu_ps (amplitudes.data() + first, amplitude);
+        _mm_storeu_ps (increments.data() + first, increment);
+    }
+   #elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+    void renderGroup (float* laneSums, int first, int numSamples, float rampScale, const float* gains, int gainStride)
+    {
+        auto phase = vld1q_f32 (phases.data() + first);
+        auto increment = vld1q_f32 (increments.data() + first);
+        auto amplitude = vld1q_f32 (amplitudes.data() + first);
+        auto step = vmulq_n_f32 (vsubq_f32 (vld1q_f32 (targetAmplitudes.data() + first), amplitude), rampScale);
+        auto incrementStep = vmulq_n_f32 (vsubq_f32 (vld1q_f32 (targetIncrements.data() + first), increment), rampScale);
+
+        const auto half = vdupq_n_f32 (0.5f), quarter = vdupq_n_f32 (0.25f), one = vdupq_n_f32 (1.0f);
+        const auto signMask = vdupq_n_u32 (0x80000000u);
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            auto sign = vandq_u32 (vreinterpretq_u32_f32 (phase), signMask);
+            auto mirrored = vsubq_f32 (vreinterpretq_f32_u32 (vorrq_u32 (sign, vreinterpretq_u32_f32 (half))), phase);
+            auto folded = vbslq_f32 (vcagtq_f32 (phase, quarter), mirrored, phase);
+
+            auto squared = vmulq_f32 (folded, folded);
+            auto poly = vmlaq_f32 (vdupq_n_f32 (c7), squared, vdupq_n_f32 (c9));
+            poly = vmlaq_f32 (vdupq_n_f32 (c5), squared, poly);
+            poly = vmlaq_f32 (vdupq_n_f32 (c3), squared, poly);
+            poly = vmlaq_f32 (vdupq_n_f32 (c1), squared, poly);
+
+            auto* sums = laneSums + i * lanes;
+            auto gain = vld1q_f32 (gains + i * gainStride + first);
+            vst1q_f32 (sums, vmlaq_f32 (vld1q_f32 (sums), vmulq_f32 (folded, poly), vmulq_f32 (amplitude, gain)));
+
+            amplitude = vaddq_f32 (amplitude, step);
+            phase = vaddq_f32 (phase, increment);
+            increment = vaddq_f32 (increment, incrementStep);
+            phase = vsubq_f32 (phase, vreinterpretq_f32_u32 (vandq_u32 (vcgeq_f32 (phase, half), vreinterpretq_u32_f32 (one))));
+        }
+
+        vst1q_f32 (phases.data() + first, phase);
+        vst1q_f32 (amplitudes.data() + first, amplitude);
+        vst1q_f32 (increments.data() + first, increment);
+    }
+   #else
+    void renderGroup (float* laneSums, int first, int numSamples, float rampScale, const float* gains, int gainStride)
+    {
+        auto phase = phases[(size_t) first];
+        auto amplitude = amplitudes[(size_t) first];
+        auto step = (targetAmplitudes[(size_t) first] - amplitude) * rampScale;
+        auto increment = increments[(size_t) first];
+        auto incrementStep = (targetIncrements[(size_t) first] - increment) * rampScale;
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            laneSums[i] += fastSin (phase) * amplitude * gains[i * gainStride + first];
+            amplitude += step;
+            phase += increment;
+            increment += incrementStep;
+
+            if (phase >= 0.5f)
+                phase -= 1.0f;
+        }
+
+        phases[(size_t) first] = phase;
+        amplitudes[(size_t) first] = amplitude;
+        increments[(size_t) first] = increment;
+    }
+   #endif
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "BlockSmoother.h"
+
+// The audio thread's view of the plugin parameters.
+//
+// The std::atomic<float>* behind every parameter is looked up once, at
+// construction, so processBlock never hashes a parameter ID. update() takes
+// one snapshot per block (a single relaxed load per parameter) and hands the
+// new values to the smoothers. The continuous parameters come first in Id
+// and only they are smoothed: the DSP reads either a per-sample ramp from
+// getRamp() or, where it takes a value once per block, advance(). Choices
+// and switches are read from the snapshot. Nothing here allocates after
+// prepare().
+class ParameterLayer
+{
+public:
+    enum Id
+    {
+        fundamental = 0,
+        drag,
+        range,
+        grainDensity,
+        grainWindow,
+        grainSize,
+        hopSize,
+        pitchEstimator,
+        engine,
+        fftSize,
+        lowLatency,
+        decimation,
+        analysisInput,
+        voiceStealing,
+        parallelRender,
+        maxPitches,
+        snapshotMode,
+        numParameters
+    };
+
+    // fundamental to grainSize
+    static constexpr int numSmoothed = grainSize + 1;
+
+    static constexpr double rampSeconds = 0.02;
+
+    explicit ParameterLayer (juce::AudioProcessorValueTreeState& state)
+    {
+        static constexpr const char* ids[numParameters] {
+            "fundamental", "drag", "range", "grainDensity", "grainWindow", "grainSize", "hopSize", "pitchEstimator", "engine", "fftSize", "lowLatency", "decimation", "analysisInput", "voiceStealing", "parallelRender", "maxPitches", "snapshotMode"
+        };
+
+        for (int i = 0; i < numParameters; ++i)
+        {
+            handles[(size_t) i] = state.getRawParameterValue (ids[i]);
+            jassert (handles[(size_t) i] != nullptr);
+        }
+    }
+
+    // Not real-time safe. Ramps start out settled on the current values.
+    void prepare (double sampleRate, int maxBlockSize)
+    {
+        update();
+
+        for (int i = 0; i < numSmoothed; ++i)
+        {
+            auto& smoother = smoothers[(size_t) i];
+            smoother.prepare (sampleRate, juce::jmax (maxBlockSize, 1), rampSeconds, getShape ((Id) i));
+            smoother.reset (snapshot[(size_t) i]);
+        }
+    }
+
+    int getMaxBlockSize() const  { return smoothers[0].getMaxBlockSize(); }
+
+    // Takes this block's snapshot. Call once at the top of processBlock.
+    void update()
+    {
+        for (size_t i = 0; i < handles.size(); ++i)
+            snapshot[i] = handles[i]->load (std::memory_order_relaxed);
+
+        for (size_t i = 0; i < smoothers.size(); ++i)
+            smoothers[i].setTarget (snapshot[i]);
+    }
+
+    // The unsmoothed value from the last update()
+    float get (Id id) const      { return snapshot[(size_t) id]; }
+    int getIndex (Id id) const   { return (int) snapshot[(size_t) id]; }
+
+    // The next numSamples (at most getMaxBlockSize()) of a parameter's ramp.
+    // Each call advances that parameter's smoother, so read each ramp once
+    // per stretch of audio.
+    const float* getRamp (Id id, int numSamples)
+    {
+        jassert (id < numSmoothed);
+        return smoothers[(size_t) id].render (numSamples);
+    }
+
+    // Advances a parameter's smoother by numSamples (any number) and returns
+    // its value at the end of them, for DSP that takes it once per block.
+    // Like getRamp(), once per stretch of audio.
+    float advance (Id id, int numSamples)
+    {
+        jassert (id < numSmoothed);
+        return smoothers[(size_t) id].skip (numSamples);
+    }
+
+    // The smoothed value as of the last getRamp() or advance()
+    float getSmoothed (Id id) const
+    {
+        jassert (id < numSmoothed);
+        return smoothers[(size_t) id].getCurrentValue();
+    }
+
+private:
+    std::array<std::atomic<float>*, numParameters> handles {};
+    std::array<float, numParameters> snapshot {};
+    std::array<BlockSmoother, numSmoothed> smoothers;
+
+    // The fundamental glides towards its target, everything else ramps
+    // linearly so a move lands in a fixed time.
+    static BlockSmoother::Shape getShape (Id id)
+    {
+        return id == fundamental ? BlockSmoother::exponential : BlockSmoother::linear;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (ParameterLayer)
+};
@@ -0,0 +1,505 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+#include "OscillatorBank.h"
+#include "PeakExtractor.h"
+#include "WorkerPool.h"
+
+// Resynthesis by partial tracking: a fixed set of persistent oscillators
+// that follow the analysed peaks, rather than notes retriggered on the
+// synth.
+//
+// Each analysis frame's peaks are matched to the live tracks, loudest
+// first, to the nearest track within a semitone. A matched track glides
+// to its peak. A peak with no track starts one, fading in from silence at
+// the peak's frequency, unless all maxTracks are live. A track left
+// unmatched for deathFrames frames fades out and is freed. Nothing is
+// retriggered while the pitch only drifts, so there is no envelope reset
+// and no voice stealing.
+//
+// The live tracks are kept dense at the front of the array, so only they
+// are visited. Matching looks each peak up in the tracks sorted by
+// frequency, skipping the ones already taken, so a frame of P peaks and
+// N tracks costs O((P + N) log N) rather than O(P N).
+//
+// Glides are exponential in frequency, with a time set by drag. Every
+// glideStep samples the glide is advanced and handed to the bank as a
+// target, and the bank ramps each oscillator's increment and amplitude to
+// it sample by sample. The steps are counted across render() calls, so
+// glides and fades take the same time whatever the block size. A track
+// that has faded out ramps to silence over one last step, and is freed
+// after the span that finishes it.
+//
+// All oscillators render together in the OscillatorBank, in spans of up to
+// spanSize samples. The targets for every step in a span are worked out
+// first; then the bank is rendered in fixed runs of slotsPerTask partials,
+// each into a row of its own, and the rows summed in order. Given a
+// WorkerPool the runs are shared out among its threads, so the output
+// never depends on the pool or which thread took which run. No allocation
+// after prepare().
+class PartialTracker
+{
+public:
+    // As many as the analyser extracts, so a frame's peaks all reach the bank
+    static constexpr int maxTracks = PeakFrame::maxPeaks;
+    static constexpr int glideStep = 32;
+
+    // A track starting or ending, reported by addFrame()
+    struct Change
+    {
+        bool born = false;
+        float frequency = 0.0f;
+        float amplitude = 0.0f;
+    };
+
+    // Not real-time safe
+    void prepare (double newSampleRate)
+    {
+        sampleRate = newSampleRate;
+        bank.prepare (maxTracks);
+
+        auto maxTasks = (bank.getCapacity() + slotsPerTask - 1) / slotsPerTask;
+        taskMix.assign ((size_t) (maxTasks * spanSize), 0.0f);
+        threadScratch.resize (maxTasks > 1 ? (size_t) WorkerPool::maxWorkers + 1 : 1);
+        segmentIncrements.assign ((size_t) (maxSegments * bank.getCapacity()), 0.0f);
+        segmentAmplitudes.assign ((size_t) (maxSegments * bank.getCapacity()), 0.0f);
+
+        tracks.fill ({});
+        numTracks = 0;
+        samplesUntilStep = 0;
+
+        amplitudeCoefficient = std::exp (-(float) glideStep / (float) (sampleRate * amplitudeSeconds));
+    }
+
+    // Silences and frees every track at once
+    void reset()
+    {
+        for (int i = 0; i < numTracks; ++i)
+            bank.removePartial (tracks[(size_t) i].handle);
+
+        tracks.fill ({});
+        numTracks = 0;
+        samplesUntilStep = 0;
+    }
+
+    // pitchRatio scales every frequency played, reached by a linear ramp over
+    // the next rampSamples rendered (at once for 0). drag (0..1) sets the
+    // glide time, up to maxGlideSeconds; at 0 tracks jump straight to each peak.
+    void setParameters (float newPitchRatio, float drag, int rampSamples = 0)
+    {
+        targetPitchRatio = newPitchRatio;
+        samplesToPitchRatio = std::max (0, rampSamples);
+
+        if (samplesToPitchRatio == 0)
+            pitchRatio = newPitchRatio;
+        else
+            pitchRatioStep = (newPitchRatio - pitchRatio) / (float) samplesToPitchRatio;
+
+        glideCoefficient = drag > 0.0f ? std::exp (-(float) glideStep / (float) (sampleRate * drag * maxGlideSeconds)) : 0.0f;
+    }
+
+    // Renders on the pool's threads as well as the caller's, or only the
+    // caller's with nullptr. The pool must outlive its use here.
+    void setWorkerPool (WorkerPool* newPool)
+    {
+        pool = newPool;
+    }
+
+    // Matches one analysis frame's peaks to the tracks. Births and deaths
+    // are written to changes (up to maxChanges), and their number returned.
+    int addFrame (const SpectralPeak* peaks, int numPeaks, Change* changes, int maxChanges)
+    {
+        int numChanges = 0;
+
+        auto report = [&] (bool born, const Track& track)
+        {
+            if (numChanges < maxChanges)
+                changes[numChanges++] = { born, track.targetFrequency, born ? track.targetAmplitude : track.amplitude };
+        };
+
+        sortCandidates();
+
+        // Loudest first, so the strongest peaks get first pick of the tracks
+        numPeaks = std::min (numPeaks, PeakFrame::maxPeaks);
+
+        for (int i = 0; i < numPeaks; ++i)
+            order[(size_t) i] = i;
+
+        std::sort (order.begin(), order.begin() + numPeaks,
+                   [peaks] (int a, int b)
+                   {
+                       return peaks[a].amplitude > peaks[b].amplitude
+                           || (peaks[a].amplitude == peaks[b].amplitude && a < b);
+                   });
+
+        for (int i = 0; i < numPeaks; ++i)
+        {
+            auto& peak = peaks[order[(size_t) i]];
+
+            if (peak.frequency <= 0.0f || peak.amplitude <= 0.0f)
+                continue;
+
+            if (auto* track = findNearestTrack (peak.frequency))
+            {
+                track->targetFrequency = peak.frequency;
+                track->targetAmplitude = peak.amplitude;
+                track->framesUnmatched = 0;
+                track->matched = true;
+            }
+            else if (auto* newTrack = startTrack (peak))
+            {
+                report (true, *newTrack);
+            }
+        }
+
+        for (int i = 0; i < numTracks; ++i)
+        {
+            auto& track = tracks[(size_t) i];
+
+            if (track.matched || track.dying)
+                continue;
+
+            if (++track.framesUnmatched >= deathFrames)
+            {
+                track.dying = true;
+                track.targetAmplitude = 0.0f;
+                report (false, track);
+            }
+        }
+
+        return numChanges;
+    }
+
+    // Adds every track to output
+    void render (float* output, int numSamples)
+    {
+        for (int offset = 0; offset < numSamples; offset += spanSize)
+        {
+            auto count = std::min (spanSize, numSamples - offset);
+            planSegments (count);
+            renderBank (output + offset, count);
+            freeFinishedTracks();
+        }
+    }
+
+    int getNumActiveTracks() const  { return numTracks; }
+
+private:
+    static constexpr float maxGlideSeconds = 0.5f;
+    static constexpr double amplitudeSeconds = 0.01;
+    static constexpr float maxJumpRatio = 1.0594631f; // a semitone; further than this is a new note
+    static constexpr int deathFrames = 3;
+    static constexpr float silence = 1.0e-4f;
+
+    // Samples rendered at a time. Below minParallelSamples, or with a single
+    // run, waking the workers would cost more than it saves.
+    static constexpr int spanSize = 256;
+    static constexpr int maxSegments = spanSize / glideStep + 1;
+    static constexpr int slotsPerTask = 64;
+    static constexpr int minParallelSamples = 64;
+    static_assert (slotsPerTask % OscillatorBank::slotAlignment == 0, "Runs must start on a vector");
+
+    struct Track
+    {
+        int handle = -1;             // in the bank
+        float frequency = 0.0f, targetFrequency = 0.0f;
+        float amplitude = 0.0f, targetAmplitude = 0.0f;
+        float stepIncrement = 0.0f;  // where the bank is ramping to this step
+        float bankIncrement = 0.0f, bankAmplitude = 0.0f; // where it will be after the planned segments
+        int framesUnmatched = 0;
+        bool matched = false;
+        bool dying = false;
+        bool finished = false;       // ramping to silence, to be freed once there
+    };
+
+    // Part of a span with the same targets: the rest of a glide step, or as
+    // much of it as the span holds
+    struct Segment
+    {
+        int offset = 0, numSamples = 0;
+    };
+
+    OscillatorBank bank;
+    std::array<Track, maxTracks> tracks;
+    int numTracks = 0;
+    std::array<int, PeakFrame::maxPeaks> order;
+
+    // The tracks a frame's peaks can match, lowest target frequency first,
+    // and for each the nearest candidate not yet taken at or above it
+    // (nextFree) and at or below it, offset by one (previousFree)
+    std::array<int, maxTracks> candidates;
+    std::array<int, maxTracks + 1> nextFree, previousFree;
+    int numCandidates = 0;
+
+    double sampleRate = 44100.0;
+    float pitchRatio = 1.0f, targetPitchRatio = 1.0f, pitchRatioStep = 0.0f;
+    int samplesToPitchRatio = 0;
+    int samplesUntilStep = 0;
+
+    std::array<Segment, maxSegments> segments;
+    int numSegments = 0, spanSamples = 0;
+    std::vector<float> segmentIncrements, segmentAmplitudes;  // a row of the bank's capacity per segment
+    std::vector<float> taskMix;                                // a row of spanSize per run
+    std::vector<OscillatorBank::Scratch> threadScratch;       // one per thread that can render
+    WorkerPool* pool = nullptr;
+
+    float glideCoefficient = 0.0f;
+    float amplitudeCoefficient = 0.0f;
+
+    float getIncrement (float frequency) const
+    {
+        // Keep clear of Nyquist, where the bank's sine would alias
+        return std::min ((float) (frequency * pitchRatio / sampleRate), 0.49f);
+    }
+
+    // Splits the next numSamples at the glide steps and works out the bank's
+    // targets for each part, by slot. Nothing is freed until the span has
+    // been rendered, so the slots stay put.
+    void planSegments (int numSamples)
+    {
+        auto capacity = bank.getCapacity();
+        numSegments = 0;
+        spanSamples = numSamples;
+
+        for (int offset = 0; offset < numSamples;)
+        {
+            if (samplesUntilStep == 0)
+                advanceGlides();
+
+            auto count = std::min (samplesUntilStep, numSamples - offset);
+            auto* increments = segmentIncrements.data() + numSegments * capacity;
+            auto* amplitudes = segmentAmplitudes.data() + numSegments * capacity;
+
+            // The bank ramps to its targets over one segment, so a step split
+            // across segments is handed over the same fraction at a time
+            auto fraction = (float) count / (float) samplesUntilStep;
+
+            for (int i = 0; i < numTracks; ++i)
+            {
+                auto& track = tracks[(size_t) i];
+                auto slot = (size_t) bank.getSlot (track.handle);
+
+                if (count == samplesUntilStep)
+                {
+                    track.bankIncrement = track.stepIncrement;
+                    track.bankAmplitude = track.amplitude;
+                }
+                else
+                {
+                    track.bankIncrement += (track.stepIncrement - track.bankIncrement) * fraction;
+                    track.bankAmplitude += (track.amplitude - track.bankAmplitude) * fraction;
+                }
+
+                increments[slot] = track.bankIncrement;
+                amplitudes[slot] = track.bankAmplitude;
+            }
+
+            segments[(size_t) numSegments++] = { offset, count };
+            samplesUntilStep -= count;
+            offset += count;
+        }
+    }
+
+    // Renders the planned span into output, one run of partials per task,
+    // and sums the runs in order
+    void renderBank (float* output, int numSamples)
+    {
+        auto numTasks = std::max (1, (bank.getNumActive() + slotsPerTask - 1) / slotsPerTask);
+
+        if (pool != nullptr && numTasks > 1 && numSamples >= minParallelSamples)
+            pool->run (numTasks, renderTask, this);
+        else
+            for (int task = 0; task < numTasks; ++task)
+                renderTask (this, task, 0);
+
+        for (int task = 0; task < numTasks; ++task)
+        {
+            auto* row = taskMix.data() + task * spanSize;
+
+            for (int i = 0; i < numSamples; ++i)
+                output[i] += row[i];
+        }
+    }
+
+    static void renderTask (void* context, int task, int thread)
+    {
+        auto& tracker = *static_cast<PartialTracker*> (context);
+        auto& bank = tracker.bank;
+        auto capacity = bank.getCapacity();
+        auto firstSlot = task * slotsPerTask;
+        auto endSlot = std::min ((task + 1) * slotsPerTask, bank.getNumActive());
+        auto* row = tracker.taskMix.data() + task * spanSize;
+
+        std::fill (row, row + tracker.spanSamples, 0.0f);
+
+        for (int s = 0; s < tracker.numSegments; ++s)
+        {
+            auto& segment = tracker.segments[(size_t) s];
+            auto* increments = tracker.segmentIncrements.data() + s * capacity;
+            auto* amplitudes = tracker.segmentAmplitudes.data() + s * capacity;
+
+            for (int slot = firstSlot; slot < endSlot; ++slot)
+                bank.setSlotTargets (slot, increments[slot], amplitudes[slot]);
+
+            bank.renderSlots (row + segment.offset, segment.numSamples, nullptr, 0,
+                              firstSlot, endSlot, tracker.threadScratch[(size_t) thread]);
+            bank.finishSlots (firstSlot, endSlot);
+        }
+    }
+
+    void freeFinishedTracks()
+    {
+        for (int i = numTracks; --i >= 0;)
+        {
+            if (tracks[(size_t) i].finished && tracks[(size_t) i].bankAmplitude == 0.0f)
+            {
+                bank.removePartial (tracks[(size_t) i].handle);
+                tracks[(size_t) i] = tracks[(size_t) --numTracks];
+                tracks[(size_t) numTracks] = {};
+            }
+        }
+    }
+
+    // Starts the next glideStep samples, moving every track on by one step
+    // of its glide. One that faded out over the last step ramps to silence.
+    void advanceGlides()
+    {
+        // The increments are taken at the end of the step, so is the ratio
+        if (samplesToPitchRatio > 0)
+        {
+            auto rampCount = std::min (glideStep, samplesToPitchRatio);
+            samplesToPitchRatio -= rampCount;
+            pitchRatio = samplesToPitchRatio == 0 ? targetPitchRatio : pitchRatio + pitchRatioStep * (float) rampCount;
+        }
+
+        for (int i = 0; i < numTracks; ++i)
+        {
+            auto& track = tracks[(size_t) i];
+
+            if (track.dying && track.amplitude < silence)
+            {
+                track.amplitude = 0.0f;
+                track.finished = true;
+                continue;
+            }
+
+            // A settled glide stays put, and skips the pow
+            if (track.frequency != track.targetFrequency)
+                track.frequency = track.targetFrequency * std::pow (track.frequency / track.targetFrequency, glideCoefficient);
+
+            track.amplitude = track.targetAmplitude + (track.amplitude - track.targetAmplitude) * amplitudeCoefficient;
+            track.stepIncrement = getIncrement (track.frequency);
+        }
+
+        samplesUntilStep = glideStep;
+    }
+
+    // Clears the matches and sorts the tracks that can be matched this frame
+    void sortCandidates()
+    {
+        numCandidates = 0;
+
+        for (int i = 0; i < numTracks; ++i)
+        {
+            auto& track = tracks[(size_t) i];
+            track.matched = false;
+
+            if (! track.dying)
+                candidates[(size_t) numCandidates++] = i;
+        }
+
+        // Ties broken on where the tracks are, not on where they sit in the
+        // array, which depends on when others were freed
+        std::sort (candidates.begin(), candidates.begin() + numCandidates,
+                   [this] (int a, int b)
+                   {
+                       auto& x = tracks[(size_t) a];
+                       auto& y = tracks[(size_t) b];
+
+                       if (x.targetFrequency != y.targetFrequency)
+                           return x.targetFrequency < y.targetFrequency;
+
+                       return x.frequency < y.frequency || (x.frequency == y.frequency && x.amplitude < y.amplitude);
+                   });
+
+        for (int i = 0; i <= numCandidates; ++i)
+            nextFree[(size_t) i] = previousFree[(size_t) i] = i;
+    }
+
+    // Follows the links past the candidates already taken, shortening them
+    // on the way so the next search is quicker
+    static int skipTaken (std::array<int, maxTracks + 1>& links, int index)
+    {
+        while (links[(size_t) index] != index)
+        {
+            links[(size_t) index] = links[(size_t) links[(size_t) index]];
+            index = links[(size_t) index];
+        }
+
+        return index;
+    }
+
+    Track* findNearestTrack (float frequency)
+    {
+        // The first candidate at or above the frequency, and the last below
+        auto position = (int) (std::lower_bound (candidates.begin(), candidates.begin() + numCandidates, frequency,
+                                                 [this] (int candidate, float f) { return tracks[(size_t) candidate].targetFrequency < f; })
+                               - candidates.begin());
+
+        auto above = skipTaken (nextFree, position);           // numCandidates if none
+        auto below = skipTaken (previousFree, position) - 1;   // -1 if none
+
+        // Compared as frequency ratios above 1, which order the same as cents
+        auto best = -1;
+        auto bestRatio = maxJumpRatio;
+
+        if (above < numCandidates)
+        {
+            auto ratio = tracks[(size_t) candidates[(size_t) above]].targetFrequency / frequency;
+
+            if (ratio < bestRatio)
+            {
+                best = above;
+                bestRatio = ratio;
+            }
+        }
+
+        if (below >= 0)
+        {
+            auto ratio = frequency / tracks[(size_t) candidates[(size_t) below]].targetFrequency;
+
+            if (ratio < bestRatio)
+                best = below;
+        }
+
+        if (best < 0)
+            return nullptr;
+
+        nextFree[(size_t) best] = best + 1;
+        previousFree[(size_t) best + 1] = best;
+        return &tracks[(size_t) candidates[(size_t) best]];
+    }
+
+    Track* startTrack (const SpectralPeak& peak)
+    {
+        if (numTracks == maxTracks)
+            return nullptr;
+
+        auto handle = bank.addPartial (getIncrement (peak.frequency));
+
+        if (handle < 0)
+            return nullptr;
+
+        auto& track = tracks[(size_t) numTracks++];
+        track = {};
+        track.handle = handle;
+        track.frequency = track.targetFrequency = peak.frequency;
+        track.targetAmplitude = peak.amplitude;
+        track.stepIncrement = track.bankIncrement = bank.getIncrement (handle);
+        track.matched = true;
+        return &track;
+    }
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+
+#if defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+ #include <immintrin.h>
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+ #include <arm_neon.h>
+#endif
+
+// One component found in an analysis frame.
+struct SpectralPeak
+{
+    float frequency = 0.0f; // Hz
+    float amplitude = 0.0f; // linear, 1 for a full-scale sine
+};
+
+// Every peak the analyser found in one frame, lowest frequency first.
+struct PeakFrame
+{
+    static constexpr int maxPeaks = 256;
+
+    uint32_t frameIndex = 0;     // matches AnalysisResult::frameIndex
+    uint64_t samplePosition = 0; // input sample just after the end of the frame
+    int numPeaks = 0;
+    std::array<SpectralPeak, maxPeaks> peaks;
+};
+
+// Finds the strongest local maxima of a magnitude spectrum.
+//
+// Local maxima are found four bins at a time with SSE2 or NEON, otherwise
+// one at a time. The strongest are kept in a min-heap no bigger than the
+// number asked for, so a frame with B bins costs O(B log N) for N peaks,
+// never a sort of the whole spectrum. Only the survivors get parabolic
+// interpolation, on log magnitude, of their frequency and amplitude.
+// No allocation; the heap lives in the extractor.
+class PeakExtractor
+{
+public:
+    // magnitudes is a frequency-only FFT of a Hann-windowed frame of
+    // fftSize samples, bins 0 to fftSize / 2. Writes up to maxPeaks peaks
+    // louder than floorAmplitude to peaks, lowest frequency first, and
+    // returns how many.
+    int extract (const float* magnitudes, int fftSize, double sampleRate, int maxPeaks,
+                 float floorAmplitude, SpectralPeak* peaks)
+    {
+        maxPeaks = std::min (maxPeaks, PeakFrame::maxPeaks);
+
+        if (maxPeaks <= 0)
+            return 0;
+
+        // A Hann window sums to fftSize / 2, so a sine of amplitude a peaks at a * fftSize / 4
+        auto magnitudeScale = 4.0f / (float) fftSize;
+        auto floorMagnitude = floorAmplitude / magnitudeScale;
+        auto numBins = fftSize / 2 + 1;
+        heapSize = 0;
+
+        // Bins 1 to numBins - 2, so every candidate has both neighbours
+        int bin = 1;
+
+       #if defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+        const auto floor = _mm_set1_ps (floorMagnitude);
+
+        for (; bin + 4 <= numBins - 1; bin += 4)
+        {
+            auto centre = _mm_loadu_ps (magnitudes + bin);
+            auto isPeak = _mm_and_ps (_mm_and_ps (_mm_cmpgt_ps (centre, _mm_loadu_ps (magnitudes + bin - 1)),
+                                                  _mm_cmpge_ps (centre, _mm_loadu_ps (magnitudes + bin + 1))),
+                                      _mm_cmpgt_ps (centre, floor));
+
+            for (auto mask = _mm_movemask_ps (isPeak); mask != 0; mask &= mask - 1)
+                offer (bin + countTrailingZeros (mask), magnitudes, maxPeaks);
+        }
+       #elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+        const auto floor = vdupq_n_f32 (floorMagnitude);
+
+        for (; bin + 4 <= numBins - 1; bin += 4)
+        {
+            auto centre = vld1q_f32 (magnitudes + bin);
+            auto isPeak = vandq_u32 (vandq_u32 (vcgtq_f32 (centre, vld1q_f32 (magnitudes + bin - 1)),
+                                                vcgeq_f32 (centre, vld1q_f32 (magnitudes + bin + 1))),
+                                     vcgtq_f32 (centre, floor));
+
+            // Nearly every group of four has no peak at all
+            auto any = vorr_u32 (vget_low_u32 (isPeak), vget_high_u32 (isPeak));
+
+            if ((vget_lane_u32 (any, 0) | vget_lane_u32 (any, 1)) == 0)
+                continue;
+
+            std::array<uint32_t, 4> lanes;
+            vst1q_u32 (lanes.data(), isPeak);
+
+            for (int lane = 0; lane < 4; ++lane)
+                if (lanes[(size_t) lane] != 0)
+                    offer (bin + lane, magnitudes, maxPeaks);
+        }
+       #endif
+
+        for (; bin < numBins - 1; ++bin)
+            if (magnitudes[bin] > magnitudes[bin - 1] && magnitudes[bin] >= magnitudes[bin + 1] && magnitudes[bin] > floorMagnitude)
+                offer (bin, magnitudes, maxPeaks);
+
+        // Lowest bin first, then interpolate only the survivors
+        std::sort (heap.begin(), heap.begin() + heapSize,
+                   [] (const Candidate& a, const Candidate& b) { return a.bin < b.bin; });
+
+        auto binHz = (float) (sampleRate / fftSize);
+
+        for (int i = 0; i < heapSize; ++i)
+        {
+            auto b = heap[(size_t) i].bin;
+            auto left = std::log (magnitudes[b - 1] + tiny);
+            auto centre = std::log (magnitudes[b] + tiny);
+            auto right = std::log (magnitudes[b + 1] + tiny);
+            auto curvature = left - 2.0f * centre + right;
+            auto offset = curvature < 0.0f ? 0.5f * (left - right) / curvature : 0.0f;
+
+            peaks[i].frequency = ((float) b + offset) * binHz;
+            peaks[i].amplitude = std::exp (centre - 0.25f * (left - right) * offset) * magnitudeScale;
+        }
+
+        return heapSize;
+    }
+
+private:
+    static constexpr float tiny = 1.0e-20f;
+
+    struct Candidate
+    {
+        float magnitude;
+        int bin;
+
+        // Ordering for a min-heap: the quietest candidate on top
+        bool operator> (const Candidate& other) const  { return magnitude > other.magnitude; }
+    };
+
+    std::array<Candidate, PeakFrame::maxPeaks> heap;
+    int heapSize = 0;
+
+    void offer (int bin, const float* magnitudes, int maxPeaks)
+    {
+        Candidate candidate { magnitudes[bin], bin };
+
+        if (heapSize < maxPeaks)
+        {
+            heap[(size_t) heapSize++] = candidate;
+            std::push_heap (heap.begin(), heap.begin() + heapSize, std::greater<Candidate>());
+        }
+        else if (candidate.magnitude > heap[0].magnitude)
+        {
+            std::pop_heap (heap.begin(), heap.begin() + heapSize, std::greater<Candidate>());
+            heap[(size_t) heapSize - 1] = candidate;
+            std::push_heap (heap.begin(), heap.begin() + heapSize, std::greater<Candidate>());
+        }
+    }
+
+    static int countTrailingZeros (int mask)
+    {
+        int count = 0;
+
+        for (; (mask & 1) == 0; mask >>= 1)
+            ++count;
+
+        return count;
+    }
+};
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "SpectralAnalyser.h"
+
+// Phase vocoder resynthesis: STFT, per-bin edits, inverse FFT and windowed
+// overlap-add. Unlike the sine bank, its cost is fixed per hop (one forward
+// and one inverse FFT plus a pass over the bins) however many partials the
+// input has, so it suits dense or noisy material.
+//
+// Each hop the spectrum is
+//  - smeared in time by drag (a one-pole on every bin's magnitude),
+//  - pitch shifted by moving each peak, with its lobe, to a new frequency, and
+//  - limited to the first few harmonics of the analysed fundamental by range.
+//
+// It uses the analyser's default frame size, whatever size the analysis is
+// set to, and runs its own STFT on the audio thread:
+// the analyser's frames are magnitude only, follow the analysis hop and arrive
+// whenever the analysis thread gets to them, while resynthesis needs phases
+// and has to produce a hop of output in step with every hop of input.
+// Latency is fftSize samples: a frame is taken once its last hop is in,
+// and its first hop of output is only finished, and played, a hop later.
+class PhaseVocoder
+{
+public:
+    static constexpr int fftOrder = SpectralAnalyser::defaultFftOrder;
+    static constexpr int fftSize = SpectralAnalyser::defaultFftSize;
+    static constexpr int hopSize = fftSize / 4;
+    static constexpr int numBins = fftSize / 2 + 1;
+    static constexpr int latency = fftSize;
+
+    PhaseVocoder()
+        : fft (fftOrder)
+    {
+        // Periodic Hann, so analysis and synthesis windows overlap-add to a constant
+        auto sumOfSquares = 0.0f;
+
+        for (int i = 0; i < fftSize; ++i)
+        {
+            window[(size_t) i] = 0.5f - 0.5f * std::cos (juce::MathConstants<float>::twoPi * (float) i / fftSize);
+            sumOfSquares += window[(size_t) i] * window[(size_t) i];
+        }
+
+        overlapGain = (float) hopSize / sumOfSquares;
+    }
+
+    void prepare (double newSampleRate)
+    {
+        sampleRate = newSampleRate;
+        reset();
+    }
+
+    void reset()
+    {
+        inputFifo.fill (0.0f);
+        outputFifo.fill (0.0f);
+        outputAccumulator.fill (0.0f);
+        previousPhase.fill (0.0f);
+        synthesisPhase.fill (0.0f);
+        smearedMagnitude.fill (0.0f);
+        fifoPosition = newestHop;
+    }
+
+    // pitchRatio scales every frequency. range (0..1) keeps the first 1 to
+    // maxHarmonics harmonics of fundamentalHz, and everything at 1 or when no
+    // fundamental is known. drag (0..1) smears each bin over up to
+    // maxDragSeconds. Picked up from the next hop.
+    void setParameters (float newPitchRatio, float fundamentalHz, float range, float drag)
+    {
+        pitchRatio = newPitchRatio;
+
+        auto fundamentalBin = (float) (fundamentalHz * fftSize / sampleRate);
+        auto maxHarmonic = 1.0f + range * (float) (maxHarmonics - 1);
+
+        highestBin = range < 1.0f && fundamentalBin > 0.0f ? (maxHarmonic + 0.5f) * fundamentalBin * pitchRatio
+                                                           : (float) numBins;
+
+        dragCoefficient = drag > 0.0f ? (float) std::exp (-hopSize / (drag * maxDragSeconds * sampleRate)) : 0.0f;
+    }
+
+    // Writes numSamples of resynthesis of input, delayed by latency samples.
+    // input and output may be the same buffer.
+    void process (const float* input, float* output, int numSamples)
+    {
+        for (int done = 0; done < numSamples;)
+        {
+            auto count = juce::jmin (numSamples - done, fftSize - fifoPosition);
+            auto start = fifoPosition - newestHop;
+
+            juce::FloatVectorOperations::copy (inputFifo.data() + fifoPosition, input + done, count);
+            juce::FloatVectorOperations::copy (output + done, outputFifo.data() + start, count);
+
+            fifoPosition += count;
+            done += count;
+
+            if (fifoPosition == fftSize)
+            {
+                processFrame();
+                fifoPosition = newestHop;
+            }
+        }
+    }
+
+    // Harmonics kept at range 1, short of keeping everything
+    static constexpr int maxHarmonics = 64;
+
+private:
+    static constexpr double maxDragSeconds = 2.0;
+
+    // Where in the input FIFO each hop is written, the last of the frame
+    static constexpr int newestHop = fftSize - hopSize;
+
+    juce::dsp::FFT fft;
+    std::array<float, fftSize> window;
+    float overlapGain = 1.0f;
+    double sampleRate = 44100.0;
+
+    std::array<float, fftSize> inputFifo {};
+    std::array<float, hopSize> outputFifo {};
+    std::array<float, fftSize> outputAccumulator {};
+    std::array<float, fftSize * 2> fftBuffer {};
+    int fifoPosition = newestHop;
+
+    std::array<float, numBins> previousPhase {}, synthesisPhase {}, smearedMagnitude {};
+    std::array<float, numBins> analysedFrequency {};
+
+    float pitchRatio = 1.0f;
+    float highestBin = (float) numBins;
+    float dragCoefficient = 0.0f;
+
+    void processFrame()
+    {
+        const auto twoPi = juce::MathConstants<float>::twoPi;
+        const auto expectedAdvance = twoPi * (float) hopSize / fftSize;
+        const auto oversampling = (float) fftSize / hopSize;
+
+        juce::FloatVectorOperations::multiply (fftBuffer.data(), inputFifo.data(), window.data(), fftSize);
+        fft.performRealOnlyForwardTransform (fftBuffer.data(), true);
+
+        // Analysis: each bin's magnitude and true frequency (in bins), from
+        // how far its phase moved beyond what the bin centre would explain
+        for (int bin = 0; bin < numBins; ++bin)
+        {
+            auto real = fftBuffer[(size_t) bin * 2];
+            auto imag = fftBuffer[(size_t) bin * 2 + 1];
+            auto phase = std::atan2 (imag, real);
+            auto advance = phase - previousPhase[(size_t) bin] - (float) bin * expectedAdvance;
+            previousPhase[(size_t) bin] = phase;
+
+            advance -= twoPi * std::round (advance / twoPi);
+            analysedFrequency[(size_t) bin] = (float) bin + advance * oversampling / twoPi;
+
+            auto& magnitude = smearedMagnitude[(size_t) bin];
+            auto current = std::hypot (real, imag);
+            magnitude = current + dragCoefficient * (magnitude - current);
+        }
+
+        // Pitch shift and synthesis, with identity phase locking: the spectrum
+        // is split into one region per peak, and each region is moved whole so
+        // its peak lands on peak * pitchRatio. Only the peak's phase advances
+        // by its own (shifted) frequency; the bins around it keep the phase
+        // offsets they had in the analysis, so every partial's main lobe stays
+        // intact. Regions above the range limit are left out.
+        std::fill (fftBuffer.begin(), fftBuffer.begin() + numBins * 2, 0.0f);
+
+        for (int start = 0, peak = findNextPeak (0); start < numBins;)
+        {
+            auto next = findNextPeak (peak + 1);
+            auto end = next > peak ? lowestBinBetween (peak, next) : numBins;
+            auto target = (int) ((float) peak * pitchRatio + 0.5f);
+
+            if (target >= numBins || (float) target > highestBin)
+                break;
+
+            auto& phase = synthesisPhase[(size_t) target];
+            phase += analysedFrequency[(size_t) peak] * pitchRatio * expectedAdvance;
+            phase -= twoPi * std::floor (phase / twoPi);
+
+            auto shift = target - peak;
+
+            for (int bin = juce::jmax (start, -shift); bin < juce::jmin (end, numBins - shift); ++bin)
+            {
+                auto binPhase = phase + previousPhase[(size_t) bin] - previousPhase[(size_t) peak];
+                fftBuffer[(size_t) (bin + shift) * 2]     += smearedMagnitude[(size_t) bin] * std::cos (binPhase);
+                fftBuffer[(size_t) (bin + shift) * 2 + 1] += smearedMagnitude[(size_t) bin] * std::sin (binPhase);
+            }
+
+            start = end;
+            peak = next;
+        }
+
+        // Mirror the negative frequencies, so the inverse sees a full spectrum on every FFT engine
+        for (int bin = 1; bin < fftSize / 2; ++bin)
+        {
+            fftBuffer[(size_t) (fftSize - bin) * 2]     =  fftBuffer[(size_t) bin * 2];
+            fftBuffer[(size_t) (fftSize - bin) * 2 + 1] = -fftBuffer[(size_t) bin * 2 + 1];
+        }
+
+        fft.performRealOnlyInverseTransform (fftBuffer.data());
+
+        // Window, overlap-add, and hand the finished hop to the output
+        for (int i = 0; i < fftSize; ++i)
+            outputAccumulator[(size_t) i] += fftBuffer[(size_t) i] * window[(size_t) i] * overlapGain;
+
+        std::copy (outputAccumulator.begin(), outputAccumulator.begin() + hopSize, outputFifo.begin());
+        std::copy (outputAccumulator.begin() + hopSize, outputAccumulator.end(), outputAccumulator.begin());
+        std::fill (outputAccumulator.end() - hopSize, outputAccumulator.end(), 0.0f);
+        std::copy (inputFifo.begin() + hopSize, inputFifo.end(), inputFifo.begin());
+    }
+
+    // First local maximum of the analysed spectrum at or after bin, or the
+    // last bin if there is none
+    int findNextPeak (int bin) const
+    {
+        for (; bin < numBins - 1; ++bin)
+            if (smearedMagnitude[(size_t) bin] > 0.0f
+                && (bin == 0 || smearedMagnitude[(size_t) bin] >= smearedMagnitude[(size_t) bin - 1])
+                && smearedMagnitude[(size_t) bin] > smearedMagnitude[(size_t) bin + 1])
+                return bin;
+
+        return numBins - 1;
+    }
+
+    // Where one peak's region of influence ends and the next one's begins
+    int lowestBinBetween (int peak, int nextPeak) const
+    {
+        auto lowest = peak + 1;
+
+        for (int bin = peak + 1; bin < nextPeak; ++bin)
+            if (smearedMagnitude[(size_t) bin] < smearedMagnitude[(size_t) lowest])
+                lowest = bin;
+
+        return lowest;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PhaseVocoder)
+};
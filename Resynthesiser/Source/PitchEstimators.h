@@ -0,0 +1,586 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// One frame's worth of pitch.
+struct PitchEstimate
+{
+    float frequency = 0.0f;  // Hz, 0 if no pitch was found
+    float confidence = 0.0f; // 0..1, estimator specific
+};
+
+// Interface for the fundamental estimators the analyser can run.
+//
+// Every estimator is given both the magnitude spectrum (fftSize / 2 bins,
+// already computed by the analyser) and the unwindowed time-domain frame.
+// Buffers are sized in prepare(); estimate() never allocates.
+//
+// getCostPerFrame() publishes the approximate number of floating point
+// operations one estimate() call costs at the prepared size, not counting
+// the shared FFT (roughly 5 N log2 N, about 113k at N = 2048), so the
+// estimator can be picked per instance by accuracy against CPU:
+//
+//    estimator              cost at N = 2048, hop 512     resolution
+//    parabolic peak         ~1k                            sub-bin, locks onto loudest partial
+//    harmonic product       ~16k                           sub-bin, robust to strong overtones
+//    YIN                    ~3.1M (~1.6M at hop 256)       sub-sample lag, best in the low register
+//    multiple pitches       ~11k per pitch, at most ~66k      sub-bin, up to 6 at once (chords)
+class PitchEstimator
+{
+public:
+    virtual ~PitchEstimator() = default;
+
+    virtual const char* getName() const = 0;
+    virtual bool needsTimeDomainFrame() const { return false; }
+
+    virtual void prepare (double newSampleRate, int newFftSize, int newHopSize)
+    {
+        sampleRate = newSampleRate;
+        fftSize = newFftSize;
+        hopSize = newHopSize;
+        reset();
+    }
+
+    // Forget any state carried between frames (e.g. after a hop size change).
+    virtual void reset() {}
+
+    virtual PitchEstimate estimate (const float* magnitudes, const float* frame) = 0;
+
+    // Up to maxPitches fundamentals, strongest first, written to pitches.
+    // Returns how many were found. Estimators that only ever find one give
+    // what estimate() does.
+    virtual int estimateMultiple (const float* magnitudes, const float* frame, PitchEstimate* pitches, int maxPitches)
+    {
+        auto estimate = this->estimate (magnitudes, frame);
+
+        if (estimate.frequency <= 0.0f || maxPitches < 1)
+            return 0;
+
+        pitches[0] = estimate;
+        return 1;
+    }
+
+    virtual long getCostPerFrame() const = 0;
+
+protected:
+    double sampleRate = 44100.0;
+    int fftSize = 2048;
+    int hopSize = 512;
+
+    // Fits a parabola through the log magnitudes around a peak bin and
+    // returns the offset of its vertex, in bins (-0.5..0.5).
+    static float interpolatePeakOffset (const float* magnitudes, int bin)
+    {
+        auto a = std::log (magnitudes[bin - 1] + 1.0e-9f);
+        auto b = std::log (magnitudes[bin]     + 1.0e-9f);
+        auto c = std::log (magnitudes[bin + 1] + 1.0e-9f);
+        auto denominator = a - 2.0f * b + c;
+
+        if (denominator >= 0.0f)
+            return 0.0f;
+
+        return std::clamp (0.5f * (a - c) / denominator, -0.5f, 0.5f);
+    }
+
+    float binToFrequency (float bin) const
+    {
+        return (float) (bin * sampleRate / fftSize);
+    }
+};
+
+// Loudest bin, refined by quadratic interpolation of the log spectrum. About
+// as cheap as the old argmax but accurate to a few cents on a clean tone.
+class PeakInterpolationEstimator : public PitchEstimator
+{
+public:
+    const char* getName() const override { return "Parabolic peak"; }
+
+    PitchEstimate estimate (const float* magnitudes, const float*) override
+    {
+        auto numBins = fftSize / 2;
+        auto peak = (int) (std::max_element (magnitudes + 1, magnitudes + numBins - 1) - magnitudes);
+
+        if (magnitudes[peak] <= 0.0f)
+            return {};
+
+        return { binToFrequency ((float) peak + interpolatePeakOffset (magnitudes, peak)), 1.0f };
+    }
+
+    long getCostPerFrame() const override
+    {
+        return fftSize / 2 + 16;
+    }
+};
+
+// Harmonic product spectrum: multiplies the spectrum with copies of itself
+// compressed by 2..numHarmonics, so the candidate whose harmonics are all
+// present wins over a single strong overtone. Candidates are spaced a
+// quarter of a bin apart (reading the spectrum with linear interpolation)
+// so low notes, whose harmonics fall between bins, are not pulled an octave
+// off. The winner is then refined from the loudest of its harmonics, which
+// is better resolved than the fundamental itself.
+class HarmonicProductEstimator : public PitchEstimator
+{
+public:
+    static constexpr int numHarmonics = 5;
+    static constexpr int oversampling = 4;
+    static constexpr int lowestCandidateBin = 2;
+
+    const char* getName() const override { return "Harmonic product"; }
+
+    void prepare (double newSampleRate, int newFftSize, int newHopSize) override
+    {
+        PitchEstimator::prepare (newSampleRate, newFftSize, newHopSize);
+        product.assign ((size_t) ((fftSize / 2 - 2) * oversampling / numHarmonics), 0.0f);
+    }
+
+    PitchEstimate estimate (const float* magnitudes, const float*) override
+    {
+        auto numCandidates = (int) product.size();
+        auto total = 0.0f;
+
+        for (int candidate = lowestCandidateBin * oversampling; candidate < numCandidates; ++candidate)
+        {
+            auto value = 1.0f;
+
+            for (int harmonic = 1; harmonic <= numHarmonics; ++harmonic)
+                value *= readInterpolated (magnitudes, candidate * harmonic);
+
+            product[(size_t) candidate] = value;
+            total += value;
+        }
+
+        auto best = (int) (std::max_element (product.begin() + lowestCandidateBin * oversampling, product.end()) - product.begin());
+
+        if (product[(size_t) best] <= 0.0f)
+            return {};
+
+        return { refineFromHarmonics (magnitudes, (float) best / oversampling), product[(size_t) best] / total };
+    }
+
+    long getCostPerFrame() const override
+    {
+        return (long) product.size() * numHarmonics * 4 + numHarmonics * 16;
+    }
+
+private:
+    std::vector<float> product;
+
+    static float readInterpolated (const float* magnitudes, int position)
+    {
+        auto bin = position / oversampling;
+        auto fraction = (float) (position % oversampling) / oversampling;
+        return magnitudes[bin] + fraction * (magnitudes[bin + 1] - magnitudes[bin]);
+    }
+
+    float refineFromHarmonics (const float* magnitudes, float fundamentalBin) const
+    {
+        auto bestMagnitude = 0.0f;
+        auto refined = fundamentalBin;
+
+        for (int harmonic = 1; harmonic <= numHarmonics; ++harmonic)
+        {
+            auto bin = (int) std::lround (fundamentalBin * harmonic);
+
+            if (bin < 1 || bin >= fftSize / 2 - 1)
+                break;
+
+            // Snap to the local maximum next to the predicted bin
+            if (magnitudes[bin - 1] > magnitudes[bin] && magnitudes[bin - 1] >= magnitudes[bin + 1] && bin > 1)
+                --bin;
+            else if (magnitudes[bin + 1] > magnitudes[bin] && bin < fftSize / 2 - 2)
+                ++bin;
+
+            if (magnitudes[bin] > bestMagnitude)
+            {
+                bestMagnitude = magnitudes[bin];
+                refined = ((float) bin + interpolatePeakOffset (magnitudes, bin)) / (float) harmonic;
+            }
+        }
+
+        return binToFrequency (refined);
+    }
+};
+
+// YIN (de Cheveigné & Kawahara) in the time domain. The difference function
+// is kept between frames and slid forward by one hop, so at short hops each
+// frame costs O(hop * maxLag) rather than O(window * maxLag). It is rebuilt
+// from scratch every rebuildInterval frames to stop rounding error
+// accumulating, and whenever sliding would cost more than rebuilding.
+class YinEstimator : public PitchEstimator
+{
+public:
+    static constexpr float threshold = 0.15f;
+    static constexpr int rebuildInterval = 64;
+
+    const char* getName() const override { return "YIN"; }
+    bool needsTimeDomainFrame() const override { return true; }
+
+    void prepare (double newSampleRate, int newFftSize, int newHopSize) override
+    {
+        maxLag = newFftSize / 2;
+        window = newFftSize - maxLag;
+        difference.assign ((size_t) maxLag, 0.0f);
+        normalised.assign ((size_t) maxLag, 0.0f);
+        previousFrame.assign ((size_t) newFftSize, 0.0f);
+
+        PitchEstimator::prepare (newSampleRate, newFftSize, newHopSize);
+    }
+
+    void reset() override
+    {
+        framesSinceRebuild = rebuildInterval;
+    }
+
+    PitchEstimate estimate (const float*, const float* frame) override
+    {
+        if (framesSinceRebuild >= rebuildInterval || ! isSlidingCheaper())
+            rebuildDifference (frame);
+        else
+            slideDifference (frame);
+
+        std::copy (frame, frame + fftSize, previousFrame.begin());
+        return findPitch();
+    }
+
+    long getCostPerFrame() const override
+    {
+        auto slide = (long) hopSize * maxLag * 6;
+        auto rebuild = (long) window * maxLag * 3;
+        auto difference = isSlidingCheaper() ? (slide * (rebuildInterval - 1) + rebuild) / rebuildInterval : rebuild;
+        return difference + maxLag * 4;
+    }
+
+private:
+    int maxLag = 1024;
+    int window = 1024;
+    int framesSinceRebuild = rebuildInterval;
+    std::vector<float> difference, normalised, previousFrame;
+
+    bool isSlidingCheaper() const
+    {
+        return hopSize * 2 < window;
+    }
+
+    void rebuildDifference (const float* frame)
+    {
+        for (int lag = 0; lag < maxLag; ++lag)
+        {
+            auto sum = 0.0f;
+
+            for (int i = 0; i < window; ++i)
+            {
+                auto delta = frame[i] - frame[i + lag];
+                sum += delta * delta;
+            }
+
+            difference[(size_t) lag] = sum;
+        }
+
+        framesSinceRebuild = 0;
+    }
+
+    // The frame has moved forward by hopSize: drop the terms that started in
+    // the old frame's first hop and add the ones that now end the window.
+    void slideDifference (const float* frame)
+    {
+        const float* old = previousFrame.data();
+
+        for (int lag = 1; lag < maxLag; ++lag)
+        {
+            auto sum = difference[(size_t) lag];
+
+            for (int i = 0; i < hopSize; ++i)
+            {
+                auto leaving = old[i] - old[i + lag];
+                auto entering = frame[window - hopSize + i] - frame[window - hopSize + i + lag];
+                sum += entering * entering - leaving * leaving;
+            }
+
+            difference[(size_t) lag] = std::max (0.0f, sum);
+        }
+
+        ++framesSinceRebuild;
+    }
+
+    PitchEstimate findPitch()
+    {
+        // Cumulative mean normalised difference
+        normalised[0] = 1.0f;
+        auto runningSum = 0.0f;
+
+        for (int lag = 1; lag < maxLag; ++lag)
+        {
+            runningSum += difference[(size_t) lag];
+            normalised[(size_t) lag] = runningSum > 0.0f ? difference[(size_t) lag] * (float) lag / runningSum : 1.0f;
+        }
+
+        // First dip under the threshold, followed down to its minimum
+        int lag = 2;
+
+        while (lag < maxLag - 1 && normalised[(size_t) lag] >= threshold)
+            ++lag;
+
+        if (lag >= maxLag - 1)
+            return {};
+
+        while (lag < maxLag - 2 && normalised[(size_t) lag + 1] < normalised[(size_t) lag])
+            ++lag;
+
+        // Parabolic interpolation of the lag
+        auto a = normalised[(size_t) lag - 1];
+        auto b = normalised[(size_t) lag];
+        auto c = normalised[(size_t) lag + 1];
+        auto denominator = a - 2.0f * b + c;
+        auto offset = denominator > 0.0f ? std::clamp (0.5f * (a - c) / denominator, -0.5f, 0.5f) : 0.0f;
+
+        return { (float) (sampleRate / ((float) lag + offset)), std::clamp (1.0f - b, 0.0f, 1.0f) };
+    }
+};
+
+// Several fundamentals at once, by iterative estimation and cancellation
+// (after Klapuri, 2006). Each round takes the candidate with the largest
+// weighted sum of the (compressed) spectral peaks at its harmonics, then
+// subtracts its harmonics from the residual spectrum, and the next round
+// searches what is left. A harmonic shared with another note is only taken down to the
+// level of its neighbours, so an octave or a fifth above survives.
+//
+// Candidates are fixed, a quarter of a semitone apart from lowestNote to
+// highestNote, and the bins and weights of their harmonics are tabulated in
+// prepare(), so a frame never allocates and costs at most maxPitches rounds
+// of numCandidates * numHarmonics reads. In practice far fewer: cancelling
+// can only lower a candidate's sum, so its last sum bounds its next, and a
+// candidate is only scored again if that bound beats the best so far. The
+// search stops once the best left is under stopRatio of the first pitch.
+//
+// Each pitch's confidence is its salience relative to the strongest, which
+// gets 1.
+class MultiPitchEstimator : public PitchEstimator
+{
+public:
+    static constexpr int maxPitches = 6;
+    static constexpr int numHarmonics = 10;
+    static constexpr int lowestNote = 28;  // E1, 41 Hz
+    static constexpr int highestNote = 96; // C7, 2093 Hz
+    static constexpr int candidatesPerSemitone = 4;
+    static constexpr int numCandidates = (highestNote - lowestNote) * candidatesPerSemitone + 1;
+    static constexpr float stopRatio = 0.25f;
+
+    const char* getName() const override { return "Multiple pitches"; }
+
+    void prepare (double newSampleRate, int newFftSize, int newHopSize) override
+    {
+        PitchEstimator::prepare (newSampleRate, newFftSize, newHopSize);
+        residual.assign ((size_t) (fftSize / 2 + 1), 0.0f);
+
+        // Harmonics past the last whole bin are left out; candidates too low
+        // to be told from their neighbours get none
+        auto binsPerHz = (float) fftSize / (float) sampleRate;
+
+        for (int candidate = 0; candidate < numCandidates; ++candidate)
+        {
+            auto frequency = getCandidateFrequency (candidate);
+            auto& count = harmonicCounts[(size_t) candidate];
+            count = 0;
+
+            if (frequency * binsPerHz < (float) lowestBin)
+                continue;
+
+            for (int harmonic = 1; harmonic <= numHarmonics; ++harmonic)
+            {
+                auto bin = (int) std::lround (frequency * (float) harmonic * binsPerHz);
+
+                if (bin >= fftSize / 2 - 1)
+                    break;
+
+                auto index = (size_t) (candidate * numHarmonics + count++);
+                harmonicBins[index] = bin;
+                harmonicWeights[index] = (frequency + 52.0f) / (frequency * (float) harmonic + 320.0f);
+            }
+        }
+    }
+
+    PitchEstimate estimate (const float* magnitudes, const float* frame) override
+    {
+        PitchEstimate strongest;
+        estimateMultiple (magnitudes, frame, &strongest, 1);
+        return strongest;
+    }
+
+    int estimateMultiple (const float* magnitudes, const float*, PitchEstimate* pitches, int maxToFind) override
+    {
+        maxToFind = std::clamp (maxToFind, 0, maxPitches);
+        pitchesAskedFor = maxToFind;
+
+        // Only the spectral peaks are kept, so a harmonic that falls between
+        // two partials doesn't pick up the skirts of either, and compressed,
+        // as a cheap whitening, so quiet notes aren't buried under loud ones
+        auto numBins = (int) residual.size();
+        residual[0] = residual[(size_t) numBins - 1] = 0.0f;
+
+        for (int bin = 1; bin < numBins - 1; ++bin)
+            residual[(size_t) bin] = magnitudes[bin] > magnitudes[bin - 1] && magnitudes[bin] >= magnitudes[bin + 1] ? std::sqrt (magnitudes[bin]) : 0.0f;
+
+        // Nothing scored yet, so nothing can be ruled out
+        bounds.fill (std::numeric_limits<float>::max());
+
+        auto minimumSalience = silenceFloor * std::sqrt ((float) fftSize);
+        auto firstSalience = 0.0f;
+        int numFound = 0;
+
+        while (numFound < maxToFind)
+        {
+            auto best = findBestCandidate();
+
+            if (best < 0)
+                break;
+
+            auto salience = bounds[(size_t) best];
+
+            if (salience < minimumSalience || (numFound > 0 && salience < stopRatio * firstSalience))
+                break;
+
+            if (numFound == 0)
+                firstSalience = salience;
+
+            pitches[numFound++] = { cancelHarmonics (best, magnitudes), salience / firstSalience };
+
+            // The same note can't be found twice
+            for (int i = std::max (0, best - candidatesPerSemitone); i <= std::min (numCandidates - 1, best + candidatesPerSemitone); ++i)
+                bounds[(size_t) i] = 0.0f;
+        }
+
+        return numFound;
+    }
+
+    long getCostPerFrame() const override
+    {
+        return (long) std::max (1, pitchesAskedFor) * (numCandidates * numHarmonics * 4 + numHarmonics * 24) + fftSize / 2;
+    }
+
+private:
+    static constexpr int lowestBin = 2;
+    static constexpr float silenceFloor = 1.0e-2f; // about -80 dB before compression, relative to the FFT size
+
+    std::vector<float> residual;
+    std::array<int, numCandidates * numHarmonics> harmonicBins {};
+    std::array<float, numCandidates * numHarmonics> harmonicWeights {};
+    std::array<int, numCandidates> harmonicCounts {};
+    std::array<float, numCandidates> bounds {};
+    int pitchesAskedFor = 1;
+
+    static float getCandidateFrequency (int candidate)
+    {
+        auto note = (float) lowestNote + (float) candidate / (float) candidatesPerSemitone;
+        return 440.0f * std::exp2 ((note - 69.0f) / 12.0f);
+    }
+
+    // Weighted sum of the residual at a candidate's harmonics, each read as
+    // the largest of the three bins around it
+    float score (int candidate) const
+    {
+        auto* bins = harmonicBins.data() + candidate * numHarmonics;
+        auto* weights = harmonicWeights.data() + candidate * numHarmonics;
+        auto sum = 0.0f;
+
+        for (int harmonic = 0; harmonic < harmonicCounts[(size_t) candidate]; ++harmonic)
+        {
+            auto bin = (size_t) bins[harmonic];
+            sum += weights[harmonic] * std::max ({ residual[bin - 1], residual[bin], residual[bin + 1] });
+        }
+
+        return sum;
+    }
+
+    // Scores every candidate whose bound could still beat the best, starting
+    // with the one with the highest bound so most are ruled out at once, and
+    // leaves the scores as the next round's bounds. Returns -1 if none has
+    // any harmonics.
+    int findBestCandidate()
+    {
+        auto first = (int) (std::max_element (bounds.begin(), bounds.end()) - bounds.begin());
+
+        if (bounds[(size_t) first] <= 0.0f)
+            return -1;
+
+        auto best = first;
+        auto bestScore = bounds[(size_t) first] = score (first);
+
+        for (int candidate = 0; candidate < numCandidates; ++candidate)
+        {
+            if (candidate == first || bounds[(size_t) candidate] <= bestScore)
+                continue;
+
+            auto value = bounds[(size_t) candidate] = score (candidate);
+
+            if (value > bestScore)
+            {
+                best = candidate;
+                bestScore = value;
+            }
+        }
+
+        return best;
+    }
+
+    // Takes a found pitch's harmonics out of the residual and returns its
+    // frequency, refined in the full spectrum from the loudest of them. Each
+    // harmonic is cut to the mean of itself and its neighbours, where that is
+    // lower, so what stands above the pitch's own spectral envelope is left
+    // for the others.
+    float cancelHarmonics (int candidate, const float* magnitudes)
+    {
+        std::array<int, numHarmonics> peaks {};
+        std::array<float, numHarmonics> levels {};
+        auto count = harmonicCounts[(size_t) candidate];
+        auto* bins = harmonicBins.data() + candidate * numHarmonics;
+        auto refined = getCandidateFrequency (candidate);
+        auto loudest = 0.0f;
+
+        for (int harmonic = 0; harmonic < count; ++harmonic)
+        {
+            // Snap to the local maximum next to the predicted bin
+            auto bin = bins[harmonic];
+
+            if (residual[(size_t) bin - 1] > residual[(size_t) bin] && residual[(size_t) bin - 1] >= residual[(size_t) bin + 1] && bin > 1)
+                --bin;
+            else if (residual[(size_t) bin + 1] > residual[(size_t) bin] && bin < fftSize / 2 - 2)
+                ++bin;
+
+            peaks[(size_t) harmonic] = bin;
+            levels[(size_t) harmonic] = residual[(size_t) bin];
+
+            if (levels[(size_t) harmonic] > loudest)
+            {
+                loudest = levels[(size_t) harmonic];
+                refined = binToFrequency ((float) bin + interpolatePeakOffset (magnitudes, bin)) / (float) (harmonic + 1);
+            }
+        }
+
+        for (int harmonic = 0; harmonic < count; ++harmonic)
+        {
+            auto level = levels[(size_t) harmonic];
+
+            if (level <= 0.0f)
+                continue;
+
+            auto first = std::max (0, harmonic - 1), last = std::min (count - 1, harmonic + 1);
+            auto envelope = 0.0f;
+
+            for (int i = first; i <= last; ++i)
+                envelope += levels[(size_t) i];
+
+            auto keep = 1.0f - std::min (level, envelope / (float) (last - first + 1)) / level;
+            auto peak = (size_t) peaks[(size_t) harmonic];
+
+            for (auto bin = peak - 1; bin <= peak + 1; ++bin)
+                residual[bin] *= keep;
+        }
+
+        return refined;
+    }
+};
@@ -24,11 +24,17 @@ ResynthesiserAudioProcessorEditor::ResynthesiserAudioProcessorEditor (Resynthesi
 
     addAndMakeVisible(noteDisplayLabel);
     addAndMakeVisible(FFTDisplayLabel);
+    addAndMakeVisible(telemetryLabel);
+    addAndMakeVisible(noteHistoryList);
+
+    noteHistoryList.setRowHeight(18);
 
     noteDisplayLabel.setFont(juce::Font(20.0f));
     noteDisplayLabel.setColour(juce::Label::textColourId, juce::Colours::white);
     FFTDisplayLabel.setFont(juce::Font(20.0f));
     FFTDisplayLabel.setColour(juce::Label::textColourId, juce::Colours::white);
+    telemetryLabel.setFont(juce::Font(15.0f));
+    telemetryLabel.setColour(juce::Label::textColourId, juce::Colours::white);
 
     fundamentalSlider    .setSliderStyle (juce::Slider::SliderStyle::LinearHorizontal);
     rangeSlider.setSliderStyle (juce::Slider::SliderStyle::LinearHorizontal);
@@ -71,9 +77,15 @@ ResynthesiserAudioProcessorEditor::ResynthesiserAudioProcessorEditor (Resynthesi
     grainSizeLabel.attachToComponent(&grainSizeSlider, true);
     addAndMakeVisible(grainSizeLabel);
 
+    loadSnapshotButton.onClick = [this] { chooseSnapshotLibrary(); };
+    addAndMakeVisible(loadSnapshotButton);
+    snapshotLabel.setColour(juce::Label::textColourId, juce::Colours::white);
+    addAndMakeVisible(snapshotLabel);
+    showSnapshotLibrary();
+
 
 
-    setSize (800, 600);
+    setSize (800, 760);
     startTimer(60);
 }
 
@@ -89,12 +101,31 @@ void ResynthesiserAudioProcessorEditor::paint (juce::Graphics& g)
     g.setColour (juce::Colours::white);
     g.setFont (15.0f);
 
+    // Per-block load histogram, 10% buckets, tallest bucket at full height
+    if (telemetryStats.numBlocks > 0 && ! loadHistogramBounds.isEmpty())
+    {
+        auto tallest = *std::max_element (telemetryStats.loadHistogram.begin(), telemetryStats.loadHistogram.end());
+        auto barWidth = (float) loadHistogramBounds.getWidth() / (float) TelemetryStats::numLoadBuckets;
+
+        for (int bucket = 0; bucket < TelemetryStats::numLoadBuckets; ++bucket)
+        {
+            auto height = (float) loadHistogramBounds.getHeight() * (float) telemetryStats.loadHistogram[(size_t) bucket] / (float) tallest;
+
+            // Buckets from 100% up are blocks that missed their deadline
+            g.setColour (bucket >= 10 ? juce::Colours::red : juce::Colours::white);
+            g.fillRect ((float) loadHistogramBounds.getX() + (float) bucket * barWidth + 1.0f,
+                        (float) loadHistogramBounds.getBottom() - height,
+                        barWidth - 2.0f, height);
+        }
+    }
 }
 
 void ResynthesiserAudioProcessorEditor::resized()
 {
     noteDisplayLabel.setBounds(10, 10, getWidth() - 20, 50);
     FFTDisplayLabel.setBounds(10, 30, getWidth() - 20, 50);
+    telemetryLabel.setBounds(10, 50, getWidth() - 20, 50);
+    loadHistogramBounds = juce::Rectangle<int>(10, 105, getWidth() - 20, 85);
     
 //    juce::Rectangle<int> bounds = getLocalBounds();
 //    const int numParams = 6;
@@ -117,11 +148,138 @@ void ResynthesiserAudioProcessorEditor::resized()
     grainWindowSlider.setBounds (param5Bounds.reduced (margin));
     grainSizeSlider.setBounds (param6Bounds.reduced (margin));
 
+    loadSnapshotButton.setBounds(10, 528, 140, 24);
+    snapshotLabel.setBounds(160, 528, getWidth() - 170, 24);
+    noteHistoryList.setBounds(10, 560, getWidth() - 20, getHeight() - 570);
+
 }
 
 void ResynthesiserAudioProcessorEditor::timerCallback()
 {
-    noteDisplayLabel.setText(audioProcessor.lastNoteText, juce::dontSendNotification);
-    FFTDisplayLabel.setText(juce::String(audioProcessor.getFundamentalFrequency(),2), juce::dontSendNotification);
+    auto numNewEvents = 0;
+
+    for (NoteEvent event; audioProcessor.popNoteEvent(event); ++numNewEvents)
+    {
+        noteHistory.push_back(event);
+
+        if (noteHistory.size() > maxNoteHistory)
+            noteHistory.pop_front();
+    }
+
+    if (numNewEvents > 0)
+    {
+        auto noteText = describeNoteEvent(noteHistory.back());
+
+        if (auto dropped = audioProcessor.getNumDroppedNoteEvents())
+            noteText += " (" + juce::String(dropped) + " events dropped)";
+
+        noteDisplayLabel.setText(noteText, juce::dontSendNotification);
+        noteHistoryList.updateContent();
+        noteHistoryList.scrollToEnsureRowIsOnscreen((int) noteHistory.size() - 1);
+    }
+
+    juce::String fftText = juce::String(audioProcessor.getFundamentalFrequency(),2)
+                         + " Hz (~" + juce::String(audioProcessor.getPitchEstimatorCost() / 1000) + "k flop/frame)";
+
+    if (auto dropped = audioProcessor.getNumDroppedAnalysisFrames())
+        fftText += " (" + juce::String(dropped) + " frames dropped)";
+
+    FFTDisplayLabel.setText(fftText, juce::dontSendNotification);
+
+    if (TelemetryRecorder::enabled)
+    {
+        for (BlockTelemetry block; audioProcessor.popBlockTelemetry(block);)
+            telemetryStats.add(block);
+
+        auto& stats = telemetryStats;
+        juce::String telemetryText = "Load " + juce::String(100.0f * stats.getMeanLoad(), 1) + "% (worst " + juce::String(100.0f * stats.worstLoad, 0) + "%), "
+                                   + juce::String(stats.deadlineMisses) + " of " + juce::String(stats.numBlocks) + " blocks late, "
+                                   + juce::String(stats.activeVoices) + " voices (peak " + juce::String(stats.peakVoices) + "), "
+                                   + juce::String(stats.activeGrains) + " grains\n";
+
+        for (int stage = 0; stage < BlockTelemetry::numStages; ++stage)
+            telemetryText += juce::String(BlockTelemetry::getStageName(stage)) + " "
+                           + juce::String(stats.getMeanStageMicroseconds(stage), 1) + " us  ";
+
+        if (auto dropped = audioProcessor.getNumDroppedTelemetryBlocks())
+            telemetryText += "(" + juce::String(dropped) + " blocks dropped)";
+
+        telemetryLabel.setText(telemetryText, juce::dontSendNotification);
+    }
+    else
+    {
+        telemetryLabel.setText("Telemetry compiled out", juce::dontSendNotification);
+    }
+
     repaint();
 }
+
+void ResynthesiserAudioProcessorEditor::chooseSnapshotLibrary()
+{
+    snapshotChooser = std::make_unique<juce::FileChooser>("Load a snapshot library", audioProcessor.getSnapshotLibraryFile(), "*.rspf");
+
+    snapshotChooser->launchAsync(juce::FileBrowserComponent::openMode | juce::FileBrowserComponent::canSelectFiles,
+                                 [this] (const juce::FileChooser& chooser)
+                                 {
+                                     auto file = chooser.getResult();
+                                     juce::String error;
+
+                                     if (file == juce::File())
+                                         return;
+
+                                     if (audioProcessor.loadSnapshotLibrary(file, error))
+                                         showSnapshotLibrary();
+                                     else
+                                         showSnapshotLibrary(file.getFileName() + ": " + error);
+                                 });
+}
+
+void ResynthesiserAudioProcessorEditor::showSnapshotLibrary(const juce::String& error)
+{
+    auto file = audioProcessor.getSnapshotLibraryFile();
+
+    if (error.isNotEmpty())
+        snapshotLabel.setText(error, juce::dontSendNotification);
+    else
+        snapshotLabel.setText(file == juce::File() ? juce::String("No snapshot library") : file.getFileName(), juce::dontSendNotification);
+}
+
+juce::String ResynthesiserAudioProcessorEditor::describeNoteEvent(const NoteEvent& event)
+{
+    juce::String text;
+
+    switch (event.type)
+    {
+        case NoteEvent::noteOn:    text = "Note On: ";   break;
+        case NoteEvent::noteOff:   text = "Note Off: ";  break;
+        case NoteEvent::onset:     text = "Onset: ";     break;
+    }
+
+    text += ResynthesiserAudioProcessor::getNoteNameFromMidiNumber(event.note)
+          + " (MIDI: " + juce::String(event.note)
+          + ", Vel: " + juce::String(event.velocity) + ")";
+
+    if (event.type != NoteEvent::noteOff)
+        text += " at " + juce::String(event.frequency, 2) + " Hz";
+
+    // Only per-channel analysis has channels past the first
+    if (event.channel > 0)
+        text += " on channel " + juce::String(event.channel + 1);
+
+    return text + ", sample " + juce::String((juce::int64) (event.blockPosition + (uint64_t) event.sampleOffset));
+}
+
+int ResynthesiserAudioProcessorEditor::getNumRows()
+{
+    return (int) noteHistory.size();
+}
+
+void ResynthesiserAudioProcessorEditor::paintListBoxItem(int rowNumber, juce::Graphics& g, int width, int height, bool)
+{
+    if (rowNumber < 0 || rowNumber >= (int) noteHistory.size())
+        return;
+
+    g.setColour(juce::Colours::white);
+    g.setFont(14.0f);
+    g.drawText(describeNoteEvent(noteHistory[(size_t) rowNumber]), 4, 0, width - 8, height, juce::Justification::centredLeft);
+}
@@ -9,13 +9,15 @@
 #pragma once
 
 #include <JuceHeader.h>
+#include <deque>
 #include "PluginProcessor.h"
 
 //==============================================================================
 /**
 */
 class ResynthesiserAudioProcessorEditor  : public juce::AudioProcessorEditor,
-                                            public juce::Timer
+                                            public juce::Timer,
+                                            private juce::ListBoxModel
 {
 public:
     ResynthesiserAudioProcessorEditor (ResynthesiserAudioProcessor&);
@@ -26,17 +28,42 @@ public:
     void resized() override;
     void timerCallback() override;
 
+    // Formats an event for display, on the message thread
+    static juce::String describeNoteEvent(const NoteEvent& event);
+
 private:
     // This reference is provided as a quick way for your editor to
     // access the processor object that created it.
     ResynthesiserAudioProcessor& audioProcessor;
     juce::Label noteDisplayLabel;
     juce::Label FFTDisplayLabel;
+    juce::Label telemetryLabel;
+
+    // Everything drained from the processor since the editor opened
+    TelemetryStats telemetryStats;
+    juce::Rectangle<int> loadHistogramBounds;
+
+    // The most recent note events, oldest first. Kept as raw events: only the
+    // rows the list box actually paints are ever formatted
+    static constexpr size_t maxNoteHistory = 256;
+    std::deque<NoteEvent> noteHistory;
+    juce::ListBox noteHistoryList { "Note history", this };
+
+    int getNumRows() override;
+    void paintListBoxItem(int rowNumber, juce::Graphics& g, int width, int height, bool rowIsSelected) override;
 
     juce::Slider fundamentalSlider, rangeSlider, dragSlider, grainDensitySlider, grainWindowSlider, grainSizeSlider;
     juce::Label fundamentalLabel, rangeLabel, dragLabel, grainDensityLabel, grainWindowLabel, grainSizeLabel;
     juce::AudioProcessorValueTreeState::SliderAttachment fundamentalAttachment, dragAttachment, rangeAttachment, grainDensityAttachment, grainWindowAttachment, grainSizeAttachment;
 
+    // Picks a snapshot library for the partial tracks, shown by name
+    juce::TextButton loadSnapshotButton { "Load snapshot..." };
+    juce::Label snapshotLabel;
+    std::unique_ptr<juce::FileChooser> snapshotChooser;
+
+    void chooseSnapshotLibrary();
+    void showSnapshotLibrary(const juce::String& error = {});
+
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ResynthesiserAudioProcessorEditor)
 };
@@ -26,18 +26,30 @@ ResynthesiserAudioProcessor::ResynthesiserAudioProcessor()
                             std::make_unique<juce::AudioParameterFloat> (juce::ParameterID { "range", 1 },             "Range of Harmonics",                0.0f, 1.0f, 0.5f),
                             std::make_unique<juce::AudioParameterFloat>   (juce::ParameterID { "grainDensity",      1 }, "Number of concurrent sine grains",  0.0f, 1.0f, 0.5f),
                             std::make_unique<juce::AudioParameterFloat> (juce::ParameterID { "grainWindow",      1 },  "Individual Grain Shape",            0.0f, 1.0f, 0.5f),
-                            std::make_unique<juce::AudioParameterFloat>   (juce::ParameterID { "grainSize",      1 },    "Individual Grain Size",             0.0f, 1.0f, 0.5f)
-                        }),
-
-                    fft (fftOrder),
-                    window (fftSize, juce::dsp::WindowingFunction<float>::hann)
+                            std::make_unique<juce::AudioParameterFloat>   (juce::ParameterID { "grainSize",      1 },    "Individual Grain Size",             0.0f, 1.0f, 0.5f),
+                            std::make_unique<juce::AudioParameterChoice>  (juce::ParameterID { "hopSize",        1 },    "Analysis hop size",                 juce::StringArray { "256", "512", "1024", "2048" }, 1),
+                            std::make_unique<juce::AudioParameterChoice>  (juce::ParameterID { "pitchEstimator", 1 },    "Pitch estimator",                   juce::StringArray { "Parabolic peak", "Harmonic product", "YIN", "Multiple pitches" }, SpectralAnalyser::harmonicProduct),
+                            std::make_unique<juce::AudioParameterChoice>  (juce::ParameterID { "engine",         1 },    "Resynthesis engine",                juce::StringArray { "Sine bank", "Phase vocoder", "Partial tracking", "Core" }, sineBank),
+                            std::make_unique<juce::AudioParameterChoice>  (juce::ParameterID { "fftSize",        1 },    "Analysis FFT size",                 juce::StringArray { "256", "512", "1024", "2048", "4096", "8192", "16384" }, SpectralAnalyser::defaultFftOrder - SpectralAnalyser::minFftOrder),
+                            std::make_unique<juce::AudioParameterBool>    (juce::ParameterID { "lowLatency",     1 },    "Low latency analysis",              false),
+                            std::make_unique<juce::AudioParameterChoice>  (juce::ParameterID { "decimation",     1 },    "Analysis decimation",               juce::StringArray { "Off", "2", "4", "8" }, 0),
+                            std::make_unique<juce::AudioParameterChoice>  (juce::ParameterID { "analysisInput",  1 },    "Analysis input",                    juce::StringArray { "Mid", "Sum", "Per channel" }, midDownmix),
+                            std::make_unique<juce::AudioParameterChoice>  (juce::ParameterID { "voiceStealing",  1 },    "Voice stealing",                    juce::StringArray { "Oldest", "Quietest", "Nearest pitch" }, SineSynth::stealOldest),
+                            std::make_unique<juce::AudioParameterBool>    (juce::ParameterID { "parallelRender", 1 },    "Parallel rendering",                false),
+                            std::make_unique<juce::AudioParameterInt>     (juce::ParameterID { "maxPitches",     1 },    "Max pitches per frame",             1, AnalysisResult::maxPitches, 4),
+                            std::make_unique<juce::AudioParameterChoice>  (juce::ParameterID { "snapshotMode",   1 },    "Snapshot playback",                 juce::StringArray { "Off", "Play", "Freeze" }, snapshotOff)
+                        })
 
 #endif
 {
+    pipelines[0] = std::make_unique<Pipeline>(0);
+    state.addParameterListener("parallelRender", this);
 }
 
 ResynthesiserAudioProcessor::~ResynthesiserAudioProcessor()
 {
+    state.removeParameterListener("parallelRender", this);
+    cancelPendingUpdate();
 }
 
 //==============================================================================
@@ -105,16 +117,81 @@ void ResynthesiserAudioProcessor::changeProgramName (int index, const juce::Stri
 //==============================================================================
 void ResynthesiserAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
-    // Set the sample rate for the synth
-    mySineSynth.setCurrentPlaybackSampleRate(sampleRate);
-    juce::ignoreUnused(samplesPerBlock);
-    this->sampleRate = sampleRate;
+    maxBlockSize = juce::jmax(samplesPerBlock, 1);
+    auto engine = parameters.getIndex(ParameterLayer::engine);
+
+    // A pipeline for every input channel, even if the input is downmixed for
+    // now; ones beyond the channel count are stopped but kept
+    auto numNeeded = juce::jlimit(1, maxPipelines, getTotalNumInputChannels());
+
+    for (int i = 0; i < maxPipelines; ++i)
+    {
+        auto& pipeline = pipelines[(size_t) i];
+
+        if (i >= numNeeded)
+        {
+            if (pipeline != nullptr)
+                pipeline->analyser.release();
+
+            continue;
+        }
+
+        if (pipeline == nullptr)
+            pipeline = std::make_unique<Pipeline>(i);
+
+        // Set the sample rate for the synth
+        pipeline->synth.setCurrentPlaybackSampleRate(sampleRate);
+
+        // Offline renders analyse inline so every frame is seen and the output is repeatable
+        pipeline->analyser.prepare(sampleRate, maxBlockSize, isNonRealtime());
+
+        pipeline->vocoder.prepare(sampleRate);
+        pipeline->tracker.prepare(sampleRate);
+
+        // Preallocate everything the grain engine needs, the audio thread never allocates
+        pipeline->grains.prepare(sampleRate);
+
+        // The core builds its tables here, so takes the hop it is prepared with
+        pipeline->core.init((float) sampleRate, hopSizes[(size_t) parameters.getIndex(ParameterLayer::hopSize)]);
+
+        pipeline->onsets.prepare(sampleRate);
+        pipeline->reset();
+
+        configureAnalyser(pipeline->analyser, engine);
+    }
+
+    numPipelines.store(numNeeded, std::memory_order_release);
+    activePipelines = numNeeded;
+    analysisBuffer.setSize(1, maxBlockSize);
+
+    grainBuffer.setSize(1, maxBlockSize);
+    parameters.prepare(sampleRate, grainBuffer.getNumSamples());
+
+    vocoderBuffer.setSize(1, maxBlockSize);
+    partialBuffer.setSize(1, maxBlockSize);
+    coreBuffer.setSize(1, maxBlockSize);
+
+    // Worker threads only while parallel rendering is on
+    if (isParallelRenderOn())
+        startRenderPool();
+    else
+        stopRenderPool();
+
+    samplesProcessed = 0;
+
+    // Report the latency the current settings give before the first block
+    setLatencySamples(getEngineLatency(engine));
 }
 
 void ResynthesiserAudioProcessor::releaseResources()
 {
     // When playback stops, you can use this as an opportunity to free up any
     // spare memory, etc.
+    for (auto& pipeline : pipelines)
+        if (pipeline != nullptr)
+            pipeline->analyser.release();
+
+    stopRenderPool();
 }
 
 #ifndef JucePlugin_PreferredChannelConfigurations
@@ -125,11 +202,12 @@ bool ResynthesiserAudioProcessor::isBusesLayoutSupported (const BusesLayout& lay
     return true;
   #else
     // This is the place where you check if the layout is supported.
-    // In this template code we only support mono or stereo.
+    // Mono, stereo and surround, up to one analysis pipeline per channel.
     // Some plugin hosts, such as certain GarageBand versions, will only
     // load plugins that support stereo bus layouts.
-    if (layouts.getMainOutputChannelSet() != juce::AudioChannelSet::mono()
-     && layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
+    auto numChannels = layouts.getMainOutputChannelSet().size();
+
+    if (numChannels == 0 || numChannels > maxPipelines)
         return false;
 
     // This checks if the input layout matches the output layout
@@ -149,26 +227,54 @@ void ResynthesiserAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer
     auto totalNumInputChannels  = getTotalNumInputChannels();
     auto totalNumOutputChannels = getTotalNumOutputChannels();
 
-    float fundamental     = state.getParameter ("fundamental")->getValue();
-    float drag            = state.getParameter ("drag")->getValue();
-    float range           = state.getParameter ("range")->getValue();
-    float grainDensity    = state.getParameter ("grainDensity")->getValue();
-    float grainWindow     = state.getParameter ("grainWindow")->getValue();
-    float grainSize       = state.getParameter ("grainSize")->getValue();
+    telemetry.beginBlock(buffer.getNumSamples(), getSampleRate());
 
+    // One snapshot of every parameter for the whole block
+    parameters.update();
+    receiveSnapshots();
 
-    static int counter = 0;
-    
-    if( ++counter > 10)
+    auto engine = parameters.getIndex(ParameterLayer::engine);
+    auto perChannelInput = parameters.getIndex(ParameterLayer::analysisInput) == perChannel;
+
+    activatePipelines(perChannelInput ? juce::jlimit(1, numPipelines.load(std::memory_order_relaxed), totalNumInputChannels) : 1);
+
+    for (int i = 0; i < activePipelines; ++i)
+        configureAnalyser(pipelines[(size_t) i]->analyser, engine);
+
+    // Only ever a different value when a parameter has just changed
+    auto latency = getEngineLatency(engine);
+
+    if (latency != getLatencySamples())
+        setLatencySamples(latency);
+
+    // fundamental, drag and range are taken once per block (or per hop or
+    // frame), smoothed to where they are at its end. The tracker ramps to that
+    // pitch across the block. fundamental shifts by up to an octave either way,
+    // 0.5 leaves the pitch alone
+    auto pitchRatio = std::exp2(2.0f * parameters.advance(ParameterLayer::fundamental, buffer.getNumSamples()) - 1.0f);
+    auto drag = parameters.advance(ParameterLayer::drag, buffer.getNumSamples());
+    parameters.advance(ParameterLayer::range, buffer.getNumSamples());
+
+    auto stealingPolicy = (SineSynth::StealingPolicy) parameters.getIndex(ParameterLayer::voiceStealing);
+    auto* pool = parameters.getIndex(ParameterLayer::parallelRender) != 0 && renderPoolReady.load(std::memory_order_acquire) ? &renderPool : nullptr;
+
+    for (int i = 0; i < activePipelines; ++i)
     {
-        counter = 0;
-        auto amplitude = getRMSAmplitude(buffer);
+        auto& tracker = pipelines[(size_t) i]->tracker;
+
+        pipelines[(size_t) i]->synth.setStealingPolicy(stealingPolicy);
+        tracker.setWorkerPool(pool);
 
-        mySineSynth.triggerNote(
-            frequencyToNearestMidiNote(getFundamentalFrequency()),// message.getNoteNumber(),
-                                amplitude);
+        // Tracks fade with the frames that no longer have their peaks, so leaving
+        // the mode just silences them
+        if (engine != partialTracking && tracker.getNumActiveTracks() > 0)
+            tracker.reset();
+
+        tracker.setParameters(pitchRatio, drag, buffer.getNumSamples());
     }
 
+    telemetry.endStage(BlockTelemetry::other);
+
     // In case we have more outputs than inputs, this code clears any output
     // channels that didn't contain input data, (because these aren't
     // guaranteed to be empty - they may contain garbage).
@@ -177,53 +283,145 @@ void ResynthesiserAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer
     // this code if your algorithm always overwrites all the output channels.
     for (auto i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
         buffer.clear (i, 0, buffer.getNumSamples());
-    
 
-    // Iterate through MIDI messages directly
-    for (const auto metadata : midiMessages)
+    for (int i = 0; i < activePipelines; ++i)
     {
-        auto message = metadata.getMessage();
-        
-        // Note On
-        if (message.isNoteOn())
+        pipelines[(size_t) i]->events.clear();
+        scheduleMidi(*pipelines[(size_t) i], midiMessages, buffer.getNumSamples());
+    }
+
+    telemetry.endStage(BlockTelemetry::noteTriggering);
+
+    // Each pipeline's input goes into its analyser's ring in one copy, and
+    // through its onset detector, a block (of the size promised) at a time
+    if (totalNumInputChannels > 0)
+    {
+        for (int offset = 0; offset < buffer.getNumSamples(); offset += analysisBuffer.getNumSamples())
         {
-            // Trigger the synth
-            mySineSynth.triggerNote(
-                frequencyToNearestMidiNote(getFundamentalFrequency()),// message.getNoteNumber(),
-                message.getVelocity() / 127.0f
-            );
-
-            // Create readable note name
-            int midiNote = message.getNoteNumber();
-            juce::String noteName = getNoteNameFromMidiNumber(midiNote);
-
-            lastNoteText = "Note On: " + noteName +
-                           " (MIDI: " + juce::String(midiNote) +
-                           ", Vel: " + juce::String(message.getVelocity()) + ")";
+            auto numSamples = juce::jmin(analysisBuffer.getNumSamples(), buffer.getNumSamples() - offset);
+
+            for (int i = 0; i < activePipelines; ++i)
+            {
+                auto& pipeline = *pipelines[(size_t) i];
+                auto* input = getAnalysisInput(buffer, i, offset, numSamples, analysisBuffer.getWritePointer(0));
+
+                pipeline.analyser.pushSamples(input, numSamples);
+                telemetry.endStage(BlockTelemetry::analysisPush);
+
+                scheduleOnsets(pipeline, input, numSamples, offset, engine);
+                telemetry.endStage(BlockTelemetry::noteTriggering);
+            }
         }
-        // Note Off
-        else if (message.isNoteOff())
+    }
+
+    for (int i = 0; i < activePipelines; ++i)
+        pipelines[(size_t) i]->delayedEvents.process(pipelines[(size_t) i]->events, samplesProcessed, buffer.getNumSamples(), latency);
+
+    telemetry.endStage(BlockTelemetry::noteTriggering);
+
+    for (int i = 0; i < activePipelines; ++i)
+    {
+        auto& pipeline = *pipelines[(size_t) i];
+
+        // Timed by the analyser itself, and charged when the results are popped
+        if (pipeline.analyser.isAnalysingInline())
+            pipeline.analyser.analysePendingFrames();
+
+        // Every frame analysed since the last block, including this one's when
+        // analysing inline
+        popAnalysisResults(pipeline, engine);
+    }
+
+    if (isPlayingSnapshot(engine))
+        playSnapshot(buffer.getNumSamples());
+
+    // Each pipeline's grains follow its own pitch, at the level of what it
+    // analyses: the whole input for the downmix, its own channel otherwise
+    for (int i = 0; i < activePipelines; ++i)
+    {
+        auto level = perChannelInput && i < totalNumInputChannels
+                         ? getRMSAmplitude(juce::AudioBuffer<float>(buffer.getArrayOfWritePointers() + i, 1, buffer.getNumSamples()))
+                         : getRMSAmplitude(buffer);
+
+        pipelines[(size_t) i]->grains.setTarget(pipelines[(size_t) i]->currentFundamental, level);
+    }
+
+    telemetry.endStage(BlockTelemetry::other);
+
+    // The output is the resynthesis alone. The input has been analysed, and
+    // the analysis is what the reported latency delays, so any dry signal left
+    // in the buffer would be early by that much. The vocoder and the core
+    // write over the channels they play on as they read them, the rest are
+    // cleared now.
+    auto numWrittenOver = engine == phaseVocoder || engine == embeddedCore
+                              ? (perChannelInput ? juce::jmin(activePipelines, totalNumOutputChannels) : totalNumOutputChannels)
+                              : 0;
+
+    for (auto i = numWrittenOver; i < totalNumInputChannels; ++i)
+        buffer.clear(i, 0, buffer.getNumSamples());
+
+    // The downmix plays on every output, each channel's pipeline only on its own
+    int activeVoices = 0;
+    int activeGrains = 0;
+
+    for (int i = 0; i < activePipelines; ++i)
+    {
+        auto& pipeline = *pipelines[(size_t) i];
+        auto numOutputs = perChannelInput ? (i < totalNumOutputChannels ? 1 : 0) : totalNumOutputChannels;
+
+        if (numOutputs > 0)
         {
-            // Release the note
-            mySineSynth.releaseNote(message.getNoteNumber());
+            juce::AudioBuffer<float> output(buffer.getArrayOfWritePointers() + (perChannelInput ? i : 0),
+                                            numOutputs, buffer.getNumSamples());
+            renderPipeline(pipeline, buffer, output, engine, pitchRatio);
+        }
 
-            lastNoteText = "Note Off: " +
-                           juce::String(message.getNoteNumber());
+        if (engine == partialTracking)
+            activeVoices += pipeline.tracker.getNumActiveTracks();
+        else if (engine == embeddedCore)
+        {
+            activeVoices += pipeline.core.getNumActivePartials();
+            activeGrains += pipeline.core.getNumActiveGrains();
+        }
+        else
+        {
+            activeVoices += pipeline.synth.getNumActiveVoices();
         }
     }
-    
-    //Load samples into FFT
-    for (int channel = 0; channel < totalNumInputChannels; ++channel)
+
+    telemetry.endStage(BlockTelemetry::render);
+
+    // Render the grain clouds on top, following the smoothed grain parameters,
+    // in chunks in case the host sends a bigger block than promised. Like the
+    // engines, the downmix's cloud plays on every output, each channel's only
+    // on its own. The core plays its own.
+    for (int offset = 0; engine != embeddedCore && offset < buffer.getNumSamples(); offset += grainBuffer.getNumSamples())
     {
-        auto* channelData = buffer.getReadPointer(0);
-        for (int i = 0; i < buffer.getNumSamples(); ++i)
+        auto numSamples = juce::jmin(grainBuffer.getNumSamples(), buffer.getNumSamples() - offset);
+        auto* density = parameters.getRamp(ParameterLayer::grainDensity, numSamples);
+        auto* window = parameters.getRamp(ParameterLayer::grainWindow, numSamples);
+        auto* size = parameters.getRamp(ParameterLayer::grainSize, numSamples);
+
+        for (int i = 0; i < activePipelines; ++i)
         {
-             pushNextSampleIntoFifo(channelData[i]);
+            auto firstOutput = perChannelInput ? i : 0;
+            auto endOutput = perChannelInput ? juce::jmin(i + 1, totalNumOutputChannels) : totalNumOutputChannels;
+
+            grainBuffer.clear();
+            pipelines[(size_t) i]->grains.render(grainBuffer.getWritePointer(0), numSamples, density, window, size);
+
+            for (int channel = firstOutput; channel < endOutput; ++channel)
+                buffer.addFrom(channel, offset, grainBuffer, 0, 0, numSamples);
         }
     }
 
-    // Render synth audio
-    mySineSynth.renderNextBlock(buffer, midiMessages, 0, buffer.getNumSamples());
+    for (int i = 0; engine != embeddedCore && i < activePipelines; ++i)
+        activeGrains += pipelines[(size_t) i]->grains.getNumActive();
+
+    samplesProcessed += (uint64_t) buffer.getNumSamples();
+
+    telemetry.endStage(BlockTelemetry::grains);
+    telemetry.endBlock(activeVoices, activeGrains);
 
     // This is the place where you'd normally do the guts of your plugin's
     // audio processing...
@@ -233,6 +431,492 @@ void ResynthesiserAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer
     // interleaved by keeping the same state.
 }
 
+// Runs the first numActive pipelines from this block on. Ones that sat idle
+// start again from silence rather than from where they stopped.
+void ResynthesiserAudioProcessor::activatePipelines(int numActive)
+{
+    for (int i = activePipelines; i < numActive; ++i)
+        pipelines[(size_t) i]->reset();
+
+    activePipelines = numActive;
+}
+
+// The settings every analyser follows, from this block's parameters. Peaks
+// are only extracted for the tracker.
+void ResynthesiserAudioProcessor::configureAnalyser(SpectralAnalyser& analyser, int engine)
+{
+    analyser.setHopSize(hopSizes[(size_t) parameters.getIndex(ParameterLayer::hopSize)]);
+    analyser.setPitchEstimator(parameters.getIndex(ParameterLayer::pitchEstimator));
+    analyser.setMaxPitches(parameters.getIndex(ParameterLayer::maxPitches));
+    analyser.setFftOrder(SpectralAnalyser::minFftOrder + parameters.getIndex(ParameterLayer::fftSize));
+    analyser.setLowLatency(parameters.getIndex(ParameterLayer::lowLatency) != 0);
+    analyser.setDecimation(1 << parameters.getIndex(ParameterLayer::decimation));
+    analyser.setMaxPeaks(engine == partialTracking ? PeakFrame::maxPeaks : 0);
+}
+
+// What a pipeline analyses, numSamples from offset: its own input channel in
+// per-channel mode or when there is only one, otherwise the mean or sum of
+// every input channel, mixed into mix.
+const float* ResynthesiserAudioProcessor::getAnalysisInput(const juce::AudioBuffer<float>& buffer, int pipeline, int offset,
+                                                           int numSamples, float* mix) const
+{
+    auto numInputs = juce::jmin(getTotalNumInputChannels(), buffer.getNumChannels());
+
+    if (activePipelines > 1 || numInputs == 1)
+        return buffer.getReadPointer(pipeline, offset);
+
+    auto gain = parameters.getIndex(ParameterLayer::analysisInput) == sumDownmix ? 1.0f : 1.0f / (float) numInputs;
+
+    juce::FloatVectorOperations::copyWithMultiply(mix, buffer.getReadPointer(0, offset), gain, numSamples);
+
+    for (int channel = 1; channel < numInputs; ++channel)
+        juce::FloatVectorOperations::addWithMultiply(mix, buffer.getReadPointer(channel, offset), gain, numSamples);
+
+    return mix;
+}
+
+// Plays one pipeline's events through the selected engine, adding it to
+// every channel of output. buffer is the whole block, for the vocoder's and
+// the core's input: they write over it as they read it, where the other
+// engines find the outputs already cleared.
+void ResynthesiserAudioProcessor::renderPipeline(Pipeline& pipeline, juce::AudioBuffer<float>& buffer,
+                                                 juce::AudioBuffer<float>& output, int engine, float pitchRatio)
+{
+    if (engine != sineBank)
+    {
+        // Nothing to render between events, the notes are only logged
+        for (auto& event : pipeline.events)
+            dispatchEvent(pipeline, event, engine);
+    }
+
+    if (engine == phaseVocoder)
+    {
+        pipeline.vocoder.setParameters(pitchRatio,
+                                       pipeline.currentFundamental,
+                                       parameters.getSmoothed(ParameterLayer::range),
+                                       parameters.getSmoothed(ParameterLayer::drag));
+
+        // Resynthesise the analysed input and write it over the outputs' input, before anything else is mixed in
+        for (int offset = 0; offset < buffer.getNumSamples(); offset += vocoderBuffer.getNumSamples())
+        {
+            auto numSamples = juce::jmin(vocoderBuffer.getNumSamples(), buffer.getNumSamples() - offset);
+            auto* resynthesis = vocoderBuffer.getWritePointer(0);
+
+            if (getTotalNumInputChannels() > 0)
+                pipeline.vocoder.process(getAnalysisInput(buffer, pipeline.channel, offset, numSamples, resynthesis),
+                                         resynthesis, numSamples);
+            else
+                vocoderBuffer.clear();
+
+            for (int channel = 0; channel < output.getNumChannels(); ++channel)
+                output.copyFrom(channel, offset, vocoderBuffer, 0, 0, numSamples);
+        }
+    }
+    else if (engine == partialTracking)
+    {
+        // The tracks follow the analysis on their own, the events don't touch them
+        for (int offset = 0; offset < buffer.getNumSamples(); offset += partialBuffer.getNumSamples())
+        {
+            auto numSamples = juce::jmin(partialBuffer.getNumSamples(), buffer.getNumSamples() - offset);
+            partialBuffer.clear();
+            pipeline.tracker.render(partialBuffer.getWritePointer(0), numSamples);
+
+            for (int channel = 0; channel < output.getNumChannels(); ++channel)
+                output.addFrom(channel, offset, partialBuffer, 0, 0, numSamples);
+        }
+    }
+    else if (engine == embeddedCore)
+    {
+        // The core analyses and plays the input by itself, grains and all, as it
+        // does on the module. It takes the parameters up at its next frame.
+        resynth::Parameters coreParameters;
+        coreParameters.pitchRatio = pitchRatio;
+        coreParameters.drag = parameters.getSmoothed(ParameterLayer::drag);
+        coreParameters.range = parameters.getSmoothed(ParameterLayer::range);
+        coreParameters.grainDensity = parameters.get(ParameterLayer::grainDensity);
+        coreParameters.grainWindow = parameters.get(ParameterLayer::grainWindow);
+        coreParameters.grainSize = parameters.get(ParameterLayer::grainSize);
+        pipeline.core.setParameters(coreParameters);
+
+        for (int offset = 0; offset < buffer.getNumSamples(); offset += coreBuffer.getNumSamples())
+        {
+            auto numSamples = juce::jmin(coreBuffer.getNumSamples(), buffer.getNumSamples() - offset);
+            auto* resynthesis = coreBuffer.getWritePointer(0);
+
+            if (getTotalNumInputChannels() > 0)
+                pipeline.core.process(getAnalysisInput(buffer, pipeline.channel, offset, numSamples, resynthesis),
+                                      resynthesis, numSamples);
+            else
+                coreBuffer.clear();
+
+            for (int channel = 0; channel < output.getNumChannels(); ++channel)
+                output.copyFrom(channel, offset, coreBuffer, 0, 0, numSamples);
+        }
+    }
+    else
+    {
+        // Render synth audio up to each event, then apply it, so every note
+        // starts on its own sample whatever the block size
+        int position = 0;
+
+        for (auto& event : pipeline.events)
+        {
+            if (event.sampleOffset > position)
+            {
+                pipeline.synth.renderNextBlock(output, position, event.sampleOffset - position);
+                position = event.sampleOffset;
+            }
+
+            dispatchEvent(pipeline, event, engine);
+        }
+
+        if (position < output.getNumSamples())
+            pipeline.synth.renderNextBlock(output, position, output.getNumSamples() - position);
+    }
+}
+
+// Takes every frame analysed since the last call, in order, and follows the
+// fundamental. Short frames, in low-latency mode, set it whenever they find
+// a pitch; the long frames set it the rest of the time, which covers the low
+// register and any pause in the short frames.
+void ResynthesiserAudioProcessor::popAnalysisResults(Pipeline& pipeline, int engine)
+{
+    auto& analyser = pipeline.analyser;
+
+    if (parameters.getIndex(ParameterLayer::lowLatency) == 0)
+        pipeline.fastTierHasPitch = false;
+
+    for (AnalysisResult result; analyser.popResult(result);)
+    {
+        telemetry.addStageTime(BlockTelemetry::analysis, result.analysisNanoseconds);
+
+        if (result.fastTier)
+        {
+            pipeline.fastTierHasPitch = result.fundamental > 0.0f;
+
+            if (pipeline.fastTierHasPitch)
+                pipeline.currentFundamental = result.fundamental;
+
+            continue;
+        }
+
+        if (! pipeline.fastTierHasPitch)
+            pipeline.currentFundamental = result.fundamental;
+
+        pipeline.currentPitches = result.pitches;
+        pipeline.numCurrentPitches = result.numPitches;
+
+        pipeline.onsets.addSpectralFlux(result.spectralFlux);
+
+        // Each frame's peaks are published just before its result
+        for (auto* frame = analyser.beginReadingPeaks(); frame != nullptr && frame->frameIndex <= result.frameIndex;
+             frame = analyser.beginReadingPeaks())
+        {
+            if (engine == partialTracking && ! isPlayingSnapshot(engine) && frame->frameIndex == result.frameIndex)
+                trackPartials(pipeline, frame->peaks.data(), frame->numPeaks, result.fundamental);
+
+            analyser.finishReadingPeaks();
+        }
+    }
+}
+
+// What the host is told to compensate for, the same for every pipeline. The
+// vocoder's is exact. Notes on the sine bank are held back until the
+// analysis can have a frame that starts after them. The tracks follow each
+// frame as it arrives, so lag by about half a frame, where its peaks are
+// centred, plus the time to get it.
+int ResynthesiserAudioProcessor::getEngineLatency(int engine) const
+{
+    auto& analyser = pipelines[0]->analyser;
+
+    switch (engine)
+    {
+        case phaseVocoder:    return PhaseVocoder::latency;
+        case partialTracking: return analyser.getPeakLatency() + analyser.getAnalysisDelay(maxBlockSize);
+        case embeddedCore:    return resynth::ModuleResynthesiser::getLatency();
+        default:              return analyser.getPitchLatency() + analyser.getAnalysisDelay(maxBlockSize);
+    }
+}
+
+// Turning parallel rendering on can come from the audio thread, which must
+// not start threads, so the pool is started on the message thread
+void ResynthesiserAudioProcessor::parameterChanged(const juce::String&, float newValue)
+{
+    if (newValue >= 0.5f)
+        triggerAsyncUpdate();
+}
+
+void ResynthesiserAudioProcessor::handleAsyncUpdate()
+{
+    if (isParallelRenderOn())
+        startRenderPool();
+}
+
+bool ResynthesiserAudioProcessor::isParallelRenderOn() const
+{
+    return state.getRawParameterValue("parallelRender")->load() >= 0.5f;
+}
+
+// Safe while processBlock runs, which only takes the pool once it is ready
+void ResynthesiserAudioProcessor::startRenderPool()
+{
+    const juce::ScopedLock lock(renderPoolLock);
+
+    if (renderPoolReady.load(std::memory_order_relaxed))
+        return;
+
+    // One core is left to the host
+    renderPool.prepare(juce::jlimit(0, 3, juce::SystemStats::getNumCpus() - 2));
+    renderPoolReady.store(true, std::memory_order_release);
+}
+
+// Only when processBlock can't be running, as it may be using the pool
+void ResynthesiserAudioProcessor::stopRenderPool()
+{
+    const juce::ScopedLock lock(renderPoolLock);
+
+    renderPoolReady.store(false, std::memory_order_relaxed);
+    renderPool.release();
+}
+
+// Adds the host's MIDI to a pipeline's events, in sample order. Every
+// pipeline gets all of it. Nothing is applied yet.
+void ResynthesiserAudioProcessor::scheduleMidi(Pipeline& pipeline, const juce::MidiBuffer& midiMessages, int numSamples)
+{
+    for (const auto metadata : midiMessages)
+    {
+        auto message = metadata.getMessage();
+
+        ScheduledEvent event;
+        event.sampleOffset = juce::jlimit(0, juce::jmax(0, numSamples - 1), metadata.samplePosition);
+        event.note = (uint8_t) message.getNoteNumber();
+        event.velocity = message.getFloatVelocity();
+
+        if (message.isNoteOn())
+        {
+            event.type = ScheduledEvent::noteOn;
+        }
+        else if (message.isNoteOff())
+        {
+            event.type = ScheduledEvent::noteOff;
+        }
+        else if (metadata.numBytes <= (int) event.midiData.size())
+        {
+            event.type = ScheduledEvent::midi;
+            event.midiSize = (uint8_t) metadata.numBytes;
+            std::copy(metadata.data, metadata.data + metadata.numBytes, event.midiData.begin());
+        }
+        else
+        {
+            continue; // sysex, the synth has no use for it
+        }
+
+        pipeline.events.add(event);
+    }
+}
+
+// Adds the onsets in numSamples of a pipeline's input, which starts
+// blockOffset samples into the block, to its events.
+void ResynthesiserAudioProcessor::scheduleOnsets(Pipeline& pipeline, const float* input, int numSamples, int blockOffset, int engine)
+{
+    // Always run, so the detector's thresholds keep up with the input, but
+    // the vocoder has no notes to start
+    auto numOnsets = pipeline.onsets.process(input, numSamples, blockOnsets.data(), maxOnsetsPerBlock);
+
+    if (engine != sineBank)
+        return;
+
+    for (int i = 0; i < numOnsets; ++i)
+    {
+        ScheduledEvent event;
+        event.type = ScheduledEvent::onset;
+        event.sampleOffset = blockOffset + blockOnsets[(size_t) i].sampleOffset;
+        event.velocity = juce::jmin(1.0f, blockOnsets[(size_t) i].level);
+        pipeline.events.add(event);
+    }
+}
+
+// Follows one frame's peaks, lowest first, with the partial tracks, and logs
+// the tracks that start or end as notes. range keeps the same band of
+// harmonics as it does for the vocoder: the first 1 to maxHarmonics of the
+// fundamental, or everything at 1 or when no fundamental is known.
+void ResynthesiserAudioProcessor::trackPartials(Pipeline& pipeline, const SpectralPeak* peaks, int numPeaks, float fundamental)
+{
+    auto range = parameters.getSmoothed(ParameterLayer::range);
+
+    if (range < 1.0f && fundamental > 0.0f)
+    {
+        auto highest = (1.5f + range * (float) (PhaseVocoder::maxHarmonics - 1)) * fundamental;
+        auto end = std::lower_bound(peaks, peaks + numPeaks, highest,
+                                     [] (const SpectralPeak& peak, float frequency) { return peak.frequency < frequency; });
+        numPeaks = (int) (end - peaks);
+    }
+
+    auto numChanges = pipeline.tracker.addFrame(peaks, numPeaks, trackChanges.data(), (int) trackChanges.size());
+
+    for (int i = 0; i < numChanges; ++i)
+    {
+        auto& change = trackChanges[(size_t) i];
+
+        NoteEvent logged;
+        logged.type = change.born ? NoteEvent::onset : NoteEvent::noteOff;
+        logged.note = (uint8_t) juce::jlimit(0, 127, frequencyToNearestMidiNote(change.frequency));
+        logged.velocity = (uint8_t) juce::jlimit(0, 127, juce::roundToInt(change.amplitude * 127.0f));
+        logged.frequency = change.frequency;
+        logged.blockPosition = samplesProcessed;
+        logged.channel = pipeline.channel;
+        noteEvents.push(logged);
+    }
+}
+
+// Takes up the library loaded most recently, if any, from its first frame,
+// and sends back the ones it replaces. One that can't be sent back stays
+// mapped until the processor goes.
+void ResynthesiserAudioProcessor::receiveSnapshots()
+{
+    for (SpectralSnapshotLibrary* next = nullptr; incomingSnapshots.pop(next);)
+    {
+        if (snapshot != nullptr)
+            retiredSnapshots.push(snapshot);
+
+        snapshot = next;
+        snapshotFrame = 0;
+        snapshotSamples = 0.0;
+    }
+}
+
+bool ResynthesiserAudioProcessor::isPlayingSnapshot(int engine) const
+{
+    return engine == partialTracking && snapshot != nullptr && snapshot->getNumFrames() > 0
+        && parameters.getIndex(ParameterLayer::snapshotMode) != snapshotOff;
+}
+
+// Feeds every pipeline's tracks the library's frames in place of the live
+// peaks, one per recorded hop at this sample rate. Play loops back to the
+// start at the end; Freeze feeds the frame it stopped on again every hop, so
+// the tracks hold it. The partials go to the tracker straight from the
+// mapping.
+void ResynthesiserAudioProcessor::playSnapshot(int numSamples)
+{
+    auto hop = (double) snapshot->getHopSize() * getSampleRate() / snapshot->getSampleRate();
+    auto freeze = parameters.getIndex(ParameterLayer::snapshotMode) == snapshotFreeze;
+    auto numPlayed = 0;
+
+    if (! (hop > 0.0))
+        return;
+
+    for (snapshotSamples += numSamples; snapshotSamples >= hop; snapshotSamples -= hop)
+    {
+        if (numPlayed++ < maxSnapshotFramesPerBlock)
+        {
+            auto frame = snapshot->getFrame(snapshotFrame);
+
+            for (int i = 0; i < activePipelines; ++i)
+                trackPartials(*pipelines[(size_t) i], frame.partials, frame.numPartials, frame.fundamental);
+        }
+
+        if (! freeze)
+            snapshotFrame = (snapshotFrame + 1) % snapshot->getNumFrames();
+    }
+}
+
+// Message thread: unmaps the libraries the audio thread has finished with
+void ResynthesiserAudioProcessor::freeRetiredSnapshots()
+{
+    for (SpectralSnapshotLibrary* retired = nullptr; retiredSnapshots.pop(retired);)
+        snapshotLibraries.removeObject(retired);
+}
+
+bool ResynthesiserAudioProcessor::loadSnapshotLibrary(const juce::File& file, juce::String& error)
+{
+    freeRetiredSnapshots();
+
+    auto library = SpectralSnapshotLibrary::open(file, error);
+
+    if (library == nullptr)
+        return false;
+
+    if (! incomingSnapshots.push(library.get()))
+    {
+        error = "still waiting for the audio thread to take up the last library";
+        return false;
+    }
+
+    snapshotLibraries.add(library.release());
+    state.state.setProperty("snapshotLibrary", file.getFullPathName(), nullptr);
+    return true;
+}
+
+void ResynthesiserAudioProcessor::clearSnapshotLibrary()
+{
+    freeRetiredSnapshots();
+    incomingSnapshots.push(nullptr);
+    state.state.removeProperty("snapshotLibrary", nullptr);
+}
+
+juce::File ResynthesiserAudioProcessor::getSnapshotLibraryFile() const
+{
+    auto path = state.state.getProperty("snapshotLibrary").toString();
+    return path.isEmpty() ? juce::File() : juce::File(path);
+}
+
+// Applies one event to a pipeline's synth and logs it for the editor
+void ResynthesiserAudioProcessor::dispatchEvent(Pipeline& pipeline, const ScheduledEvent& event, int engine)
+{
+    NoteEvent logged;
+    logged.velocity = (uint8_t) juce::jlimit(0, 127, juce::roundToInt(event.velocity * 127.0f));
+    logged.sampleOffset = event.sampleOffset;
+    logged.frequency = pipeline.currentFundamental;
+    logged.blockPosition = samplesProcessed;
+    logged.channel = pipeline.channel;
+
+    switch (event.type)
+    {
+        case ScheduledEvent::noteOn:
+        case ScheduledEvent::onset:
+        {
+            // Whatever note was asked for, the analysed one is played, or with
+            // several pitches in the frame, a voice for each, as loud as it is
+            // salient
+            auto chord = pipeline.numCurrentPitches > 1;
+            auto numNotes = chord ? pipeline.numCurrentPitches : 1;
+
+            logged.type = event.type == ScheduledEvent::noteOn ? NoteEvent::noteOn : NoteEvent::onset;
+
+            for (int i = 0; i < numNotes; ++i)
+            {
+                auto& pitch = pipeline.currentPitches[(size_t) i];
+                auto frequency = chord ? pitch.frequency : pipeline.currentFundamental;
+                auto velocity = chord ? event.velocity * pitch.confidence : event.velocity;
+                auto note = frequencyToNearestMidiNote(frequency);
+
+                if (engine == sineBank)
+                    pipeline.synth.triggerNote(note, velocity);
+
+                logged.note = (uint8_t) juce::jlimit(0, 127, note);
+                logged.frequency = frequency;
+                logged.velocity = (uint8_t) juce::jlimit(0, 127, juce::roundToInt(velocity * 127.0f));
+                noteEvents.push(logged);
+            }
+
+            return;
+        }
+
+        case ScheduledEvent::noteOff:
+            pipeline.synth.releaseNote(event.note);
+
+            logged.type = NoteEvent::noteOff;
+            logged.note = event.note;
+            break;
+
+        case ScheduledEvent::midi:
+            pipeline.synth.handleMessage(juce::MidiMessage(event.midiData.data(), event.midiSize));
+            return;
+    }
+
+    noteEvents.push(logged);
+}
+
 //==============================================================================
 bool ResynthesiserAudioProcessor::hasEditor() const
 {
@@ -254,7 +938,20 @@ void ResynthesiserAudioProcessor::getStateInformation (juce::MemoryBlock& destDa
 void ResynthesiserAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
 {
     if (auto xmlState = getXmlFromBinary (data, sizeInBytes))
+    {
         state.replaceState (juce::ValueTree::fromXml (*xmlState));
+
+        // The state has the library's path, not its frames. One that has gone
+        // missing stops playback but keeps its path, so saving again doesn't
+        // lose it
+        auto file = getSnapshotLibraryFile();
+        juce::String error;
+
+        if (file == juce::File())
+            clearSnapshotLibrary();
+        else if (! loadSnapshotLibrary (file, error))
+            incomingSnapshots.push (nullptr);
+    }
 }
 
 //==============================================================================
@@ -10,15 +10,58 @@
 
 #include <JuceHeader.h>
 #include "SineSynth.h"
+#include "SpectralAnalyser.h"
+#include "GrainEngine.h"
+#include "ParameterLayer.h"
+#include "PhaseVocoder.h"
+#include "Telemetry.h"
+#include "NoteEventLog.h"
+#include "EventScheduler.h"
+#include "OnsetDetector.h"
+#include "PartialTracker.h"
+#include "SpectralSnapshot.h"
+#include "../Core/Resynthesiser.h"
 
 //==============================================================================
 /**
 */
-class ResynthesiserAudioProcessor  : public juce::AudioProcessor
+class ResynthesiserAudioProcessor  : public juce::AudioProcessor,
+                                      private juce::AudioProcessorValueTreeState::Listener,
+                                      private juce::AsyncUpdater
 {
 public:
     juce::AudioProcessorValueTreeState state;
 
+    // What turns the analysis back into sound, chosen by the "engine" parameter
+    enum Engine
+    {
+        sineBank = 0, // notes on the SineSynth, cost grows with the number of partials
+        phaseVocoder, // fixed cost per hop, for dense or noisy input
+        partialTracking, // persistent oscillators gliding after the analysis, no retriggering
+        embeddedCore // the portable core (Core/), as the module plays it: its own analysis, partials and grains
+    };
+
+    // What the analysis listens to, chosen by the "analysisInput" parameter
+    enum AnalysisInput
+    {
+        midDownmix = 0, // the mean of the input channels, analysed once and played on every output
+        sumDownmix,     // their sum, for quiet stems
+        perChannel      // each input channel analysed on its own, played by its own voices on its own output
+    };
+
+    // What the partial tracks follow while a snapshot library is loaded,
+    // chosen by the "snapshotMode" parameter
+    enum SnapshotMode
+    {
+        snapshotOff = 0, // the live analysis, as without a library
+        snapshotPlay,    // the library's frames at their recorded rate, looping
+        snapshotFreeze   // one frame of it, held
+    };
+
+    // Input channels that can each have their own analysis, and the widest
+    // layout supported
+    static constexpr int maxPipelines = 8;
+
     //==============================================================================
     ResynthesiserAudioProcessor();
     ~ResynthesiserAudioProcessor() override;
@@ -61,23 +104,66 @@ public:
     void handleIncomingMidiMessage(const juce::MidiMessage& message);
     void addMidiMessage(const juce::MidiMessage& message);
     
+    // Message thread only: the next note played or released, oldest first
+    bool popNoteEvent(NoteEvent& event)
+    {
+        return noteEvents.pop(event);
+    }
 
-    juce::String lastNoteText;
-    
-    
-    float getFundamentalFrequency()
+    // Note events lost because nothing drained them
+    uint32_t getNumDroppedNoteEvents() const
     {
-        if (readyToProcessFFT)
-        {
-            readyToProcessFFT = false;
-            window.multiplyWithWindowingTable(fftBuffer.data(), fftSize);
-            fft.performFrequencyOnlyForwardTransform(fftBuffer.data());
+        return noteEvents.getNumDropped();
+    }
 
-            return findFundamentalFrequency();
-        }
+    // Latest fundamental published by the analysis thread, of the downmix or
+    // the first channel. Never blocks, so it is safe from both processBlock
+    // and the editor's timer.
+    float getFundamentalFrequency() const
+    {
+        return pipelines[0]->analyser.getLatestResult().fundamental;
+    }
 
-        return 0.0f; // No new frequency computed
+    // Cost of the selected pitch estimator on the last frame, in flops
+    int getPitchEstimatorCost() const
+    {
+        return pipelines[0]->analyser.getLatestResult().estimatorCost;
     }
+
+    // Frames lost because an analysis thread or processBlock fell behind
+    uint32_t getNumDroppedAnalysisFrames() const
+    {
+        uint32_t dropped = 0;
+
+        for (int i = 0; i < numPipelines.load(std::memory_order_acquire); ++i)
+            dropped += pipelines[(size_t) i]->analyser.getNumDroppedFrames();
+
+        return dropped;
+    }
+
+    // Message thread only: the next block's timings, oldest first
+    bool popBlockTelemetry(BlockTelemetry& block)
+    {
+        return telemetry.pop(block);
+    }
+
+    // Blocks whose timings were lost because nothing drained them
+    uint32_t getNumDroppedTelemetryBlocks() const
+    {
+        return telemetry.getNumDropped();
+    }
+
+    // Message thread only. Maps a snapshot library for the partial tracks to
+    // play and hands it to the audio thread. The state keeps only its path,
+    // so presets stay small and reload it from disk. Returns false, with the
+    // reason in error, if the file can't be used.
+    bool loadSnapshotLibrary(const juce::File& file, juce::String& error);
+
+    // Message thread only. Stops snapshot playback and forgets the library
+    void clearSnapshotLibrary();
+
+    // Message thread only: the library last loaded, or File() if none
+    juce::File getSnapshotLibraryFile() const;
     
     int frequencyToNearestMidiNote(float frequencyHz)
     {
@@ -98,6 +184,9 @@ public:
         float sumOfSquares = 0.0f;
         int totalSamples = buffer.getNumChannels() * buffer.getNumSamples();
         
+        if (totalSamples == 0)
+            return 0.0f;
+        
         for (int channel = 0; channel < buffer.getNumChannels(); ++channel)
         {
             const float* channelData = buffer.getReadPointer(channel);
@@ -111,6 +200,16 @@ public:
         return std::sqrt(sumOfSquares / totalSamples);
     }
     
+    // Utility method to convert MIDI note to note name. Allocates, so keep it
+    // off the audio thread
+    static juce::String getNoteNameFromMidiNumber(int midiNoteNumber)
+    {
+        static const char* const noteNames[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+        int octave = (midiNoteNumber / 12) - 1;
+        int noteIndex = midiNoteNumber % 12;
+        return juce::String(noteNames[noteIndex]) + juce::String(octave);
+    }
+
     float getPeakAmplitude(const juce::AudioBuffer<float>& buffer)
     {
         float maxAmplitude = 0.0f;
@@ -129,65 +228,140 @@ public:
     }
     
 private:
-    SineSynth mySineSynth; 
-    
-    // Utility method to convert MIDI note to note name
-   static juce::String getNoteNameFromMidiNumber(int midiNoteNumber)
-   {
-       juce::String noteNames[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
-       int octave = (midiNoteNumber / 12) - 1;
-       int noteIndex = midiNoteNumber % 12;
-       return noteNames[noteIndex] + juce::String(octave);
-   }
-    
-    static constexpr int fftOrder = 11; // FFT size = 2^11 = 2048
-    static constexpr int fftSize = 1 << fftOrder;
-
-    juce::dsp::FFT fft;
-    juce::dsp::WindowingFunction<float> window;
-    std::array<float, fftSize * 2> fftBuffer { 0.0f };
-    std::array<float, fftSize> fifoBuffer { 0.0f };
-    int fifoIndex = 0;
-    bool readyToProcessFFT = false;
-    double sampleRate = 44100.0;
-
-    void pushNextSampleIntoFifo (float sample)
+    // One stream of analysis and the voices that play what it finds: the
+    // downmix, or in per-channel mode one input channel, played on the
+    // output channel of the same number
+    struct Pipeline
     {
-        if (fifoIndex < fftSize)
-        {
-            fifoBuffer[fifoIndex++] = sample;
+        explicit Pipeline(int pipelineChannel) : channel((uint8_t) pipelineChannel) {}
 
-            if (fifoIndex == fftSize)
-            {
-                if (!readyToProcessFFT)
-                {
-                    std::copy(fifoBuffer.begin(), fifoBuffer.end(), fftBuffer.begin());
-                    readyToProcessFFT = true;
-                }
-                fifoIndex = 0;
-            }
+        // Back to silence, for a pipeline that was idle while the others ran
+        void reset()
+        {
+            synth.stopAllVoices();
+            vocoder.reset();
+            tracker.reset();
+            grains.reset();
+            core.reset();
+            onsets.reset();
+            events.clear();
+            delayedEvents.clear();
+            currentFundamental = 0.0f;
+            fastTierHasPitch = false;
+            numCurrentPitches = 0;
         }
-    }
 
-    float findFundamentalFrequency()
-    {
-        auto maxIndex = 0;
-        auto maxValue = 0.0f;
+        const uint8_t channel;
+        SpectralAnalyser analyser;
+        SineSynth synth;
+        PhaseVocoder vocoder;
+        PartialTracker tracker;
+        resynth::ModuleResynthesiser core;
 
-        // Find the bin with the maximum magnitude
-        for (int i = 1; i < fftSize / 2; ++i)
-        {
-            if (fftBuffer[i] > maxValue)
-            {
-                maxValue = fftBuffer[i];
-                maxIndex = i;
-            }
-        }
+        // Follows this pipeline's fundamental and its input's level, on top of
+        // whichever engine plays
+        GrainEngine grains;
 
-        // Calculate the fundamental frequency
-        auto fundamentalFreq = (maxIndex * sampleRate) / fftSize;
-        return fundamentalFreq;
-    }
+        // The fundamental everything plays, from the latest frame. In low-latency
+        // mode the short frames have priority while they find a pitch
+        float currentFundamental = 0.0f;
+        bool fastTierHasPitch = false;
+
+        // Every pitch in the latest long frame. With more than one, a note
+        // starts a voice for each
+        std::array<PitchEstimate, AnalysisResult::maxPitches> currentPitches {};
+        int numCurrentPitches = 0;
+
+        // This block's notes, host MIDI and detected onsets merged, in sample order.
+        // The synth is rendered in segments between them
+        EventScheduler events;
+
+        // Events are held back by the latency reported to the host, by which
+        // time the analysis has frames of the notes they start
+        EventDelayLine delayedEvents;
+
+        // Notes are started by onsets in the input, on the sample they occur
+        // (then held back with everything else by the reported latency)
+        OnsetDetector onsets;
+    };
+
+    ParameterLayer parameters { state };
+    juce::AudioBuffer<float> grainBuffer;
+    juce::AudioBuffer<float> vocoderBuffer;
+    juce::AudioBuffer<float> partialBuffer;
+    juce::AudioBuffer<float> coreBuffer;
+    std::array<PartialTracker::Change, PartialTracker::maxTracks> trackChanges;
+
+    // The first is made with the processor, so the editor always has one to
+    // ask; the rest in prepareToPlay, one per input channel, and kept, so
+    // switching to per-channel analysis never allocates. Only the first
+    // activePipelines run in a block.
+    std::array<std::unique_ptr<Pipeline>, maxPipelines> pipelines;
+    std::atomic<int> numPipelines { 1 };
+    int activePipelines = 1;
+
+    // The downmix, a block at a time
+    juce::AudioBuffer<float> analysisBuffer;
+
+    // Shared by every pipeline's partial tracker when "parallelRender" is on.
+    // The pipelines render one after another, so only one uses it at a time.
+    // The workers are started on the message thread when the parameter is
+    // turned on, and only handed to the audio thread once renderPoolReady is
+    // set; they are stopped when playback is prepared or released with it off.
+    WorkerPool renderPool;
+    std::atomic<bool> renderPoolReady { false };
+    juce::CriticalSection renderPoolLock;
+
+    // Snapshot libraries are opened and owned on the message thread and
+    // passed to the audio thread by pointer (nullptr to stop). The one each
+    // replaces comes back through retiredSnapshots to be unmapped, so the
+    // audio thread never frees one.
+    juce::OwnedArray<SpectralSnapshotLibrary> snapshotLibraries;
+    SpscRing<SpectralSnapshotLibrary*, 16> incomingSnapshots, retiredSnapshots;
+
+    // The audio thread's: the library playing, its next frame, and the
+    // samples since the last one
+    SpectralSnapshotLibrary* snapshot = nullptr;
+    int64_t snapshotFrame = 0;
+    double snapshotSamples = 0.0;
+
+    // Frames played in one block at most, in case of a tiny recorded hop.
+    // The rest are skipped
+    static constexpr int maxSnapshotFramesPerBlock = 16;
+
+    TelemetryRecorder telemetry;
+    NoteEventLog noteEvents;
+
+    // Input samples processed since prepareToPlay, stamped on the note events
+    uint64_t samplesProcessed = 0;
+
+    int maxBlockSize = 0;
+
+    static constexpr int maxOnsetsPerBlock = 64;
+    std::array<OnsetDetector::Onset, maxOnsetsPerBlock> blockOnsets;
+
+    void activatePipelines(int numActive);
+    void configureAnalyser(SpectralAnalyser& analyser, int engine);
+    const float* getAnalysisInput(const juce::AudioBuffer<float>& buffer, int pipeline, int offset, int numSamples, float* mix) const;
+    void scheduleMidi(Pipeline& pipeline, const juce::MidiBuffer& midiMessages, int numSamples);
+    void scheduleOnsets(Pipeline& pipeline, const float* input, int numSamples, int blockOffset, int engine);
+    void renderPipeline(Pipeline& pipeline, juce::AudioBuffer<float>& buffer, juce::AudioBuffer<float>& output, int engine, float pitchRatio);
+    void dispatchEvent(Pipeline& pipeline, const ScheduledEvent& event, int engine);
+    void trackPartials(Pipeline& pipeline, const SpectralPeak* peaks, int numPeaks, float fundamental);
+    void receiveSnapshots();
+    bool isPlayingSnapshot(int engine) const;
+    void playSnapshot(int numSamples);
+    void freeRetiredSnapshots();
+    void popAnalysisResults(Pipeline& pipeline, int engine);
+    int getEngineLatency(int engine) const;
+    void parameterChanged(const juce::String& parameterID, float newValue) override;
+    void handleAsyncUpdate() override;
+    bool isParallelRenderOn() const;
+    void startRenderPool();
+    void stopRenderPool();
+
+    // Hop sizes offered by the "hopSize" parameter, in samples
+    static constexpr std::array<int, 4> hopSizes { 256, 512, 1024, 2048 };
 //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (ResynthesiserAudioProcessor)
 };
@@ -1,96 +1,175 @@
 #pragma once
 
 #include <JuceHeader.h>
+#include "OscillatorBank.h"
+#include "BlockEnvelope.h"
+#include "WorkerPool.h"
 
-class SineSynthSound : public juce::SynthesiserSound {
-public:
-    bool appliesToNote(int) override { return true; }
-    bool appliesToChannel(int) override { return true; }
-};
+// A voice owns one partial in its synth's OscillatorBank. The sine itself
+// is rendered by the bank, all voices at once, so rendering a voice means
+// writing its envelope for the block as a gain curve into the synth's gain
+// matrix, in the column of its partial.
+//
+// Voices only ever play sines, so there is no sound to check them against.
+// The links are the synth's: a voice is on either its free list or its
+// active list, and on the list of the pitch it plays.
+struct SineSynthVoice {
+    int channel = 0;      // 1-16
+    int note = -1;        // -1 when free
+    int partial = -1;
+    float velocity = 0.0f;
+    bool keyDown = false;
+    bool sustained = false; // key released while the sustain pedal was held
+    BlockEnvelope envelope;
 
-class SineSynthVoice : public juce::SynthesiserVoice {
-private:
-    juce::ADSR envelope;
-    juce::dsp::Oscillator<float> oscillator;
-    float currentLevel = 0.0f;
+    int previous = -1, next = -1;               // free or active list
+    int previousAtPitch = -1, nextAtPitch = -1; // voices playing the same note number
+};
 
+// Polyphonic sine synth with its own voice allocator.
+//
+// Everything a note does is O(1) whatever the voice count: a free voice is
+// popped off the free list, a key is found through a table indexed by
+// channel and note, and the active list is kept in the order notes started,
+// so the oldest is always at its head. When every voice is busy one is
+// stolen, by the policy chosen with setStealingPolicy():
+//  - oldest: the head of the active list;
+//  - quietest: the one that ended the last block quietest, found during
+//    render, where every active voice is visited anyway (the oldest, if
+//    that one has been stolen since);
+//  - nearest pitch: found by searching outwards from the new note through
+//    the 128 per-pitch lists, a fixed bound however many voices there are.
+// A stolen voice, like a retriggered one, keeps its partial and its phase.
+//
+// The bank's partials are rendered in fixed runs of slotsPerTask, each into
+// a row of its own, and the rows summed in order. Given a WorkerPool the
+// runs are spread across its threads, but the sums are the same either way,
+// so the output never depends on the pool or which thread took which run.
+class SineSynth {
 public:
-    SineSynthVoice() {
-        juce::ADSR::Parameters params;
+    enum StealingPolicy {
+        stealOldest = 0,
+        stealQuietest,
+        stealNearestPitch
+    };
+
+    SineSynth(int numVoices = 64) {
+        bank.prepare(numVoices);
+        gainCurves.assign((size_t) (maxBlockSize * bank.getCapacity()), 0.0f);
+        voices.resize((size_t) numVoices);
+
+        BlockEnvelope::Parameters params;
         params.attack = 0.01f;
         params.decay = 1.0f;
         params.sustain = 0.00f;
         params.release = 0.0f;
-        envelope.setParameters(params);
-        
-        oscillator.initialise([](float x) { return std::sin(x); });
+
+        for (auto& voice : voices)
+            voice.envelope.setParameters(params);
+
+        voiceForKey.fill(-1);
+        firstAtPitch.fill(-1);
+
+        auto maxTasks = (bank.getCapacity() + slotsPerTask - 1) / slotsPerTask;
+        taskMix.assign((size_t) (maxTasks * maxBlockSize), 0.0f);
+        threadScratch.resize(maxTasks > 1 ? (size_t) WorkerPool::maxWorkers + 1 : 1);
+
+        for (int i = numVoices; --i >= 0;)
+            pushFree(i);
     }
 
-//    // Set oscillator function (allows complex waveforms)
-//    void setOscillatorFunction(std::function<float(float)> func) {
-//        oscillator.initialise(func);
-//    }
+    void setCurrentPlaybackSampleRate(double newRate) {
+        sampleRate = newRate;
 
-    bool canPlaySound(juce::SynthesiserSound* sound) override {
-        return dynamic_cast<SineSynthSound*>(sound) != nullptr;
+        for (auto& voice : voices)
+            voice.envelope.setSampleRate(newRate);
     }
 
-    void startNote(int midiNoteNumber, float velocity,
-                   juce::SynthesiserSound*, int) override {
-        double frequency = juce::MidiMessage::getMidiNoteInHertz(midiNoteNumber);
-        
-        envelope.reset();
-        envelope.noteOn();
-        
-        oscillator.setFrequency(frequency);
-        currentLevel = velocity;
+    void setStealingPolicy(StealingPolicy newPolicy) {
+        policy = newPolicy;
     }
 
-    void stopNote(float, bool) override {
-        envelope.noteOff();
+    // Renders on the pool's threads as well as the caller's, or only the
+    // caller's with nullptr. The pool must outlive its use here.
+    void setWorkerPool(WorkerPool* newPool) {
+        pool = newPool;
     }
 
-    void renderNextBlock(juce::AudioBuffer<float>& outputBuffer,
-                          int startSample, int numSamples) override {
-        for (int sample = 0; sample < numSamples; ++sample) {
-            float oscillatorSample = oscillator.processSample(0.0f);
-            float envelopeSample = envelope.getNextSample();
-            float processedSample = oscillatorSample * envelopeSample * currentLevel;
-            
-            for (int channel = 0; channel < outputBuffer.getNumChannels(); ++channel) {
-                outputBuffer.addSample(channel, startSample + sample, processedSample);
-            }
-            
-            if (!envelope.isActive()) {
-                clearCurrentNote();
-                break;
+    // Starts a note on a free voice, or a stolen one when none is free. The
+    // same note on the same channel again retriggers the voice playing it.
+    void noteOn(int midiChannel, int midiNoteNumber, float velocity) {
+        midiChannel = juce::jlimit(1, 16, midiChannel);
+        midiNoteNumber = juce::jlimit(0, 127, midiNoteNumber);
+
+        auto& key = voiceForKey[(size_t) getKey(midiChannel, midiNoteNumber)];
+        auto index = key;
+
+        if (index >= 0) {
+            unlinkActive(index);
+        } else {
+            index = firstFree >= 0 ? popFree() : findVoiceToSteal(midiNoteNumber);
+
+            if (index < 0)
+                return;
+
+            auto& voice = voices[(size_t) index];
+
+            if (voice.note >= 0) {
+                unlinkActive(index);
+                unlinkPitch(index);
+                voiceForKey[(size_t) getKey(voice.channel, voice.note)] = -1;
             }
+
+            voice.channel = midiChannel;
+            voice.note = midiNoteNumber;
+            linkPitch(index);
+            key = index;
         }
-    }
 
-    void pitchWheelMoved(int) override {}
-    void controllerMoved(int, int) override {}
-};
+        appendActive(index);
 
-class SineSynth : public juce::Synthesiser {
-public:
-    SineSynth(int numVoices = 64) {
-        // Add sounds and voices
-        addSound(new SineSynthSound());
-        
-        for (int i = 0; i < numVoices; ++i) {
-            addVoice(new SineSynthVoice());
-        }
+        if (index == quietestVoice)
+            quietestVoice = -1;
+
+        auto& voice = voices[(size_t) index];
+        auto increment = (float) (juce::MidiMessage::getMidiNoteInHertz(midiNoteNumber) / sampleRate);
+
+        voice.velocity = velocity;
+        voice.keyDown = true;
+        voice.sustained = false;
+        voice.envelope.reset();
+        voice.envelope.noteOn();
+
+        // A stolen voice keeps its partial (and its phase), a free one claims a new one
+        if (voice.partial < 0)
+            voice.partial = bank.addPartial(increment);
+        else
+            bank.setIncrement(voice.partial, increment);
+
+        if (voice.partial >= 0)
+            bank.setAmplitude(voice.partial, velocity);
     }
 
-//    // API methods for external control
-//    void setWaveform(std::function<float(float)> waveformFunc) {
-//        for (int i = 0; i < getNumVoices(); ++i) {
-//            if (auto* voice = dynamic_cast<SineSynthVoice*>(getVoice(i))) {
-//                voice->setOscillatorFunction(waveformFunc);
-//            }
-//        }
-//    }
+    // Releases the voice playing this key, if any. With the sustain pedal
+    // down it is only marked, and released when the pedal comes up.
+    void noteOff(int midiChannel, int midiNoteNumber, float, bool allowTailOff) {
+        if (midiNoteNumber < 0 || midiNoteNumber > 127)
+            return;
+
+        midiChannel = juce::jlimit(1, 16, midiChannel);
+        auto index = voiceForKey[(size_t) getKey(midiChannel, midiNoteNumber)];
+
+        if (index < 0 || ! voices[(size_t) index].keyDown)
+            return;
+
+        auto& voice = voices[(size_t) index];
+        voice.keyDown = false;
+
+        if (sustainPedalDown[(size_t) midiChannel - 1])
+            voice.sustained = true;
+        else
+            stopVoice(voice, allowTailOff);
+    }
 
     // Trigger a note directly
     void triggerNote(int midiNoteNumber, float velocity = 0.8f) {
@@ -99,6 +178,270 @@ public:
 
     // Release a specific note
     void releaseNote(int midiNoteNumber) {
-        noteOff(1, midiNoteNumber, 0.0, true);
+        noteOff(1, midiNoteNumber, 0.0f, true);
+    }
+
+    // Note on/off, all notes off and the sustain pedal. Everything else,
+    // pitch wheel and controllers, has nothing in a sine voice to act on.
+    void handleMessage(const juce::MidiMessage& message) {
+        auto channel = juce::jlimit(1, 16, message.getChannel());
+
+        if (message.isNoteOn()) {
+            noteOn(channel, message.getNoteNumber(), message.getFloatVelocity());
+        } else if (message.isNoteOff()) {
+            noteOff(channel, message.getNoteNumber(), message.getFloatVelocity(), true);
+        } else if (message.isAllNotesOff() || message.isAllSoundOff()) {
+            for (auto index = firstActive; index >= 0; index = voices[(size_t) index].next)
+                if (voices[(size_t) index].channel == channel)
+                    stopVoice(voices[(size_t) index], message.isAllNotesOff());
+        } else if (message.isSustainPedalOn()) {
+            sustainPedalDown[(size_t) channel - 1] = true;
+        } else if (message.isSustainPedalOff()) {
+            sustainPedalDown[(size_t) channel - 1] = false;
+
+            for (auto index = firstActive; index >= 0; index = voices[(size_t) index].next) {
+                auto& voice = voices[(size_t) index];
+
+                if (voice.channel == channel && voice.sustained) {
+                    voice.sustained = false;
+                    stopVoice(voice, true);
+                }
+            }
+        }
+    }
+
+    // Ends every note at once, with no release, and frees their partials
+    void stopAllVoices() {
+        while (firstActive >= 0)
+            freeVoice(firstActive);
+
+        sustainPedalDown.fill(false);
+    }
+
+    // Voices currently holding a partial in the bank
+    int getNumActiveVoices() const {
+        return bank.getNumActive();
+    }
+
+    // Renders every voice in one pass over the bank: each voice writes its
+    // envelope for the block into the gain matrix, the bank renders all the
+    // partials into a mono scratch block, and that is added to each channel.
+    void renderNextBlock(juce::AudioBuffer<float>& outputAudio, int startSample, int numSamples) {
+        for (int offset = 0; offset < numSamples; offset += maxBlockSize) {
+            auto chunk = std::min(maxBlockSize, numSamples - offset);
+            auto quietestLevel = std::numeric_limits<float>::max();
+            quietestVoice = -1;
+
+            for (auto index = firstActive; index >= 0; index = voices[(size_t) index].next) {
+                auto& voice = voices[(size_t) index];
+
+                if (voice.partial < 0)
+                    continue;
+
+                voice.envelope.render(gainCurves.data() + bank.getSlot(voice.partial), chunk, bank.getCapacity());
+
+                auto level = voice.envelope.getLevel() * voice.velocity;
+
+                if (level < quietestLevel) {
+                    quietestLevel = level;
+                    quietestVoice = index;
+                }
+            }
+
+            renderBank(chunk);
+
+            for (int channel = 0; channel < outputAudio.getNumChannels(); ++channel)
+                outputAudio.addFrom(channel, startSample + offset, mix.data(), chunk);
+
+            // The voice is only checked for the end of its note once per block
+            for (auto index = firstActive; index >= 0;) {
+                auto next = voices[(size_t) index].next;
+
+                if (! voices[(size_t) index].envelope.isActive())
+                    freeVoice(index);
+
+                index = next;
+            }
+        }
+    }
+
+private:
+    static constexpr int maxBlockSize = 256;
+
+    // Partials per run. Below minParallelSamples per chunk, or with a single
+    // run, waking the workers would cost more than it saves.
+    static constexpr int slotsPerTask = 64;
+    static constexpr int minParallelSamples = 64;
+    static_assert(slotsPerTask % OscillatorBank::slotAlignment == 0, "Runs must start on a vector");
+
+    OscillatorBank bank;
+    std::vector<SineSynthVoice> voices;
+    std::vector<float> gainCurves;
+    std::array<float, maxBlockSize> mix {};
+    std::vector<float> taskMix;                           // a row of maxBlockSize per run
+    std::vector<OscillatorBank::Scratch> threadScratch;  // one per thread that can render
+    WorkerPool* pool = nullptr;
+    int taskSamples = 0;
+    double sampleRate = 44100.0;
+    StealingPolicy policy = stealOldest;
+
+    int firstFree = -1;
+    int firstActive = -1, lastActive = -1;
+    int quietestVoice = -1; // as of the last block, -1 once it has been reused
+
+    std::array<int, 16 * 128> voiceForKey;
+    std::array<int, 128> firstAtPitch;
+    std::array<bool, 16> sustainPedalDown {};
+
+    // Renders the bank into mix, one run of partials per task, and sums the
+    // runs in order
+    void renderBank(int numSamples) {
+        auto numTasks = std::max(1, (bank.getNumActive() + slotsPerTask - 1) / slotsPerTask);
+        taskSamples = numSamples;
+
+        if (pool != nullptr && numTasks > 1 && numSamples >= minParallelSamples)
+            pool->run(numTasks, renderTask, this);
+        else
+            for (int task = 0; task < numTasks; ++task)
+                renderTask(this, task, 0);
+
+        std::copy(taskMix.begin(), taskMix.begin() + numSamples, mix.begin());
+
+        for (int task = 1; task < numTasks; ++task)
+            juce::FloatVectorOperations::add(mix.data(), taskMix.data() + task * maxBlockSize, numSamples);
+
+        bank.finishRender();
+    }
+
+    static void renderTask(void* context, int task, int thread) {
+        auto& synth = *static_cast<SineSynth*>(context);
+        auto* row = synth.taskMix.data() + task * maxBlockSize;
+
+        std::fill(row, row + synth.taskSamples, 0.0f);
+        synth.bank.renderSlots(row, synth.taskSamples, synth.gainCurves.data(), synth.bank.getCapacity(),
+                               task * slotsPerTask, (task + 1) * slotsPerTask, synth.threadScratch[(size_t) thread]);
+    }
+
+    static int getKey(int midiChannel, int midiNoteNumber) {
+        return (midiChannel - 1) * 128 + midiNoteNumber;
+    }
+
+    void stopVoice(SineSynthVoice& voice, bool allowTailOff) {
+        voice.keyDown = false;
+
+        // Freed at the end of the next block, once it has rendered silence
+        if (allowTailOff)
+            voice.envelope.noteOff();
+        else
+            voice.envelope.reset();
+    }
+
+    int findVoiceToSteal(int midiNoteNumber) const {
+        if (policy == stealQuietest && quietestVoice >= 0)
+            return quietestVoice;
+
+        if (policy == stealNearestPitch) {
+            for (int distance = 0; distance < 128; ++distance) {
+                if (midiNoteNumber - distance >= 0 && firstAtPitch[(size_t) (midiNoteNumber - distance)] >= 0)
+                    return firstAtPitch[(size_t) (midiNoteNumber - distance)];
+
+                if (midiNoteNumber + distance < 128 && firstAtPitch[(size_t) (midiNoteNumber + distance)] >= 0)
+                    return firstAtPitch[(size_t) (midiNoteNumber + distance)];
+            }
+        }
+
+        return firstActive;
+    }
+
+    // Back to the free list, giving up its partial and its key
+    void freeVoice(int index) {
+        auto& voice = voices[(size_t) index];
+
+        if (voice.partial >= 0)
+            bank.removePartial(voice.partial);
+
+        unlinkActive(index);
+        unlinkPitch(index);
+        voiceForKey[(size_t) getKey(voice.channel, voice.note)] = -1;
+
+        if (index == quietestVoice)
+            quietestVoice = -1;
+
+        voice.partial = -1;
+        voice.note = -1;
+        voice.keyDown = false;
+        voice.sustained = false;
+        voice.envelope.reset();
+        pushFree(index);
+    }
+
+    void pushFree(int index) {
+        voices[(size_t) index].next = firstFree;
+        firstFree = index;
+    }
+
+    int popFree() {
+        auto index = firstFree;
+        firstFree = voices[(size_t) index].next;
+        return index;
+    }
+
+    void appendActive(int index) {
+        auto& voice = voices[(size_t) index];
+        voice.previous = lastActive;
+        voice.next = -1;
+
+        if (lastActive >= 0)
+            voices[(size_t) lastActive].next = index;
+        else
+            firstActive = index;
+
+        lastActive = index;
+    }
+
+    void unlinkActive(int index) {
+        auto& voice = voices[(size_t) index];
+
+        if (voice.previous >= 0)
+            voices[(size_t) voice.previous].next = voice.next;
+        else
+            firstActive = voice.next;
+
+        if (voice.next >= 0)
+            voices[(size_t) voice.next].previous = voice.previous;
+        else
+            lastActive = voice.previous;
+
+        voice.previous = voice.next = -1;
+    }
+
+    void linkPitch(int index) {
+        auto& voice = voices[(size_t) index];
+        auto& first = firstAtPitch[(size_t) voice.note];
+
+        voice.previousAtPitch = -1;
+        voice.nextAtPitch = first;
+
+        if (first >= 0)
+            voices[(size_t) first].previousAtPitch = index;
+
+        first = index;
+    }
+
+    void unlinkPitch(int index) {
+        auto& voice = voices[(size_t) index];
+
+        if (voice.note < 0)
+            return;
+
+        if (voice.previousAtPitch >= 0)
+            voices[(size_t) voice.previousAtPitch].nextAtPitch = voice.nextAtPitch;
+        else
+            firstAtPitch[(size_t) voice.note] = voice.nextAtPitch;
+
+        if (voice.nextAtPitch >= 0)
+            voices[(size_t) voice.nextAtPitch].previousAtPitch = voice.previousAtPitch;
+
+        voice.previousAtPitch = voice.nextAtPitch = -1;
     }
 };
@@ -0,0 +1,718 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "LockFree.h"
+#include "PitchEstimators.h"
+#include "Telemetry.h"
+#include "OnsetDetector.h"
+#include "PeakExtractor.h"
+#include "Decimator.h"
+
+// What the analysis thread publishes after each frame.
+struct AnalysisResult
+{
+    static constexpr int maxPitches = MultiPitchEstimator::maxPitches;
+
+    float fundamental = 0.0f;   // Hz, 0 if nothing has been analysed yet
+    float confidence = 0.0f;    // 0..1, as reported by the pitch estimator
+    std::array<PitchEstimate, maxPitches> pitches {}; // every fundamental found, strongest first
+    int numPitches = 0;         // at most one unless the multiple pitch estimator is selected
+    float spectralFlux = 0.0f;  // change from the previous frame, see OnsetDetector::spectralFlux
+    int32_t estimatorCost = 0;  // approximate flops the estimator spent on this frame
+    uint32_t frameIndex = 0;    // increments once per analysed frame
+    uint64_t samplePosition = 0; // input sample just after the end of the frame
+    uint32_t analysisNanoseconds = 0; // time spent on the frame, 0 with telemetry compiled out
+    bool fastTier = false;       // a short low-latency frame: fundamental only, no flux or peaks
+};
+
+// Overlapping STFT analysis, run on its own thread.
+//
+// The audio thread only writes samples into a circular buffer and publishes
+// how far it has written. The analysis thread follows behind one hop at a
+// time, windowing each frame straight out of the ring into the FFT buffer,
+// and hands every result back through an SPSC queue (so processBlock sees
+// each frame in order) as well as a seqlock holding the latest one (for the
+// editor). Each frame is reduced to a fundamental by whichever
+// PitchEstimator is selected (or, by the multiple pitch estimator, to as
+// many as setMaxPitches() allows), and its spectral flux is measured against
+// the frame before, for the onset detector. When asked for peaks, the
+// strongest spectral peaks of each frame go to the audio thread through a
+// second SPSC queue, filled and drained in place since a PeakFrame is large.
+// The audio thread never signals the analysis thread (that would take a
+// lock), the consumer just polls the write position.
+//
+// The FFT size can change while running. A plan and window for every size
+// from 256 to 16384 samples are made in prepare(), and the analysis thread
+// picks up a new size at the start of the next frame.
+//
+// In low-latency mode a second tier of short frames, about 5 ms long, runs
+// alongside: YIN on the time-domain frame, a quarter of a frame apart. It
+// gives a first estimate of anything above about 400 Hz (two periods have
+// to fit in the frame) long before a full frame has the note, while the
+// long frames still cover the low register. Both tiers' results go into
+// the same queue, in order of where their frames end, and fast ones are
+// marked fastTier. getLatestResult() only ever holds a long frame's.
+//
+// For bass, the long frames can instead be taken from the input decimated
+// by 2, 4 or 8 (see Decimator), run on the analysis thread as the samples
+// come in. The FFT shrinks by the same factor, so a frame covers the same
+// stretch of input at the same resolution in Hz for a fraction of the
+// work, but nothing above the new Nyquist is seen: with the harmonic
+// product estimator, it suits fundamentals below about
+// sampleRate / (10 * factor).
+//
+// Frames are only lost if the consumer falls more than a whole ring behind
+// or processBlock stops draining results or peaks; all are counted and
+// reported through getNumDroppedFrames() rather than skipped silently.
+//
+// For offline rendering, where the audio thread runs far faster than real
+// time and the results have to be the same on every run, prepare() can
+// instead leave the thread stopped and the caller runs the analysis inline
+// with analysePendingFrames().
+class SpectralAnalyser : private juce::Thread
+{
+public:
+    static constexpr int minFftOrder = 8;  // 256 samples
+    static constexpr int maxFftOrder = 14; // 16384 samples
+    static constexpr int defaultFftOrder = 11;
+    static constexpr int numFftOrders = maxFftOrder - minFftOrder + 1;
+    static constexpr int maxFftSize = 1 << maxFftOrder;
+    static constexpr int defaultFftSize = 1 << defaultFftOrder;
+    static constexpr int defaultHopSize = 512;
+    static constexpr double fastFrameSeconds = 0.005;
+    static constexpr int maxFastFrameSize = 1024;
+
+    enum EstimatorType
+    {
+        parabolicPeak = 0,
+        harmonicProduct,
+        yin,
+        multiPitch,
+        numEstimatorTypes
+    };
+
+    SpectralAnalyser()
+        : juce::Thread ("Resynthesiser analysis")
+    {
+    }
+
+    ~SpectralAnalyser() override
+    {
+        release();
+    }
+
+    // Call from prepareToPlay: stops the consumer, resets the ring and restarts
+    // it, or with analyseInline leaves it stopped for analysePendingFrames().
+    // maxBlockSize is the most pushSamples() will be given at once: the
+    // analysis thread keeps that much of the ring behind the published input
+    // clear, since a push may be part way through writing it. Inline
+    // analysis never runs during a push, so needs no margin.
+    void prepare (double newSampleRate, int maxBlockSize, bool analyseInline = false)
+    {
+        release();
+
+        sampleRate = newSampleRate;
+        inlineAnalysis = analyseInline;
+        pushMargin = analyseInline ? 0 : juce::jlimit (0, ringSize / 2, maxBlockSize);
+        createPlans();
+        ring.fill (0.0f);
+        writePosition.store (0);
+        readPosition = 0;
+        lastResultEnd = 0;
+        frameIndex = 0;
+        results.reset();
+        peakFrames.reset();
+
+        // Size every estimator's buffers for the largest FFT here, so switching
+        // estimator or FFT size on the analysis thread never allocates
+        for (auto* estimator : estimators)
+            estimator->prepare (sampleRate, maxFftSize, hopSize.load());
+
+        fastFrameSize = juce::jlimit (64, maxFastFrameSize, juce::roundToInt (sampleRate * fastFrameSeconds) & ~3);
+        fastHopSize = fastFrameSize / 4;
+        fastEstimator.prepare (sampleRate, fastFrameSize, fastHopSize);
+        fastTierActive = false;
+        fastReadPosition = 0;
+
+        for (size_t i = 0; i < decimators.size(); ++i)
+            decimators[i].prepare (2 << i);
+
+        activeDecimation = 1;
+        decimator = nullptr;
+
+        activeFftOrder = 0;
+        activeEstimator = nullptr;
+        droppedFrames.store (0);
+        latest.store ({});
+
+        if (! inlineAnalysis)
+            startThread();
+    }
+
+    void release()
+    {
+        stopThread (1000);
+    }
+
+    // Distance in samples between successive frames. Takes effect from the
+    // next frame, so it is safe to call from processBlock. Never more than the
+    // FFT size, so no input goes unanalysed.
+    void setHopSize (int newHopSize)
+    {
+        hopSize.store (juce::jlimit (1, maxFftSize, newHopSize), std::memory_order_relaxed);
+    }
+
+    // FFT size as a power of two, minFftOrder to maxFftOrder. A bigger FFT
+    // resolves lower and closer partials but costs more CPU and reports
+    // each frame later. Every size's plan and window are made in prepare(),
+    // so this only selects one: it takes effect from the next frame and is
+    // safe to call from processBlock.
+    void setFftOrder (int newOrder)
+    {
+        fftOrder.store (juce::jlimit (minFftOrder, maxFftOrder, newOrder), std::memory_order_relaxed);
+    }
+
+    // Low-pass and downsample the input of the long frames by 1 (off), 2, 4
+    // or 8. Every decimator is made in prepare(), so this takes effect from
+    // the next frame and is safe to call from processBlock.
+    void setDecimation (int newFactor)
+    {
+        decimation.store (juce::jlimit (1, Decimator::maxFactor, juce::nextPowerOfTwo (newFactor)), std::memory_order_relaxed);
+    }
+
+    // Input samples covered by a long frame: the FFT size asked for, unless
+    // decimation has taken the FFT below the smallest plan
+    int getFrameLength() const
+    {
+        auto factor = decimation.load (std::memory_order_relaxed);
+        return (1 << getDecimatedFftOrder (fftOrder.load (std::memory_order_relaxed), factor)) * factor;
+    }
+
+    // Adds the tier of short frames described above. Takes effect from the
+    // next frame, so it is safe to call from processBlock.
+    void setLowLatency (bool shouldBeLowLatency)
+    {
+        lowLatency.store (shouldBeLowLatency, std::memory_order_relaxed);
+    }
+
+    // Samples from an input sample to the end of the first frame with
+    // nothing from before it, for whichever tier gives the fundamental: a
+    // frame and a hop, since frames start on the hop grid.
+    int getPitchLatency() const
+    {
+        if (lowLatency.load (std::memory_order_relaxed))
+            return fastFrameSize + fastHopSize;
+
+        auto frameLength = getFrameLength();
+        return frameLength + juce::jmin (hopSize.load (std::memory_order_relaxed), frameLength) + getDecimatorLatency();
+    }
+
+    // Samples from an input sample to the end of the long frame whose peaks
+    // are centred on it: half a frame, plus the decimator's delay.
+    int getPeakLatency() const
+    {
+        return getFrameLength() / 2 + getDecimatorLatency();
+    }
+
+    // Samples from the end of a frame to its result reaching processBlock,
+    // at worst. Inline, frames are analysed before the block that completes
+    // them is rendered, so 0. On the thread, a poll interval and then a
+    // block of up to maxBlockSize until processBlock next pops results.
+    int getAnalysisDelay (int maxBlockSize) const
+    {
+        if (inlineAnalysis)
+            return 0;
+
+        return maxBlockSize + (int) std::ceil (sampleRate * getPollIntervalMs() / 1000.0);
+    }
+
+    // Which PitchEstimator turns each frame into a fundamental. Takes effect
+    // from the next frame, so it is safe to call from processBlock.
+    void setPitchEstimator (int newType)
+    {
+        estimatorType.store (juce::jlimit (0, numEstimatorTypes - 1, newType), std::memory_order_relaxed);
+    }
+
+    // How many fundamentals the multiple pitch estimator may report per
+    // frame, 1 to AnalysisResult::maxPitches; the others only ever find one.
+    // Takes effect from the next frame, so it is safe to call from processBlock.
+    void setMaxPitches (int newMaxPitches)
+    {
+        maxPitches.store (juce::jlimit (1, AnalysisResult::maxPitches, newMaxPitches), std::memory_order_relaxed);
+    }
+
+    // How many spectral peaks to extract from each frame, at most
+    // PeakFrame::maxPeaks. 0, the default, skips peak extraction. Takes
+    // effect from the next frame, so it is safe to call from processBlock.
+    void setMaxPeaks (int newMaxPeaks)
+    {
+        maxPeaks.store (juce::jlimit (0, PeakFrame::maxPeaks, newMaxPeaks), std::memory_order_relaxed);
+    }
+
+    // Audio thread only. Wait-free, never allocates or runs the FFT: the
+    // block is copied into the ring in at most two pieces and published to
+    // the analysis thread in one go.
+    void pushSamples (const float* samples, int numSamples)
+    {
+        jassert (inlineAnalysis || numSamples <= pushMargin);
+        auto position = writePosition.load (std::memory_order_relaxed);
+
+        while (numSamples > 0)
+        {
+            auto start = (int) (position & ringMask);
+            auto count = juce::jmin (numSamples, ringSize - start);
+
+            juce::FloatVectorOperations::copy (ring.data() + start, samples, count);
+            position += (uint64_t) count;
+            samples += count;
+            numSamples -= count;
+        }
+
+        writePosition.store (position, std::memory_order_release);
+    }
+
+    bool isAnalysingInline() const  { return inlineAnalysis; }
+
+    // Inline mode only: analyses every complete frame on the calling thread.
+    void analysePendingFrames()
+    {
+        jassert (inlineAnalysis);
+        processPendingFrames();
+    }
+
+    // Audio thread only. Pops the next analysed frame, oldest first.
+    bool popResult (AnalysisResult& result)
+    {
+        return results.pop (result);
+    }
+
+    // Audio thread only. The oldest frame of peaks not yet consumed, read in
+    // place, or nullptr. Hand it back with finishReadingPeaks().
+    const PeakFrame* beginReadingPeaks() const  { return peakFrames.beginRead(); }
+    void finishReadingPeaks()                   { peakFrames.finishRead(); }
+
+    // Safe from any thread.
+    AnalysisResult getLatestResult() const
+    {
+        return latest.load();
+    }
+
+    uint32_t getNumDroppedFrames() const
+    {
+        return droppedFrames.load (std::memory_order_relaxed);
+    }
+
+private:
+    // Long enough to absorb a few hundred ms of analysis thread stalls at 192 kHz
+    static constexpr int ringSize = maxFftSize * 4;
+    static constexpr uint64_t ringMask = (uint64_t) ringSize - 1;
+    static constexpr int pollIntervalMs = 2;
+    static constexpr int fastPollIntervalMs = 1;
+
+    // One plan and window per order, made on the first prepare()
+    std::array<std::unique_ptr<juce::dsp::FFT>, numFftOrders> ffts;
+    std::array<std::vector<float>, numFftOrders> windowTables;
+
+    // Written by the audio thread
+    std::array<float, ringSize> ring { 0.0f };
+    std::atomic<uint64_t> writePosition { 0 };
+
+    // How far past writePosition a push in progress may be writing
+    int pushMargin = 0;
+    std::atomic<int> hopSize { defaultHopSize };
+    std::atomic<int> fftOrder { defaultFftOrder };
+    std::atomic<int> estimatorType { harmonicProduct };
+    std::atomic<int> maxPeaks { 0 };
+    std::atomic<int> maxPitches { 1 };
+    std::atomic<bool> lowLatency { false };
+    std::atomic<int> decimation { 1 };
+
+    // Written by the analysis thread
+    SpscRing<AnalysisResult, 256> results;
+    SpscRing<PeakFrame, 64> peakFrames;
+    std::atomic<uint32_t> droppedFrames { 0 };
+    Seqlock<AnalysisResult> latest;
+
+    // Owned by the analysis thread
+    std::array<float, maxFftSize * 2> fftBuffer { 0.0f };
+    std::array<float, maxFftSize> timeFrame { 0.0f };
+    std::array<float, maxFftSize / 2 + 1> previousMagnitudes { 0.0f };
+    int activeFftOrder = 0;
+    int fftSize = defaultFftSize;
+    juce::dsp::FFT* fft = nullptr;
+    const float* windowTable = nullptr;
+    bool previousMagnitudesValid = false;
+    double sampleRate = 44100.0;
+    bool inlineAnalysis = false;
+    uint64_t readPosition = 0; // in the long frames' input, decimated or not
+    uint64_t lastResultEnd = 0;
+    uint32_t frameIndex = 0;
+
+    PeakInterpolationEstimator peakEstimator;
+    HarmonicProductEstimator harmonicEstimator;
+    YinEstimator yinEstimator;
+    MultiPitchEstimator multiPitchEstimator;
+    std::array<PitchEstimator*, numEstimatorTypes> estimators { &peakEstimator, &harmonicEstimator, &yinEstimator, &multiPitchEstimator };
+    PitchEstimator* activeEstimator = nullptr;
+    int activeHopSize = 0;
+    PeakExtractor peakExtractor;
+
+    // The low-latency tier
+    YinEstimator fastEstimator;
+    std::array<float, maxFastFrameSize> fastFrame { 0.0f };
+    int fastFrameSize = 256;
+    int fastHopSize = 64;
+    bool fastTierActive = false;
+    uint64_t fastReadPosition = 0;
+
+    // The decimated input, when the long frames use it
+    std::array<Decimator, 3> decimators; // by 2, 4 and 8
+    Decimator* decimator = nullptr;
+    int activeDecimation = 1;
+    std::array<float, ringSize> decimatedRing { 0.0f };
+    std::array<float, 1024> decimatedBlock { 0.0f };
+    uint64_t decimatorReadPosition = 0;  // in the input
+    uint64_t decimatedWritePosition = 0; // in decimatedRing
+
+    // Peaks quieter than this (about -80 dB) aren't worth a partial
+    static constexpr float peakFloor = 1.0e-4f;
+
+    void run() override
+    {
+        while (! threadShouldExit())
+        {
+            processPendingFrames();
+            wait (getPollIntervalMs());
+        }
+    }
+
+    void processPendingFrames()
+    {
+        for (;;)
+        {
+            auto order = fftOrder.load (std::memory_order_relaxed);
+            auto factor = decimation.load (std::memory_order_relaxed);
+
+            if (order != activeFftOrder || factor != activeDecimation)
+                configure (order, factor);
+
+            // The hop stays the same in input samples
+            auto hop = (uint64_t) juce::jlimit (1, fftSize, hopSize.load (std::memory_order_relaxed) / activeDecimation);
+            auto* estimator = estimators[(size_t) estimatorType.load (std::memory_order_relaxed)];
+            auto written = writePosition.load (std::memory_order_acquire);
+            auto longWritten = written;
+
+            if (decimator != nullptr)
+            {
+                decimatePending (written, hop);
+                longWritten = decimatedWritePosition;
+            }
+
+            // A short frame comes first whenever it ends no later than the next long one
+            if (updateFastTier())
+            {
+                // It can start ahead of the input, where the next long frame ends
+                if (written < fastReadPosition + (uint64_t) fastFrameSize)
+                    return;
+
+                if (isLapped (fastReadPosition, written, pushMargin))
+                    skipOverwrittenFrames (fastReadPosition, written, pushMargin, (uint64_t) fastHopSize, &fastEstimator);
+                else
+                    analyseFastFrame();
+
+                continue;
+            }
+
+            if (longWritten < readPosition + (uint64_t) fftSize)
+                return;
+
+            // The decimated ring is only written by this thread
+            auto longMargin = decimator != nullptr ? 0 : pushMargin;
+
+            if (isLapped (readPosition, longWritten, longMargin))
+            {
+                skipOverwrittenFrames (readPosition, longWritten, longMargin, hop, activeEstimator);
+                continue;
+            }
+
+            auto frameStart = TelemetryRecorder::now();
+            auto* source = decimator != nullptr ? decimatedRing.data() : ring.data();
+            readWindowedFrame (source);
+
+            if (estimator->needsTimeDomainFrame())
+                readTimeDomainFrame (source, readPosition, fftSize, timeFrame.data());
+
+            // The writer may have lapped us while we were reading
+            if (decimator == nullptr && isLapped (readPosition, writePosition.load (std::memory_order_acquire), pushMargin))
+                continue;
+
+            fft->performFrequencyOnlyForwardTransform (fftBuffer.data());
+
+            // Right after a size change the previous frame's bins mean
+            // something else, so it counts as no change rather than an onset
+            auto numBins = fftSize / 2 + 1;
+            auto flux = previousMagnitudesValid ? OnsetDetector::spectralFlux (fftBuffer.data(), previousMagnitudes.data(), numBins) : 0.0f;
+            juce::FloatVectorOperations::copy (previousMagnitudes.data(), fftBuffer.data(), numBins);
+            previousMagnitudesValid = true;
+
+            if (estimator != activeEstimator || (int) hop != activeHopSize)
+            {
+                activeEstimator = estimator;
+                activeHopSize = (int) hop;
+                estimator->prepare (sampleRate / activeDecimation, fftSize, activeHopSize);
+            }
+
+            AnalysisResult result;
+            result.numPitches = estimator->estimateMultiple (fftBuffer.data(), timeFrame.data(), result.pitches.data(),
+                                                             maxPitches.load (std::memory_order_relaxed));
+            result.fundamental = result.pitches[0].frequency;
+            result.confidence = result.pitches[0].confidence;
+
+            auto peaksDelivered = extractPeaks();
+            result.spectralFlux = flux;
+            result.estimatorCost = (int32_t) estimator->getCostPerFrame();
+            result.frameIndex = ++frameIndex;
+            result.samplePosition = lastResultEnd = getLongFrameEnd();
+            result.analysisNanoseconds = TelemetryRecorder::nanosecondsBetween (frameStart, TelemetryRecorder::now());
+
+            if (! results.push (result) || ! peaksDelivered)
+                droppedFrames.fetch_add (1, std::memory_order_relaxed);
+
+            latest.store (result);
+            readPosition += hop;
+        }
+    }
+
+    // Not real-time safe. Plans are kept across prepare() calls, since they
+    // don't depend on the sample rate.
+    void createPlans()
+    {
+        for (int i = 0; i < numFftOrders; ++i)
+        {
+            if (ffts[(size_t) i] != nullptr)
+                continue;
+
+            auto size = 1 << (minFftOrder + i);
+            ffts[(size_t) i] = std::make_unique<juce::dsp::FFT> (minFftOrder + i);
+            windowTables[(size_t) i].resize ((size_t) size);
+            juce::dsp::WindowingFunction<float>::fillWindowingTables (windowTables[(size_t) i].data(), (size_t) size,
+                                                                      juce::dsp::WindowingFunction<float>::hann, false);
+        }
+    }
+
+    static int getDecimatedFftOrder (int order, int factor)
+    {
+        return juce::jmax (minFftOrder, order - juce::findHighestSetBit ((uint32_t) factor));
+    }
+
+    int getDecimatorLatency() const
+    {
+        auto factor = decimation.load (std::memory_order_relaxed);
+        return factor > 1 ? decimators[(size_t) juce::findHighestSetBit ((uint32_t) factor) - 1].getLatency() : 0;
+    }
+
+    // Switches to another prepared plan and decimator. The estimator is
+    // re-prepared on the next frame, within the capacity prepare() gave it.
+    void configure (int order, int factor)
+    {
+        if (factor != activeDecimation)
+        {
+            // Carry on from the same point in the input, on a whole decimated sample
+            auto inputPosition = readPosition * (uint64_t) activeDecimation / (uint64_t) factor * (uint64_t) factor;
+            activeDecimation = factor;
+            decimator = nullptr;
+            readPosition = inputPosition;
+
+            if (factor > 1)
+            {
+                decimator = &decimators[(size_t) juce::findHighestSetBit ((uint32_t) factor) - 1];
+                decimator->reset();
+                decimatorReadPosition = inputPosition;
+                decimatedWritePosition = readPosition = inputPosition / (uint64_t) factor;
+            }
+        }
+
+        activeFftOrder = order;
+        auto fftOrderUsed = getDecimatedFftOrder (order, factor);
+        fftSize = 1 << fftOrderUsed;
+        fft = ffts[(size_t) (fftOrderUsed - minFftOrder)].get();
+        windowTable = windowTables[(size_t) (fftOrderUsed - minFftOrder)].data();
+        activeEstimator = nullptr;
+        previousMagnitudesValid = false;
+
+        // A shorter frame would end before the last result; start it later,
+        // so results stay in order of where their frames end
+        if (getLongFrameEnd() < lastResultEnd)
+            readPosition += (lastResultEnd - getLongFrameEnd() + (uint64_t) factor - 1) / (uint64_t) factor;
+    }
+
+    // The input sample just after the next long frame
+    uint64_t getLongFrameEnd() const
+    {
+        return (readPosition + (uint64_t) fftSize) * (uint64_t) activeDecimation;
+    }
+
+    // Runs the decimator over everything written since it last ran, into
+    // the decimated ring
+    void decimatePending (uint64_t written, uint64_t hop)
+    {
+        auto factor = (uint64_t) activeDecimation;
+
+        if (isLapped (decimatorReadPosition, written, pushMargin))
+        {
+            // Lapped: start the filter again on what is still intact, and
+            // drop the frames that would have read the gap
+            auto resume = (written - (uint64_t) ringSize / 2) / factor * factor;
+            decimator->reset();
+            decimatorReadPosition = resume;
+            decimatedWritePosition = resume / factor;
+            skipFramesBefore (readPosition, decimatedWritePosition, hop, activeEstimator);
+        }
+
+        while (decimatorReadPosition < written)
+        {
+            auto start = (int) (decimatorReadPosition & ringMask);
+            auto count = (int) juce::jmin (written - decimatorReadPosition, (uint64_t) (ringSize - start),
+                                           (uint64_t) decimatedBlock.size());
+            auto numOutputs = decimator->process (ring.data() + start, count, decimatedBlock.data());
+
+            for (int i = 0; i < numOutputs; ++i)
+                decimatedRing[(size_t) ((decimatedWritePosition + (uint64_t) i) & ringMask)] = decimatedBlock[(size_t) i];
+
+            decimatedWritePosition += (uint64_t) numOutputs;
+            decimatorReadPosition += (uint64_t) count;
+        }
+    }
+
+    int getPollIntervalMs() const
+    {
+        return lowLatency.load (std::memory_order_relaxed) ? fastPollIntervalMs : pollIntervalMs;
+    }
+
+    // Starts or stops the short frames as asked, and returns true if the
+    // next frame to analyse is a short one. They start on a grid ending
+    // where the next long frame does.
+    bool updateFastTier()
+    {
+        auto shouldBeActive = lowLatency.load (std::memory_order_relaxed);
+        auto nextEnd = getLongFrameEnd();
+
+        if (shouldBeActive != fastTierActive)
+        {
+            fastTierActive = shouldBeActive;
+            fastReadPosition = nextEnd > (uint64_t) fastFrameSize ? nextEnd - (uint64_t) fastFrameSize : 0;
+            fastEstimator.reset();
+        }
+
+        return fastTierActive && fastReadPosition + (uint64_t) fastFrameSize <= nextEnd;
+    }
+
+    // One short frame: a fundamental from YIN, nothing else
+    void analyseFastFrame()
+    {
+        auto frameStart = TelemetryRecorder::now();
+        readTimeDomainFrame (ring.data(), fastReadPosition, fastFrameSize, fastFrame.data());
+
+        // The writer may have lapped us while we were reading
+        if (isLapped (fastReadPosition, writePosition.load (std::memory_order_acquire), pushMargin))
+            return;
+
+        auto estimate = fastEstimator.estimate (nullptr, fastFrame.data());
+
+        AnalysisResult result;
+        result.fundamental = estimate.frequency;
+        result.confidence = estimate.confidence;
+        result.pitches[0] = estimate;
+        result.numPitches = estimate.frequency > 0.0f ? 1 : 0;
+        result.estimatorCost = (int32_t) fastEstimator.getCostPerFrame();
+        result.frameIndex = ++frameIndex;
+        result.samplePosition = lastResultEnd = fastReadPosition + (uint64_t) fastFrameSize;
+        result.analysisNanoseconds = TelemetryRecorder::nanosecondsBetween (frameStart, TelemetryRecorder::now());
+        result.fastTier = true;
+
+        if (! results.push (result))
+            droppedFrames.fetch_add (1, std::memory_order_relaxed);
+
+        fastReadPosition += (uint64_t) fastHopSize;
+    }
+
+    // Publishes the peaks of the frame in fftBuffer, if any are wanted.
+    // Returns false if the audio thread has let the queue fill up.
+    bool extractPeaks()
+    {
+        auto numPeaks = maxPeaks.load (std::memory_order_relaxed);
+
+        if (numPeaks == 0)
+            return true;
+
+        auto* frame = peakFrames.beginWrite();
+
+        if (frame == nullptr)
+            return false;
+
+        frame->frameIndex = frameIndex + 1;
+        frame->samplePosition = getLongFrameEnd();
+        frame->numPeaks = peakExtractor.extract (fftBuffer.data(), fftSize, sampleRate / activeDecimation, numPeaks, peakFloor, frame->peaks.data());
+        peakFrames.finishWrite();
+        return true;
+    }
+
+    // Whether anything from position on may have been overwritten in a ring
+    // published up to written, with a push of up to margin more in progress
+    static bool isLapped (uint64_t position, uint64_t written, int margin)
+    {
+        return written + (uint64_t) margin - position > (uint64_t) ringSize;
+    }
+
+    // Jump to the oldest frame on the hop grid that is still intact in the
+    // ring. Only called once isLapped(), so the subtraction can't wrap.
+    void skipOverwrittenFrames (uint64_t& position, uint64_t written, int margin, uint64_t hop, PitchEstimator* estimator)
+    {
+        skipFramesBefore (position, written + (uint64_t) margin - (uint64_t) ringSize, hop, estimator);
+    }
+
+    // The frames either side of a skip aren't a hop apart, so the estimator
+    // that reads them starts again: YIN's running difference would mix them.
+    void skipFramesBefore (uint64_t& position, uint64_t oldestValid, uint64_t hop, PitchEstimator* estimator)
+    {
+        if (position >= oldestValid)
+            return;
+
+        auto hopsToSkip = (oldestValid - position + hop - 1) / hop;
+
+        position += hopsToSkip * hop;
+        droppedFrames.fetch_add ((uint32_t) hopsToSkip, std::memory_order_relaxed);
+
+        if (estimator != nullptr)
+            estimator->reset();
+    }
+
+    // Windows the frame starting at readPosition directly from a ring (the
+    // input or the decimated input) into the FFT buffer, in at most two
+    // contiguous runs.
+    void readWindowedFrame (const float* source)
+    {
+        auto start = (int) (readPosition & ringMask);
+        auto firstRun = juce::jmin (fftSize, ringSize - start);
+
+        juce::FloatVectorOperations::multiply (fftBuffer.data(), source + start, windowTable, firstRun);
+
+        if (firstRun < fftSize)
+            juce::FloatVectorOperations::multiply (fftBuffer.data() + firstRun, source,
+                                                   windowTable + firstRun, fftSize - firstRun);
+    }
+
+    // Unwindowed copy of a frame, only made for time-domain estimators
+    void readTimeDomainFrame (const float* source, uint64_t position, int size, float* destination)
+    {
+        auto start = (int) (position & ringMask);
+        auto firstRun = juce::jmin (size, ringSize - start);
+
+        juce::FloatVectorOperations::copy (destination, source + start, firstRun);
+
+        if (firstRun < size)
+            juce::FloatVectorOperations::copy (destination + firstRun, source, size - firstRun);
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (SpectralAnalyser)
+};
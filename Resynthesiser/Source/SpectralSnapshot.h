@@ -0,0 +1,250 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include "PeakExtractor.h"
+
+#if JUCE_LINUX || JUCE_MAC || JUCE_IOS || JUCE_ANDROID
+ #include <sys/mman.h>
+#endif
+
+// Sequences of analysed frames on disk: each frame's fundamental and its
+// partials, in a versioned binary format made to be memory-mapped.
+//
+// A file is a SnapshotFileHeader followed by numFrames records of
+// frameSize bytes each: a SnapshotFrameHeader, then maxPartials
+// SpectralPeak slots, of which the first numPartials are used (lowest
+// frequency first), padded with zeros to a multiple of 16 bytes. Every
+// record is the same size, so frame i is found by arithmetic, with no index
+// to read, and its partials can be handed on straight from the mapping.
+// Frames are hopSize samples apart at sampleRate.
+//
+// Everything is stored in the writer's byte order, and byteOrder records
+// which: a reader on a machine of the other order refuses the file rather
+// than swapping. Readers accept any header or frame record at least as big
+// as theirs, so later versions can add fields to the end of either.
+struct SnapshotFileHeader
+{
+    static constexpr uint32_t expectedMagic = 0x46505352; // "RSPF"
+    static constexpr uint32_t expectedByteOrder = 0x01020304;
+    static constexpr uint16_t currentVersion = 1;
+
+    uint32_t magic = expectedMagic;
+    uint32_t byteOrder = expectedByteOrder;
+    uint16_t version = currentVersion;
+    uint16_t headerSize = 0; // bytes before the first frame, a multiple of 16
+    uint32_t frameSize = 0;  // bytes per frame record, a multiple of 16
+    uint32_t maxPartials = 0;
+    uint32_t hopSize = 0;
+    double sampleRate = 0.0;
+    uint64_t numFrames = 0;
+    uint8_t reserved[24] {};
+};
+
+struct SnapshotFrameHeader
+{
+    float fundamental = 0.0f; // Hz, 0 if the frame had no pitch
+    float confidence = 0.0f;  // 0..1, from the pitch estimator that made it
+    uint32_t numPartials = 0;
+    uint32_t flags = 0;       // none defined yet, written as 0
+};
+
+static_assert (sizeof (SnapshotFileHeader) == 64, "The header layout is part of the file format");
+static_assert (sizeof (SnapshotFrameHeader) == 16, "The frame header layout is part of the file format");
+static_assert (sizeof (SpectralPeak) == 8, "The partial layout is part of the file format");
+
+// Not real-time safe. Writes frames to a file as they are added, so a
+// capture of any length only ever holds one frame in memory. The header is
+// written again with the frame count by finish(), or on destruction.
+class SpectralSnapshotWriter
+{
+public:
+    SpectralSnapshotWriter (const juce::File& file, double sampleRate, int hopSize, int maxPartials)
+    {
+        header.headerSize = (uint16_t) sizeof (SnapshotFileHeader);
+        header.frameSize = (uint32_t) getFrameSize (maxPartials);
+        header.maxPartials = (uint32_t) juce::jmax (0, maxPartials);
+        header.hopSize = (uint32_t) juce::jmax (1, hopSize);
+        header.sampleRate = sampleRate;
+
+        record.resize (header.frameSize);
+        file.deleteFile();
+        stream = file.createOutputStream();
+
+        if (stream != nullptr && ! writeHeader())
+            stream.reset();
+    }
+
+    ~SpectralSnapshotWriter()
+    {
+        finish();
+    }
+
+    bool isOpen() const  { return stream != nullptr; }
+
+    // Appends one frame. Partials beyond maxPartials are left out: the
+    // analyser's peaks come lowest first, so those are the highest.
+    bool addFrame (float fundamental, float confidence, const SpectralPeak* partials, int numPartials)
+    {
+        if (stream == nullptr)
+            return false;
+
+        SnapshotFrameHeader frame;
+        frame.fundamental = fundamental;
+        frame.confidence = confidence;
+        frame.numPartials = (uint32_t) juce::jlimit (0, (int) header.maxPartials, numPartials);
+
+        std::fill (record.begin(), record.end(), (char) 0);
+        std::memcpy (record.data(), &frame, sizeof (frame));
+        std::memcpy (record.data() + sizeof (frame), partials, frame.numPartials * sizeof (SpectralPeak));
+
+        if (! stream->write (record.data(), record.size()))
+            return false;
+
+        ++header.numFrames;
+        return true;
+    }
+
+    // Writes the final header and closes the file. Returns false if anything
+    // failed to be written.
+    bool finish()
+    {
+        if (stream == nullptr)
+            return false;
+
+        auto succeeded = stream->setPosition (0) && writeHeader();
+        stream->flush();
+        succeeded = succeeded && stream->getStatus().wasOk();
+        stream.reset();
+        return succeeded;
+    }
+
+    static size_t getFrameSize (int maxPartials)
+    {
+        auto size = sizeof (SnapshotFrameHeader) + (size_t) juce::jmax (0, maxPartials) * sizeof (SpectralPeak);
+        return (size + 15) & ~(size_t) 15;
+    }
+
+private:
+    SnapshotFileHeader header;
+    std::unique_ptr<juce::FileOutputStream> stream;
+    std::vector<char> record;
+
+    bool writeHeader()
+    {
+        return stream->write (&header, sizeof (header));
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (SpectralSnapshotWriter)
+};
+
+// A snapshot file, memory-mapped read-only. Opening it only maps the file
+// and checks the header, so it takes the same time whatever the file's
+// size, and nothing is read into the process: frames are paged in by the OS
+// when first touched, and the pages are shared with every other instance
+// mapping the same file and can be dropped again under memory pressure.
+//
+// getFrame() is real-time safe and copies nothing: the partials it returns
+// point into the mapping. The first touch of a page can still fault, so
+// sequential reading is advised to the OS where it listens, for read-ahead.
+class SpectralSnapshotLibrary
+{
+public:
+    struct Frame
+    {
+        float fundamental = 0.0f;
+        float confidence = 0.0f;
+        const SpectralPeak* partials = nullptr; // into the mapping, valid while the library is
+        int numPartials = 0;
+    };
+
+    // Not real-time safe. Returns nullptr, with the reason in error, if the
+    // file can't be mapped or isn't a snapshot this version can read.
+    static std::unique_ptr<SpectralSnapshotLibrary> open (const juce::File& file, juce::String& error)
+    {
+        std::unique_ptr<SpectralSnapshotLibrary> library (new SpectralSnapshotLibrary (file));
+        error = library->validate();
+
+        if (error.isNotEmpty())
+            return nullptr;
+
+       #if JUCE_LINUX || JUCE_MAC || JUCE_IOS || JUCE_ANDROID
+        posix_madvise (library->mapping.getData(), library->mapping.getSize(), POSIX_MADV_SEQUENTIAL);
+       #endif
+
+        return library;
+    }
+
+    const juce::File& getFile() const  { return file; }
+    int64_t getNumFrames() const       { return (int64_t) header.numFrames; }
+    double getSampleRate() const       { return header.sampleRate; }
+    int getHopSize() const             { return (int) header.hopSize; }
+    int getMaxPartials() const         { return (int) header.maxPartials; }
+
+    // Frame index, 0 to getNumFrames() - 1. A partial count beyond the
+    // record's slots, which only a damaged file would have, is clamped.
+    Frame getFrame (int64_t index) const
+    {
+        auto* record = frames + (size_t) index * header.frameSize;
+
+        SnapshotFrameHeader frameHeader;
+        std::memcpy (&frameHeader, record, sizeof (frameHeader));
+
+        Frame frame;
+        frame.fundamental = frameHeader.fundamental;
+        frame.confidence = frameHeader.confidence;
+        frame.partials = reinterpret_cast<const SpectralPeak*> (record + sizeof (SnapshotFrameHeader));
+        frame.numPartials = (int) juce::jmin (frameHeader.numPartials, header.maxPartials);
+        return frame;
+    }
+
+private:
+    juce::File file;
+    juce::MemoryMappedFile mapping;
+    SnapshotFileHeader header;
+    const char* frames = nullptr;
+
+    explicit SpectralSnapshotLibrary (const juce::File& fileToMap)
+        : file (fileToMap), mapping (fileToMap, juce::MemoryMappedFile::readOnly, false)
+    {
+    }
+
+    juce::String validate()
+    {
+        auto* data = static_cast<const char*> (mapping.getData());
+        auto size = (uint64_t) mapping.getSize();
+
+        if (data == nullptr)
+            return "can't map " + file.getFullPathName();
+
+        if (size < sizeof (header))
+            return "too short to be a snapshot";
+
+        std::memcpy (&header, data, sizeof (header));
+
+        if (header.magic != SnapshotFileHeader::expectedMagic)
+            return "not a snapshot";
+
+        if (header.byteOrder != SnapshotFileHeader::expectedByteOrder)
+            return "written on a machine of the other byte order";
+
+        if (header.version > SnapshotFileHeader::currentVersion)
+            return "written by a newer version (" + juce::String (header.version) + ")";
+
+        // Everything the frames are found with is checked against the file
+        // before it is used, so a damaged file can't send getFrame() past the
+        // mapping. No more partials than the analysis ever extracts.
+        if (header.headerSize < sizeof (header) || header.headerSize % 16 != 0 || header.headerSize > size
+            || header.maxPartials > (uint32_t) PeakFrame::maxPeaks
+            || header.frameSize < SpectralSnapshotWriter::getFrameSize ((int) header.maxPartials) || header.frameSize % 16 != 0
+            || header.hopSize == 0 || ! (header.sampleRate > 0.0))
+            return "damaged header";
+
+        if (header.numFrames > (size - header.headerSize) / header.frameSize)
+            return "truncated: " + juce::String ((juce::int64) header.numFrames) + " frames promised";
+
+        frames = data + header.headerSize;
+        return {};
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (SpectralSnapshotLibrary)
+};
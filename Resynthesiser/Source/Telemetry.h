@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include "LockFree.h"
+
+// Build with RESYNTHESISER_TELEMETRY=0 to compile the instrumentation out:
+// the recorder's methods are then empty and inline away to nothing.
+#ifndef RESYNTHESISER_TELEMETRY
+ #define RESYNTHESISER_TELEMETRY 1
+#endif
+
+// What one processBlock call cost, stage by stage.
+struct BlockTelemetry
+{
+    enum Stage
+    {
+        other = 0,      // parameters, levels, anything not broken out below
+        analysisPush,   // writing the input into the analyser's ring
+        analysis,       // STFT and pitch estimate of the frames that finished, on whichever thread ran them
+        noteTriggering,
+        render,         // the sine bank or the phase vocoder
+        grains,
+        numStages
+    };
+
+    std::array<uint32_t, numStages> stageNanoseconds {};
+    uint32_t blockNanoseconds = 0;    // all of processBlock (analysis only when it runs inline)
+    uint32_t deadlineNanoseconds = 0; // how long the block lasts at the sample rate
+    uint16_t activeVoices = 0;
+    uint16_t activeGrains = 0;
+
+    bool missedDeadline() const  { return blockNanoseconds > deadlineNanoseconds; }
+
+    static const char* getStageName (int stage)
+    {
+        static constexpr std::array<const char*, numStages> names { "other", "push", "analysis", "notes", "render", "grains" };
+        return names[(size_t) stage];
+    }
+};
+
+#if RESYNTHESISER_TELEMETRY
+
+// Audio thread side: timestamps each stage of the block with steady_clock
+// and pushes one BlockTelemetry per block into a lock-free ring for the
+// editor to drain. No locks, no allocation; if nobody drains the ring the
+// newest records are dropped and counted.
+class TelemetryRecorder
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr bool enabled = true;
+
+    static Clock::time_point now()  { return Clock::now(); }
+
+    static uint32_t nanosecondsBetween (Clock::time_point start, Clock::time_point end)
+    {
+        return (uint32_t) std::chrono::duration_cast<std::chrono::nanoseconds> (end - start).count();
+    }
+
+    void beginBlock (int numSamples, double sampleRate)
+    {
+        current = {};
+        current.deadlineNanoseconds = (uint32_t) std::min (1.0e9 * numSamples / sampleRate, 4.0e9);
+        blockStart = stageStart = now();
+    }
+
+    // Charges the time since the previous stage ended to stage.
+    void endStage (BlockTelemetry::Stage stage)
+    {
+        auto time = now();
+        current.stageNanoseconds[(size_t) stage] += nanosecondsBetween (stageStart, time);
+        stageStart = time;
+    }
+
+    // For time spent elsewhere, e.g. by the analysis thread.
+    void addStageTime (BlockTelemetry::Stage stage, uint32_t nanoseconds)
+    {
+        current.stageNanoseconds[(size_t) stage] += nanoseconds;
+    }
+
+    void endBlock (int activeVoices, int activeGrains)
+    {
+        current.blockNanoseconds = nanosecondsBetween (blockStart, now());
+        current.activeVoices = (uint16_t) std::min (activeVoices, 0xffff);
+        current.activeGrains = (uint16_t) std::min (activeGrains, 0xffff);
+
+        if (! blocks.push (current))
+            dropped.fetch_add (1, std::memory_order_relaxed);
+    }
+
+    // Message thread only.
+    bool pop (BlockTelemetry& block)  { return blocks.pop (block); }
+
+    uint32_t getNumDropped() const    { return dropped.load (std::memory_order_relaxed); }
+
+private:
+    SpscRing<BlockTelemetry, 1024> blocks;
+    std::atomic<uint32_t> dropped { 0 };
+    BlockTelemetry current;
+    Clock::time_point blockStart, stageStart;
+};
+
+#else
+
+class TelemetryRecorder
+{
+public:
+    struct Clock { struct time_point {}; };
+
+    static constexpr bool enabled = false;
+
+    static Clock::time_point now()                                      { return {}; }
+    static uint32_t nanosecondsBetween (Clock::time_point, Clock::time_point)  { return 0; }
+
+    void beginBlock (int, double)                        {}
+    void endStage (BlockTelemetry::Stage)                {}
+    void addStageTime (BlockTelemetry::Stage, uint32_t)  {}
+    void endBlock (int, int)                             {}
+    bool pop (BlockTelemetry&)                           { return false; }
+    uint32_t getNumDropped() const                       { return 0; }
+};
+
+#endif
+
+// Message thread side: what the editor accumulates from the drained blocks.
+struct TelemetryStats
+{
+    // Block time as a fraction of its deadline, in 10% steps; the last bucket
+    // holds everything from 110% up
+    static constexpr int numLoadBuckets = 12;
+
+    std::array<uint32_t, numLoadBuckets> loadHistogram {};
+    std::array<uint64_t, BlockTelemetry::numStages> stageNanoseconds {};
+    uint64_t blockNanoseconds = 0, deadlineNanoseconds = 0;
+    uint32_t numBlocks = 0;
+    uint32_t deadlineMisses = 0;
+    float worstLoad = 0.0f;
+    int activeVoices = 0, peakVoices = 0, activeGrains = 0;
+
+    void add (const BlockTelemetry& block)
+    {
+        auto load = block.deadlineNanoseconds > 0 ? (float) block.blockNanoseconds / (float) block.deadlineNanoseconds : 0.0f;
+
+        ++loadHistogram[(size_t) std::min ((int) (load * 10.0f), numLoadBuckets - 1)];
+        worstLoad = std::max (worstLoad, load);
+
+        for (size_t stage = 0; stage < stageNanoseconds.size(); ++stage)
+            stageNanoseconds[stage] += block.stageNanoseconds[stage];
+
+        blockNanoseconds += block.blockNanoseconds;
+        deadlineNanoseconds += block.deadlineNanoseconds;
+        ++numBlocks;
+        deadlineMisses += block.missedDeadline() ? 1 : 0;
+
+        activeVoices = block.activeVoices;
+        activeGrains = block.activeGrains;
+        peakVoices = std::max (peakVoices, activeVoices);
+    }
+
+    // Total time spent processing as a fraction of the audio it produced
+    float getMeanLoad() const
+    {
+        return deadlineNanoseconds > 0 ? (float) blockNanoseconds / (float) deadlineNanoseconds : 0.0f;
+    }
+
+    // Mean time per block spent in a stage, in microseconds
+    float getMeanStageMicroseconds (int stage) const
+    {
+        return numBlocks > 0 ? (float) stageNanoseconds[(size_t) stage] / (float) numBlocks / 1000.0f : 0.0f;
+    }
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#if JUCE_LINUX || JUCE_ANDROID
+ #include <linux/futex.h>
+ #include <sys/syscall.h>
+ #include <unistd.h>
+#endif
+
+#if defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+ #include <immintrin.h>
+#endif
+
+// A small pool of worker threads for splitting the audio thread's work
+// across cores. The threads are started in prepare(), so running a job
+// never creates a thread, takes a lock or allocates.
+//
+// run() deals a job's tasks out in contiguous runs, one per thread, with
+// the calling thread taking the first. A thread that finishes its own run
+// steals from the others' until none are left. Runs are claimed a task at
+// a time with a compare-and-swap on a word that also holds the job's
+// number, so a worker still finishing the last job can never take a task
+// from the next one. Which thread runs a task never matters to the result:
+// tasks write to their own outputs, and the caller combines them in task
+// order once run() returns.
+//
+// Idle workers spin for a few microseconds, then sleep on a futex (on
+// Linux; elsewhere they nap for 100 us at a time), and the caller only
+// makes the system call to wake them when one is asleep. The caller never
+// waits for a sleeping worker to start: its run is stolen like any other,
+// and the caller only waits for tasks already under way.
+class WorkerPool
+{
+public:
+    static constexpr int maxWorkers = 8;
+    static constexpr int maxTasks = 0xffff;
+
+    // Runs task number task of a job; thread is 0 for the caller and 1 to
+    // getNumWorkers() for the workers, to index per-thread scratch
+    using Task = void (*) (void* context, int task, int thread);
+
+    WorkerPool() = default;
+
+    ~WorkerPool()
+    {
+        release();
+    }
+
+    // Not real-time safe. Starts numWorkers threads, each pinned to a core
+    // of its own from the second on (the first is left to the audio
+    // thread). With none, run() works through the tasks itself.
+    void prepare (int newNumWorkers)
+    {
+        release();
+
+        numWorkers = juce::jlimit (0, maxWorkers, newNumWorkers);
+        auto numCores = juce::jlimit (1, 32, juce::SystemStats::getNumCpus());
+
+        for (int i = 0; i < numWorkers; ++i)
+        {
+            workers[(size_t) i] = std::make_unique<Worker> (*this, i + 1);
+            workers[(size_t) i]->setAffinityMask ((juce::uint32) 1 << ((i + 1) % numCores));
+            workers[(size_t) i]->startThread (juce::Thread::Priority::highest);
+        }
+    }
+
+    void release()
+    {
+        for (int i = 0; i < numWorkers; ++i)
+            workers[(size_t) i]->signalThreadShouldExit();
+
+        generation.fetch_add (1);
+        wakeAll();
+
+        for (int i = 0; i < numWorkers; ++i)
+            workers[(size_t) i]->stopThread (1000);
+
+        for (auto& worker : workers)
+            worker.reset();
+
+        numWorkers = 0;
+    }
+
+    int getNumWorkers() const  { return numWorkers; }
+
+    // Audio thread only. Runs task (context, i, thread) for every i from 0
+    // to numTasks - 1 and returns when all of them have finished.
+    void run (int numTasks, Task task, void* context)
+    {
+        numTasks = juce::jlimit (0, maxTasks, numTasks);
+        auto numThreads = juce::jmin (numWorkers + 1, numTasks);
+
+        if (numThreads <= 1)
+        {
+            for (int i = 0; i < numTasks; ++i)
+                task (context, i, 0);
+
+            return;
+        }
+
+        auto job = generation.load (std::memory_order_relaxed) + 1;
+
+        currentTask.store (task, std::memory_order_relaxed);
+        currentContext.store (context, std::memory_order_relaxed);
+        remaining.store (numTasks, std::memory_order_relaxed);
+
+        for (int i = 0; i <= numWorkers; ++i)
+        {
+            auto begin = i < numThreads ? numTasks * i / numThreads : 0;
+            auto end = i < numThreads ? numTasks * (i + 1) / numThreads : 0;
+            ranges[(size_t) i].state.store (pack (job, begin, end), std::memory_order_release);
+        }
+
+        generation.store (job);
+
+        if (numSleeping.load() > 0)
+            wakeAll();
+
+        work (job, 0);
+
+        // Only tasks that workers have already started can be left
+        while (remaining.load (std::memory_order_acquire) > 0)
+            pause();
+    }
+
+private:
+    class Worker : public juce::Thread
+    {
+    public:
+        Worker (WorkerPool& owner, int threadIndex)
+            : juce::Thread ("Resynthesiser worker " + juce::String (threadIndex)), pool (owner), index (threadIndex)
+        {
+        }
+
+        void run() override
+        {
+            auto seen = pool.generation.load();
+
+            while (! threadShouldExit())
+            {
+                seen = pool.waitForJob (seen, *this);
+
+                if (! threadShouldExit())
+                    pool.work (seen, index);
+            }
+        }
+
+    private:
+        WorkerPool& pool;
+        const int index;
+    };
+
+    // A thread's run of tasks: the job it belongs to, the next task to
+    // claim and the end of the run, in one word
+    struct alignas (64) Range
+    {
+        std::atomic<uint64_t> state { 0 };
+    };
+
+    static constexpr int spinIterations = 4000;
+
+    std::array<std::unique_ptr<Worker>, maxWorkers> workers;
+    int numWorkers = 0;
+
+    std::array<Range, maxWorkers + 1> ranges;
+    alignas (64) std::atomic<uint32_t> generation { 0 }; // the current job's number, and the futex word
+    alignas (64) std::atomic<int> remaining { 0 };
+    std::atomic<int> numSleeping { 0 };
+    std::atomic<Task> currentTask { nullptr };
+    std::atomic<void*> currentContext { nullptr };
+
+    static uint64_t pack (uint32_t job, int next, int end)
+    {
+        return ((uint64_t) job << 32) | ((uint64_t) next << 16) | (uint64_t) end;
+    }
+
+    // Runs tasks of job until none are left unclaimed: first from thread's
+    // own run, then from each of the others'
+    void work (uint32_t job, int thread)
+    {
+        auto task = currentTask.load (std::memory_order_relaxed);
+        auto* context = currentContext.load (std::memory_order_relaxed);
+
+        for (int i = 0; i <= numWorkers; ++i)
+        {
+            auto& range = ranges[(size_t) ((thread + i) % (numWorkers + 1))];
+
+            for (int index; claim (range, job, index);)
+            {
+                task (context, index, thread);
+                remaining.fetch_sub (1, std::memory_order_release);
+            }
+        }
+    }
+
+    static bool claim (Range& range, uint32_t job, int& index)
+    {
+        auto state = range.state.load (std::memory_order_acquire);
+
+        for (;;)
+        {
+            auto next = (int) ((state >> 16) & 0xffff);
+
+            if ((uint32_t) (state >> 32) != job || next >= (int) (state & 0xffff))
+                return false;
+
+            if (range.state.compare_exchange_weak (state, state + ((uint64_t) 1 << 16), std::memory_order_acquire))
+            {
+                index = next;
+                return true;
+            }
+        }
+    }
+
+    // Returns the next job's number once there is one (or the thread is
+    // asked to exit), spinning first and then sleeping
+    uint32_t waitForJob (uint32_t seen, juce::Thread& thread)
+    {
+        for (int i = 0; i < spinIterations; ++i)
+        {
+            auto job = generation.load (std::memory_order_acquire);
+
+            if (job != seen)
+                return job;
+
+            pause();
+        }
+
+        numSleeping.fetch_add (1);
+
+        while (generation.load() == seen && ! thread.threadShouldExit())
+        {
+           #if JUCE_LINUX || JUCE_ANDROID
+            // Returns at once if the job has already changed
+            syscall (SYS_futex, reinterpret_cast<uint32_t*> (&generation), FUTEX_WAIT_PRIVATE, seen, nullptr, nullptr, 0);
+           #else
+            std::this_thread::sleep_for (std::chrono::microseconds (100));
+           #endif
+        }
+
+        numSleeping.fetch_sub (1);
+        return generation.load (std::memory_order_acquire);
+    }
+
+    void wakeAll()
+    {
+       #if JUCE_LINUX || JUCE_ANDROID
+        syscall (SYS_futex, reinterpret_cast<uint32_t*> (&generation), FUTEX_WAKE_PRIVATE, maxWorkers, nullptr, nullptr, 0);
+       #endif
+    }
+
+    static void pause()
+    {
+       #if defined (__SSE2__) || defined (_M_X64) || defined (_M_IX86_FP)
+        _mm_pause();
+       #elif defined (__aarch64__) || defined (_M_ARM64)
+        __asm__ __volatile__ ("yield");
+       #endif
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (WorkerPool)
+};
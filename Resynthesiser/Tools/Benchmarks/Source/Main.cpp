@@ -0,0 +1,579 @@
+/*
+  ==============================================================================
+
+    Micro and macro benchmarks for the resynthesiser, on synthetic input.
+
+    Usage:
+        Benchmarks [options]
+
+        --quick               a handful of cases instead of the full sweep
+        --filter=TEXT         only run benchmarks whose name contains TEXT
+        --min-time=SECONDS    timed run per case (default 0.05)
+        --json=FILE           write the results as JSON
+        --baseline=FILE       compare against an earlier --json file, and exit
+                              with 2 if any case got slower by more than
+                              --threshold
+        --threshold=PERCENT   allowed slowdown in ns/sample (default 10)
+
+    Every case reports the median ns and cycles per sample over its blocks,
+    and its worst block, both in ns and as a fraction of the time that block
+    represents at its sample rate (above 100% is an xrun).
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include "../../../Source/PluginProcessor.h"
+
+#if JUCE_INTEL
+ #if JUCE_MSVC
+  #include <intrin.h>
+ #else
+  #include <x86intrin.h>
+ #endif
+#endif
+
+//==============================================================================
+struct BenchmarkResult
+{
+    juce::String name;
+    int voices = 0;
+    int blockSize = 0;
+    double sampleRate = 0.0;
+    double nsPerSample = 0.0;
+    double cyclesPerSample = 0.0; // TSC cycles, 0 where there is no cycle counter
+    double worstBlockNs = 0.0;
+    double worstBlockLoad = 0.0;  // worst block time / block duration
+
+    juce::String getKey() const
+    {
+        return name + "/" + juce::String (voices) + "/" + juce::String (blockSize) + "/" + juce::String ((int) sampleRate);
+    }
+};
+
+struct BenchmarkOptions
+{
+    bool quick = false;
+    juce::String filter;
+    double minSeconds = 0.05;
+};
+
+static uint64_t readCycleCounter()
+{
+   #if JUCE_INTEL
+    return (uint64_t) __rdtsc();
+   #else
+    return 0;
+   #endif
+}
+
+//==============================================================================
+// Times processBlock() one block at a time, after a few untimed warm-up
+// blocks, until both minSeconds and minBlocks have passed. beforeBlock() runs
+// before each block and is not timed.
+template <typename BeforeBlock, typename ProcessBlock>
+static BenchmarkResult measure (const BenchmarkOptions& options, const juce::String& name, int voices,
+                                int blockSize, double sampleRate, BeforeBlock&& beforeBlock, ProcessBlock&& processBlock)
+{
+    using Clock = std::chrono::steady_clock;
+
+    constexpr int warmUpBlocks = 8, minBlocks = 32, maxBlocks = 200000;
+
+    for (int i = 0; i < warmUpBlocks; ++i)
+    {
+        beforeBlock();
+        processBlock();
+    }
+
+    std::vector<double> nanoseconds, cycles;
+    nanoseconds.reserve (maxBlocks);
+    cycles.reserve (maxBlocks);
+
+    auto totalNs = 0.0;
+
+    while (((int) nanoseconds.size() < minBlocks || totalNs < options.minSeconds * 1.0e9) && (int) nanoseconds.size() < maxBlocks)
+    {
+        beforeBlock();
+
+        auto startCycles = readCycleCounter();
+        auto start = Clock::now();
+        processBlock();
+        auto end = Clock::now();
+        auto endCycles = readCycleCounter();
+
+        nanoseconds.push_back ((double) std::chrono::duration_cast<std::chrono::nanoseconds> (end - start).count());
+        cycles.push_back ((double) (endCycles - startCycles));
+        totalNs += nanoseconds.back();
+    }
+
+    auto median = [] (std::vector<double>& values)
+    {
+        std::nth_element (values.begin(), values.begin() + (long) values.size() / 2, values.end());
+        return values[values.size() / 2];
+    };
+
+    BenchmarkResult result;
+    result.name = name;
+    result.voices = voices;
+    result.blockSize = blockSize;
+    result.sampleRate = sampleRate;
+    result.worstBlockNs = *std::max_element (nanoseconds.begin(), nanoseconds.end());
+    result.worstBlockLoad = result.worstBlockNs / (blockSize / sampleRate * 1.0e9);
+    result.nsPerSample = median (nanoseconds) / blockSize;
+    result.cyclesPerSample = median (cycles) / blockSize;
+    return result;
+}
+
+// Mono test signal: a harmonic tone with some noise, long enough to loop over
+static std::vector<float> makeTestSignal (double sampleRate)
+{
+    std::vector<float> signal ((size_t) sampleRate);
+    juce::Random random (1);
+
+    for (size_t i = 0; i < signal.size(); ++i)
+    {
+        auto t = (double) i / sampleRate;
+
+        for (int harmonic = 1; harmonic <= 8; ++harmonic)
+            signal[i] += (float) (0.3 / harmonic * std::sin (juce::MathConstants<double>::twoPi * 220.0 * harmonic * t));
+
+        signal[i] += 0.02f * (random.nextFloat() * 2.0f - 1.0f);
+    }
+
+    return signal;
+}
+
+//==============================================================================
+class BenchmarkSuite
+{
+public:
+    explicit BenchmarkSuite (const BenchmarkOptions& benchmarkOptions)
+        : options (benchmarkOptions)
+    {
+        if (options.quick)
+        {
+            voiceCounts = { 1, 16, 64 };
+            blockSizes = { 64, 512 };
+            sampleRates = { 48000.0 };
+        }
+    }
+
+    std::vector<BenchmarkResult> run()
+    {
+        renderPool.prepare (juce::SystemStats::getNumCpus() - 1);
+
+        for (auto sampleRate : sampleRates)
+        {
+            auto signal = makeTestSignal (sampleRate);
+
+            for (auto blockSize : blockSizes)
+            {
+                for (auto voices : voiceCounts)
+                    runIfSelected ("SineSynth::renderNextBlock", [&] { benchmarkSynth (voices, blockSize, sampleRate, nullptr); });
+
+                for (auto voices : voiceCounts)
+                    runIfSelected ("SineSynth::renderNextBlock/parallel", [&] { benchmarkSynth (voices, blockSize, sampleRate, &renderPool); });
+
+                // Not per block, so once per sample rate
+                if (blockSize == blockSizes.front())
+                    for (auto voices : voiceCounts)
+                        for (int policy = 0; policy < (int) policyNames.size(); ++policy)
+                            runIfSelected ("SineSynth::noteOn/" + juce::String (policyNames[(size_t) policy]),
+                                           [&] { benchmarkNoteHandling (voices, policy, sampleRate); });
+
+                runIfSelected ("getRMSAmplitude", [&] { benchmarkLevel (false, blockSize, sampleRate, signal); });
+                runIfSelected ("getPeakAmplitude", [&] { benchmarkLevel (true, blockSize, sampleRate, signal); });
+                runIfSelected ("OnsetDetector::process", [&] { benchmarkOnsets (blockSize, sampleRate, signal); });
+
+                for (auto factor : { 2, 4, 8 })
+                    runIfSelected ("Decimator::process", [&] { benchmarkDecimator (factor, blockSize, sampleRate, signal); });
+
+                for (int engine = 0; engine < (int) engineNames.size(); ++engine)
+                    runIfSelected ("processBlock/" + juce::String (engineNames[(size_t) engine]),
+                                   [&] { benchmarkProcessor (engine, blockSize, sampleRate, signal); });
+
+                // A stereo input analysed and played channel by channel
+                runIfSelected ("processBlock/sineBank/perChannel",
+                               [&] { benchmarkProcessor (ResynthesiserAudioProcessor::sineBank, blockSize, sampleRate, signal,
+                                                         ResynthesiserAudioProcessor::perChannel); });
+            }
+
+            for (int estimator = 0; estimator < SpectralAnalyser::numEstimatorTypes; ++estimator)
+                for (auto hop : { 256, 512, 1024, 2048 })
+                    runIfSelected ("analysis/" + juce::String (estimatorNames[(size_t) estimator]),
+                                   [&] { benchmarkAnalysis (estimator, SpectralAnalyser::defaultFftOrder, hop, sampleRate, signal); });
+
+            // Every FFT size with the default estimator, at 75% overlap
+            for (int order = SpectralAnalyser::minFftOrder; order <= SpectralAnalyser::maxFftOrder; ++order)
+                runIfSelected ("analysis/harmonicProduct",
+                               [&] { benchmarkAnalysis (SpectralAnalyser::harmonicProduct, order, (1 << order) / 4, sampleRate, signal); });
+
+            // The same frame taken from decimated input, decimator included
+            for (auto factor : { 2, 4, 8 })
+                runIfSelected ("analysis/harmonicProduct/decimate" + juce::String (factor),
+                               [&] { benchmarkAnalysis (SpectralAnalyser::harmonicProduct, SpectralAnalyser::defaultFftOrder,
+                                                        SpectralAnalyser::defaultHopSize, sampleRate, signal, factor); });
+
+            for (auto numPeaks : { 16, 64, 128, 256 })
+                runIfSelected ("PeakExtractor::extract", [&] { benchmarkPeaks (numPeaks, sampleRate, signal); });
+        }
+
+        return results;
+    }
+
+private:
+    const BenchmarkOptions& options;
+    std::vector<int> voiceCounts { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024 };
+    std::vector<int> blockSizes { 16, 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+    std::vector<double> sampleRates { 44100.0, 48000.0, 96000.0, 192000.0 };
+    std::vector<BenchmarkResult> results;
+
+    // For the parallel render cases, one worker per core beyond the first
+    WorkerPool renderPool;
+
+    static constexpr std::array<const char*, SpectralAnalyser::numEstimatorTypes> estimatorNames { "parabolicPeak", "harmonicProduct", "yin", "multiPitch" };
+    static constexpr std::array<const char*, 3> policyNames { "oldest", "quietest", "nearestPitch" };
+    static constexpr std::array<const char*, 4> engineNames { "sineBank", "phaseVocoder", "partialTracking", "embeddedCore" };
+
+    template <typename Benchmark>
+    void runIfSelected (const juce::String& name, Benchmark&& benchmark)
+    {
+        if (options.filter.isEmpty() || name.contains (options.filter))
+            benchmark();
+    }
+
+    void report (const BenchmarkResult& result)
+    {
+        std::cout << juce::String::formatted ("%-30s %5d voices %5d samples %6.0f Hz %10.2f ns/sample %10.2f cycles/sample %10.0f ns worst (%5.1f%%)",
+                                              result.name.toRawUTF8(), result.voices, result.blockSize, result.sampleRate,
+                                              result.nsPerSample, result.cyclesPerSample, result.worstBlockNs, result.worstBlockLoad * 100.0)
+                  << std::endl;
+
+        results.push_back (result);
+    }
+
+    // The synth's own render loop with every voice held, on the calling
+    // thread alone or with a pool's workers. Notes decay, so they are struck
+    // again every quarter of a second (untimed).
+    void benchmarkSynth (int voices, int blockSize, double sampleRate, WorkerPool* pool)
+    {
+        SineSynth synth (voices);
+        synth.setCurrentPlaybackSampleRate (sampleRate);
+        synth.setWorkerPool (pool);
+
+        juce::AudioBuffer<float> buffer (2, blockSize);
+        auto samplesSinceNotes = (int) sampleRate;
+
+        auto strikeNotes = [&]
+        {
+            if (samplesSinceNotes < sampleRate / 4)
+                return;
+
+            // Spread over channels so no two voices share a note
+            for (int i = 0; i < voices; ++i)
+                synth.noteOn (1 + i / 96, 24 + i % 96, 0.5f);
+
+            samplesSinceNotes = 0;
+        };
+
+        report (measure (options, pool != nullptr ? "SineSynth::renderNextBlock/parallel" : "SineSynth::renderNextBlock", voices, blockSize, sampleRate,
+                         [&] { strikeNotes(); samplesSinceNotes += blockSize; buffer.clear(); },
+                         [&] { synth.renderNextBlock (buffer, 0, blockSize); }));
+    }
+
+    // Note ons and offs with every voice busy, so nearly every note on
+    // steals, with the voice count as given and the stealing policy. Timed
+    // in bursts of 64 pairs (reported as the block size, so the time per
+    // sample is per pair). Nothing is rendered, so released voices stay
+    // busy, and the cost should not grow with the voice count.
+    void benchmarkNoteHandling (int voices, int policy, double sampleRate)
+    {
+        constexpr int notesPerBurst = 64;
+        constexpr int numKeys = 16 * 128;
+
+        SineSynth synth (voices);
+        synth.setCurrentPlaybackSampleRate (sampleRate);
+        synth.setStealingPolicy ((SineSynth::StealingPolicy) policy);
+
+        for (int i = 0; i < voices; ++i)
+            synth.noteOn (1 + i / 128, i % 128, 0.5f);
+
+        auto key = voices;
+
+        report (measure (options, "SineSynth::noteOn/" + juce::String (policyNames[(size_t) policy]),
+                         voices, notesPerBurst, sampleRate,
+                         [] {},
+                         [&]
+                         {
+                             for (int i = 0; i < notesPerBurst; ++i, key = (key + 1) % numKeys)
+                             {
+                                 synth.noteOn (1 + key / 128, key % 128, 0.5f);
+                                 synth.noteOff (1 + key / 128, key % 128, 0.0f, true);
+                             }
+                         }));
+    }
+
+    void benchmarkLevel (bool peak, int blockSize, double sampleRate, const std::vector<float>& signal)
+    {
+        ResynthesiserAudioProcessor processor;
+        juce::AudioBuffer<float> buffer (2, blockSize);
+        fillBuffer (buffer, signal, 0);
+
+        volatile float sink = 0.0f;
+
+        report (measure (options, peak ? "getPeakAmplitude" : "getRMSAmplitude", 0, blockSize, sampleRate,
+                         [] {},
+                         [&] { sink = peak ? processor.getPeakAmplitude (buffer) : processor.getRMSAmplitude (buffer); }));
+    }
+
+    void benchmarkOnsets (int blockSize, double sampleRate, const std::vector<float>& signal)
+    {
+        OnsetDetector detector;
+        detector.prepare (sampleRate);
+
+        std::array<OnsetDetector::Onset, 64> onsets;
+        std::vector<float> block ((size_t) blockSize);
+        size_t position = 0;
+        volatile int sink = 0;
+
+        report (measure (options, "OnsetDetector::process", 0, blockSize, sampleRate,
+                         [&] { for (auto& sample : block) { sample = signal[position]; position = (position + 1) % signal.size(); } },
+                         [&] { sink = detector.process (block.data(), blockSize, onsets.data(), (int) onsets.size()); }));
+    }
+
+    // The analysis front end's filter, with the factor reported as voices
+    void benchmarkDecimator (int factor, int blockSize, double sampleRate, const std::vector<float>& signal)
+    {
+        Decimator decimator;
+        decimator.prepare (factor);
+
+        std::vector<float> block ((size_t) blockSize), decimated ((size_t) blockSize);
+        size_t position = 0;
+        volatile int sink = 0;
+
+        report (measure (options, "Decimator::process", factor, blockSize, sampleRate,
+                         [&] { for (auto& sample : block) { sample = signal[position]; position = (position + 1) % signal.size(); } },
+                         [&] { sink = decimator.process (block.data(), blockSize, decimated.data()); }));
+    }
+
+    // The whole plugin as a host would run it, analysis threads and all
+    void benchmarkProcessor (int engine, int blockSize, double sampleRate, const std::vector<float>& signal,
+                             int analysisInput = ResynthesiserAudioProcessor::midDownmix)
+    {
+        ResynthesiserAudioProcessor processor;
+
+        if (auto* parameter = processor.state.getParameter ("engine"))
+            parameter->setValueNotifyingHost (parameter->convertTo0to1 ((float) engine));
+
+        if (auto* parameter = processor.state.getParameter ("analysisInput"))
+            parameter->setValueNotifyingHost (parameter->convertTo0to1 ((float) analysisInput));
+
+        processor.setRateAndBufferSizeDetails (sampleRate, blockSize);
+        processor.prepareToPlay (sampleRate, blockSize);
+
+        juce::AudioBuffer<float> buffer (2, blockSize);
+        juce::MidiBuffer midi;
+        size_t position = 0;
+
+        auto name = "processBlock/" + juce::String (engineNames[(size_t) engine]);
+
+        if (analysisInput == ResynthesiserAudioProcessor::perChannel)
+            name << "/perChannel";
+
+        report (measure (options, name,
+                         0, blockSize, sampleRate,
+                         [&] { position = fillBuffer (buffer, signal, position); midi.clear(); },
+                         [&] { processor.processBlock (buffer, midi); }));
+
+        processor.releaseResources();
+    }
+
+    // One STFT frame and pitch estimate per block, run inline so the cost of
+    // the frame is what gets timed. The block size reported is the hop, and
+    // the frame length is reported as voices. The multiple pitch estimator
+    // may find as many pitches as it can report, its worst case.
+    void benchmarkAnalysis (int estimator, int fftOrder, int hop, double sampleRate, const std::vector<float>& signal,
+                            int decimation = 1)
+    {
+        auto analyser = std::make_unique<SpectralAnalyser>();
+        analyser->setHopSize (hop);
+        analyser->setPitchEstimator (estimator);
+        analyser->setMaxPitches (AnalysisResult::maxPitches);
+        analyser->setFftOrder (fftOrder);
+        analyser->setDecimation (decimation);
+        analyser->prepare (sampleRate, 1 << fftOrder, true);
+
+        size_t position = 0;
+
+        auto push = [&] (int numSamples)
+        {
+            while (numSamples > 0)
+            {
+                auto count = juce::jmin (numSamples, (int) (signal.size() - position));
+                analyser->pushSamples (signal.data() + position, count);
+                position = (position + (size_t) count) % signal.size();
+                numSamples -= count;
+            }
+        };
+
+        push (analyser->getFrameLength() - hop);
+
+        auto name = "analysis/" + juce::String (estimatorNames[(size_t) estimator]);
+
+        if (decimation > 1)
+            name << "/decimate" << decimation;
+
+        report (measure (options, name, analyser->getFrameLength(), hop, sampleRate,
+                         [&] { push (hop); for (AnalysisResult result; analyser->popResult (result);) {} },
+                         [&] { analyser->analysePendingFrames(); }));
+    }
+
+    // Peak extraction from one frame's spectrum, for up to numPeaks peaks
+    // (reported as voices). Per frame, so the block size reported is the
+    // default hop.
+    void benchmarkPeaks (int numPeaks, double sampleRate, const std::vector<float>& signal)
+    {
+        constexpr auto fftSize = SpectralAnalyser::defaultFftSize;
+        juce::dsp::FFT fft (SpectralAnalyser::defaultFftOrder);
+        juce::dsp::WindowingFunction<float> window ((size_t) fftSize, juce::dsp::WindowingFunction<float>::hann, false);
+
+        std::vector<float> magnitudes ((size_t) fftSize * 2, 0.0f);
+        std::copy (signal.begin(), signal.begin() + fftSize, magnitudes.begin());
+        window.multiplyWithWindowingTable (magnitudes.data(), (size_t) fftSize);
+        fft.performFrequencyOnlyForwardTransform (magnitudes.data());
+
+        PeakExtractor extractor;
+        std::array<SpectralPeak, PeakFrame::maxPeaks> peaks;
+        volatile int sink = 0;
+
+        report (measure (options, "PeakExtractor::extract", numPeaks, SpectralAnalyser::defaultHopSize, sampleRate,
+                         [] {},
+                         [&] { sink = extractor.extract (magnitudes.data(), fftSize, sampleRate, numPeaks, 1.0e-6f, peaks.data()); }));
+    }
+
+    static size_t fillBuffer (juce::AudioBuffer<float>& buffer, const std::vector<float>& signal, size_t position)
+    {
+        for (int i = 0; i < buffer.getNumSamples(); ++i)
+        {
+            for (int channel = 0; channel < buffer.getNumChannels(); ++channel)
+                buffer.setSample (channel, i, signal[position]);
+
+            position = (position + 1) % signal.size();
+        }
+
+        return position;
+    }
+};
+
+//==============================================================================
+static juce::var toJson (const std::vector<BenchmarkResult>& results)
+{
+    juce::Array<juce::var> cases;
+
+    for (auto& result : results)
+    {
+        auto* object = new juce::DynamicObject();
+        object->setProperty ("name", result.name);
+        object->setProperty ("voices", result.voices);
+        object->setProperty ("blockSize", result.blockSize);
+        object->setProperty ("sampleRate", result.sampleRate);
+        object->setProperty ("nsPerSample", result.nsPerSample);
+        object->setProperty ("cyclesPerSample", result.cyclesPerSample);
+        object->setProperty ("worstBlockNs", result.worstBlockNs);
+        object->setProperty ("worstBlockLoad", result.worstBlockLoad);
+        cases.add (juce::var (object));
+    }
+
+    auto* root = new juce::DynamicObject();
+    root->setProperty ("cpu", juce::SystemStats::getCpuModel());
+    root->setProperty ("results", cases);
+    return juce::var (root);
+}
+
+// Returns the number of cases that got slower than the baseline by more than thresholdPercent
+static int compareWithBaseline (const std::vector<BenchmarkResult>& results, const juce::var& baseline, double thresholdPercent)
+{
+    std::map<juce::String, double> baselineNs;
+
+    if (auto* cases = baseline["results"].getArray())
+    {
+        for (auto& item : *cases)
+        {
+            BenchmarkResult result;
+            result.name = item["name"].toString();
+            result.voices = item["voices"];
+            result.blockSize = item["blockSize"];
+            result.sampleRate = item["sampleRate"];
+            baselineNs[result.getKey()] = item["nsPerSample"];
+        }
+    }
+
+    int numRegressions = 0;
+
+    for (auto& result : results)
+    {
+        auto found = baselineNs.find (result.getKey());
+
+        if (found == baselineNs.end() || found->second <= 0.0)
+            continue;
+
+        auto change = (result.nsPerSample / found->second - 1.0) * 100.0;
+
+        if (change > thresholdPercent)
+        {
+            ++numRegressions;
+            std::cout << "REGRESSION " << result.getKey() << ": " << juce::String (found->second, 2) << " -> "
+                      << juce::String (result.nsPerSample, 2) << " ns/sample (+" << juce::String (change, 1) << "%)" << std::endl;
+        }
+    }
+
+    return numRegressions;
+}
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    juce::ScopedJuceInitialiser_GUI juceInitialiser;
+    juce::ArgumentList args (argc, argv);
+
+    BenchmarkOptions options;
+    options.quick = args.containsOption ("--quick");
+    options.filter = args.getValueForOption ("--filter");
+
+    if (args.containsOption ("--min-time"))
+        options.minSeconds = juce::jmax (0.001, args.getValueForOption ("--min-time").getDoubleValue());
+
+    auto threshold = args.containsOption ("--threshold") ? args.getValueForOption ("--threshold").getDoubleValue() : 10.0;
+
+    auto results = BenchmarkSuite (options).run();
+
+    if (args.containsOption ("--json"))
+    {
+        auto file = args.getFileForOption ("--json");
+
+        if (! file.replaceWithText (juce::JSON::toString (toJson (results))))
+        {
+            std::cout << "Can't write " << file.getFullPathName() << std::endl;
+            return 1;
+        }
+    }
+
+    if (args.containsOption ("--baseline"))
+    {
+        auto baselineFile = args.getFileForOption ("--baseline");
+
+        if (! baselineFile.existsAsFile())
+        {
+            std::cout << "Can't read " << baselineFile.getFullPathName() << std::endl;
+            return 1;
+        }
+
+        auto baseline = juce::JSON::parse (baselineFile);
+        auto numRegressions = compareWithBaseline (results, baseline, threshold);
+
+        std::cout << numRegressions << " regression(s) over " << threshold << "%" << std::endl;
+        return numRegressions == 0 ? 0 : 2;
+    }
+
+    return 0;
+}
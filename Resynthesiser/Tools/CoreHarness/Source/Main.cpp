@@ -0,0 +1,319 @@
+/*
+  ==============================================================================
+
+    Host harness for the portable core (Resynthesiser/Core), built without
+    JUCE: runs the module's configuration on a synthetic input and checks it
+    the way the module needs it to behave, so its code path can be profiled
+    and regression-tested without the hardware.
+
+    Usage:
+        CoreHarness [options]
+
+        --seconds N              length of the test input (default 10)
+        --rate N                 sample rate (default 48000)
+        --hop N                  analysis hop (default 512)
+        --block N                block size to time (default 48, the module's),
+                                 may be repeated; one longer than the input
+                                 is reported and skipped
+        --write-reference FILE   saves the output as raw 32-bit floats
+        --reference FILE         compares the output with a saved one, bit for bit
+
+    Checks, each reported as PASS or FAIL (and the exit code is 1 if any fail):
+     - the output is bit-identical whatever block size process() is called with,
+     - nothing is allocated after init,
+     - with --reference, the output is bit-identical to the saved one, e.g.
+       from another compiler, another optimisation level or the module.
+
+    Then, for each block size, the mean and worst host cycles per block (TSC
+    on x86, elsewhere ns) and ns per sample. These are the host's, not the
+    module's: compare them between builds, and measure the target on the
+    target.
+
+  ==============================================================================
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#if defined (__x86_64__) || defined (__i386__)
+ #include <x86intrin.h>
+#endif
+
+#include "../../../Core/Resynthesiser.h"
+
+using Core = resynth::ModuleResynthesiser;
+
+//==============================================================================
+// Every allocation in the process is counted, so the harness can tell if
+// process() ever allocates
+static std::atomic<uint64_t> numAllocations { 0 };
+
+void* operator new (size_t size)
+{
+    ++numAllocations;
+
+    if (auto* memory = std::malloc (size == 0 ? 1 : size))
+        return memory;
+
+    throw std::bad_alloc();
+}
+
+void operator delete (void* memory) noexcept               { std::free (memory); }
+void operator delete (void* memory, size_t) noexcept       { std::free (memory); }
+
+//==============================================================================
+struct HarnessSettings
+{
+    int seconds = 10;
+    float sampleRate = 48000.0f;
+    int hopSize = 512;
+    std::vector<int> blockSizes;
+    std::string writeReference, reference;
+};
+
+static uint64_t readCycleCounter()
+{
+   #if defined (__x86_64__) || defined (__i386__)
+    return (uint64_t) __rdtsc();
+   #else
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now().time_since_epoch()).count();
+   #endif
+}
+
+static bool report (bool passed, const std::string& check)
+{
+    std::cout << (passed ? "PASS  " : "FAIL  ") << check << std::endl;
+    return passed;
+}
+
+// Notes of a harmonic tone, a chord and bursts of noise, made with the
+// core's own float maths so the input is the same on every target
+static std::vector<float> makeTestInput (const HarnessSettings& settings)
+{
+    static constexpr float notes[] = { 110.0f, 146.83f, 220.0f, 329.63f, 82.41f, 440.0f, 196.0f, 261.63f };
+    static constexpr float chord[] = { 261.63f, 329.63f, 392.0f };
+
+    auto length = (size_t) settings.seconds * (size_t) settings.sampleRate;
+    auto noteLength = (size_t) (settings.sampleRate / 2.0f);
+    std::vector<float> input (length, 0.0f);
+    uint32_t noise = 0x12345678u;
+
+    std::vector<float> phases (3 * 8, 0.0f);
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        auto note = i / noteLength;
+        auto isChord = note % 5 == 4;
+        auto numVoices = isChord ? 3 : 1;
+        auto sample = 0.0f;
+
+        for (int voice = 0; voice < numVoices; ++voice)
+        {
+            auto fundamental = isChord ? chord[voice] : notes[note % 8];
+
+            for (int harmonic = 1; harmonic <= 8; ++harmonic)
+            {
+                auto& phase = phases[(size_t) (voice * 8 + harmonic - 1)];
+                phase += fundamental * (float) harmonic / settings.sampleRate;
+                phase -= phase >= 0.5f ? 1.0f : 0.0f;
+                sample += resynth::fastSin (phase) * 0.2f / (float) harmonic;
+            }
+        }
+
+        // A burst of noise at the start of every other note
+        if (note % 2 == 1 && i % noteLength < noteLength / 10)
+        {
+            noise ^= noise << 13;
+            noise ^= noise >> 17;
+            noise ^= noise << 5;
+            sample += 0.1f * ((float) (noise >> 8) * (1.0f / 8388608.0f) - 1.0f);
+        }
+
+        input[i] = sample;
+    }
+
+    return input;
+}
+
+static resynth::Parameters getTestParameters()
+{
+    resynth::Parameters parameters;
+    parameters.pitchRatio = 1.5f;
+    parameters.drag = 0.3f;
+    parameters.range = 0.5f;
+    parameters.grainDensity = 0.5f;
+    parameters.grainWindow = 0.5f;
+    parameters.grainSize = 0.3f;
+    return parameters;
+}
+
+// Runs the whole input through a fresh core in blocks of blockSize, or of
+// varying sizes up to 4096 if blockSize is 0. Per-block cycles go to
+// cycles, if given.
+static std::vector<float> render (Core& core, const HarnessSettings& settings, const std::vector<float>& input,
+                                  int blockSize, std::vector<uint64_t>* cycles = nullptr)
+{
+    std::vector<float> output (input.size(), 0.0f);
+    uint32_t sizes = 0x2545f491u;
+
+    core.init (settings.sampleRate, settings.hopSize);
+    core.setParameters (getTestParameters());
+
+    for (size_t position = 0; position < input.size();)
+    {
+        auto size = blockSize;
+
+        if (size == 0)
+        {
+            sizes ^= sizes << 13;
+            sizes ^= sizes >> 17;
+            sizes ^= sizes << 5;
+            size = 1 + (int) (sizes % 4096);
+        }
+
+        auto count = std::min ((size_t) size, input.size() - position);
+        auto start = readCycleCounter();
+        core.process (input.data() + position, output.data() + position, (int) count);
+        auto end = readCycleCounter();
+
+        if (cycles != nullptr && count == (size_t) size)
+            cycles->push_back (end - start);
+
+        position += count;
+    }
+
+    return output;
+}
+
+static std::string describeDifference (const std::vector<float>& a, const std::vector<float>& b)
+{
+    auto first = std::mismatch (a.begin(), a.end(), b.begin(),
+                                [] (float x, float y) { return std::memcmp (&x, &y, sizeof (float)) == 0; });
+
+    if (first.first == a.end())
+        return {};
+
+    auto worst = 0.0f;
+
+    for (size_t i = 0; i < a.size(); ++i)
+        worst = std::max (worst, std::abs (a[i] - b[i]));
+
+    return " (first differs at sample " + std::to_string (first.first - a.begin()) + ", largest difference "
+           + std::to_string (worst) + ")";
+}
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    HarnessSettings settings;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        auto hasValue = i + 1 < argc;
+
+        if (arg == "--seconds" && hasValue)                 settings.seconds = std::max (1, std::atoi (argv[++i]));
+        else if (arg == "--rate" && hasValue)               settings.sampleRate = (float) std::max (8000, std::atoi (argv[++i]));
+        else if (arg == "--hop" && hasValue)                settings.hopSize = std::clamp (std::atoi (argv[++i]), 1, Core::fftSize);
+        else if (arg == "--block" && hasValue)              settings.blockSizes.push_back (std::max (1, std::atoi (argv[++i])));
+        else if (arg == "--write-reference" && hasValue)    settings.writeReference = argv[++i];
+        else if (arg == "--reference" && hasValue)          settings.reference = argv[++i];
+        else
+        {
+            std::cout << "Usage: " << argv[0] << " [--seconds N] [--rate N] [--hop N] [--block N]..."
+                      << " [--write-reference FILE] [--reference FILE]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (settings.blockSizes.empty())
+        settings.blockSizes = { 48, 16, 128, 512 };
+
+    // The core is big, and on the module lives in static storage
+    auto core = std::make_unique<Core>();
+    auto input = makeTestInput (settings);
+    auto allPassed = true;
+
+    std::cout << "Core: " << Core::fftSize << "-point frames, hop " << settings.hopSize << ", "
+              << sizeof (Core) << " bytes, latency " << Core::getLatency() << " samples" << std::endl;
+
+    // Bit-exact whatever the block size
+    auto expected = render (*core, settings, input, settings.blockSizes.front());
+
+    for (auto blockSize : { 1, 7, 64, 1000, 4096, 0 })
+    {
+        auto output = render (*core, settings, input, blockSize);
+        auto difference = describeDifference (expected, output);
+        auto name = blockSize == 0 ? std::string ("varying blocks") : std::to_string (blockSize) + "-sample blocks";
+        allPassed &= report (difference.empty(), "bit-exact in " + name + difference);
+    }
+
+    // Nothing allocated after init
+    core->init (settings.sampleRate, settings.hopSize);
+    core->setParameters (getTestParameters());
+    std::vector<float> output (input.size());
+    auto allocationsBefore = numAllocations.load();
+
+    for (size_t position = 0; position < input.size(); position += 48)
+        core->process (input.data() + position, output.data() + position, (int) std::min ((size_t) 48, input.size() - position));
+
+    auto numProcessAllocations = numAllocations.load() - allocationsBefore;
+    allPassed &= report (numProcessAllocations == 0, "no allocation in process() (" + std::to_string (numProcessAllocations) + ")");
+
+    if (! settings.writeReference.empty())
+    {
+        std::ofstream file (settings.writeReference, std::ios::binary);
+        file.write (reinterpret_cast<const char*> (expected.data()), (std::streamsize) (expected.size() * sizeof (float)));
+        allPassed &= report (file.good(), "wrote " + settings.writeReference);
+    }
+
+    if (! settings.reference.empty())
+    {
+        std::ifstream file (settings.reference, std::ios::binary);
+        std::vector<float> reference (expected.size(), 0.0f);
+        file.read (reinterpret_cast<char*> (reference.data()), (std::streamsize) (reference.size() * sizeof (float)));
+        auto complete = file.gcount() == (std::streamsize) (reference.size() * sizeof (float)) && file.peek() == EOF;
+        auto difference = complete ? describeDifference (reference, expected) : std::string (" (a different length)");
+        allPassed &= report (complete && difference.empty(), "bit-exact with " + settings.reference + difference);
+    }
+
+    // Host cycles per block, on a warm cache. Only whole blocks are timed
+    for (auto blockSize : settings.blockSizes)
+    {
+        if ((size_t) blockSize > input.size())
+        {
+            std::printf ("%5d-sample blocks: not timed, longer than the %zu-sample input\n", blockSize, input.size());
+            continue;
+        }
+
+        std::vector<uint64_t> cycles;
+        cycles.reserve (input.size() / (size_t) blockSize + 1);
+
+        auto start = std::chrono::steady_clock::now();
+        render (*core, settings, input, blockSize, &cycles);
+        auto seconds = std::chrono::duration<double> (std::chrono::steady_clock::now() - start).count();
+
+        auto mean = 0.0;
+
+        for (auto value : cycles)
+            mean += (double) value / (double) cycles.size();
+
+        auto worst = (double) *std::max_element (cycles.begin(), cycles.end());
+
+        std::printf ("%5d-sample blocks: %10.0f host cycles mean, %10.0f worst, %7.2f ns/sample (host, not target)\n",
+                     blockSize, mean, worst, seconds * 1.0e9 / (double) input.size());
+    }
+
+    return allPassed ? 0 : 1;
+}
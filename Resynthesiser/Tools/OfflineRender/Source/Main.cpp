@@ -0,0 +1,360 @@
+/*
+  ==============================================================================
+
+    Headless batch renderer: streams WAV/AIFF files through
+    ResynthesiserAudioProcessor, one processor per worker thread.
+
+    Usage:
+        OfflineRender [options] file...
+
+        --threads N       workers (default: one per core)
+        --block N         samples per processBlock call (default 512)
+        --output DIR      where to write results (default: next to each input)
+        --set id=value    sets a parameter before rendering, e.g. --set engine=1
+                          (value in the parameter's own range), may be repeated
+        --snapshot        also captures each input's analysis as <name>.rspf
+        --load-snapshot F plays snapshot library F through the partial tracks
+                          (with --set engine=2 --set snapshotMode=1)
+
+    Each input is written as <name>_resynth.<ext> in the input's format, and
+    its real-time factor (audio duration / wall time) is reported when done.
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+#include "../../../Source/PluginProcessor.h"
+
+//==============================================================================
+struct RenderSettings
+{
+    int blockSize = 512;
+    juce::File outputDirectory;
+    juce::StringPairArray parameterValues;
+    bool captureSnapshots = false;
+    juce::File snapshotLibrary;
+};
+
+static juce::CriticalSection consoleLock;
+
+static void printLine (const juce::String& text)
+{
+    const juce::ScopedLock sl (consoleLock);
+    std::cout << text << std::endl;
+}
+
+//==============================================================================
+// Owns one processor and renders files from the shared queue until it runs dry.
+class RenderWorker  : public juce::Thread
+{
+public:
+    RenderWorker (const juce::Array<juce::File>& filesToRender, std::atomic<int>& nextFileIndex,
+                  const RenderSettings& renderSettings, int workerIndex)
+        : juce::Thread ("Render worker " + juce::String (workerIndex)),
+          files (filesToRender), nextFile (nextFileIndex), settings (renderSettings)
+    {
+        formatManager.registerBasicFormats();
+        applyParameterValues();
+
+        juce::String error;
+
+        if (settings.snapshotLibrary != juce::File() && ! processor.loadSnapshotLibrary (settings.snapshotLibrary, error))
+            printLine (settings.snapshotLibrary.getFileName() + ": " + error);
+    }
+
+    ~RenderWorker() override
+    {
+        stopThread (-1);
+    }
+
+    int getNumFailures() const  { return numFailures; }
+
+    void run() override
+    {
+        for (auto index = nextFile++; index < files.size() && ! threadShouldExit(); index = nextFile++)
+        {
+            juce::String error;
+
+            if (! render (files.getReference (index), error))
+            {
+                ++numFailures;
+                printLine (files.getReference (index).getFileName() + ": " + error);
+            }
+        }
+    }
+
+private:
+    const juce::Array<juce::File>& files;
+    std::atomic<int>& nextFile;
+    const RenderSettings& settings;
+
+    juce::AudioFormatManager formatManager;
+    ResynthesiserAudioProcessor processor;
+    int numFailures = 0;
+
+    void applyParameterValues()
+    {
+        auto& values = settings.parameterValues;
+
+        for (auto& id : values.getAllKeys())
+        {
+            if (auto* parameter = processor.state.getParameter (id))
+                parameter->setValueNotifyingHost (parameter->convertTo0to1 (values[id].getFloatValue()));
+            else
+                printLine ("Unknown parameter: " + id);
+        }
+    }
+
+    bool render (const juce::File& input, juce::String& error)
+    {
+        std::unique_ptr<juce::AudioFormatReader> reader (formatManager.createReaderFor (input));
+
+        if (reader == nullptr)
+        {
+            error = "not a readable audio file";
+            return false;
+        }
+
+        auto* format = formatManager.findFormatForFileExtension (input.getFileExtension());
+        auto directory = settings.outputDirectory == juce::File() ? input.getParentDirectory() : settings.outputDirectory;
+        auto output = directory.getChildFile (input.getFileNameWithoutExtension() + "_resynth" + input.getFileExtension());
+        auto numOutputChannels = juce::jmax (1, processor.getTotalNumOutputChannels());
+
+        output.deleteFile();
+        auto stream = output.createOutputStream();
+
+        if (format == nullptr || stream == nullptr)
+        {
+            error = "can't write " + output.getFullPathName();
+            return false;
+        }
+
+        std::unique_ptr<juce::AudioFormatWriter> writer (format->createWriterFor (stream.get(), reader->sampleRate,
+                                                                                  (unsigned int) numOutputChannels,
+                                                                                  (int) juce::jmax (16u, reader->bitsPerSample),
+                                                                                  {}, 0));
+        if (writer == nullptr)
+        {
+            error = "no " + format->getFormatName() + " writer for this format";
+            return false;
+        }
+
+        stream.release(); // now owned by the writer
+
+        if (settings.captureSnapshots)
+        {
+            auto snapshot = directory.getChildFile (input.getFileNameWithoutExtension() + ".rspf");
+
+            if (! captureSnapshot (*reader, snapshot, error))
+                return false;
+        }
+
+        auto startTime = juce::Time::getMillisecondCounterHiRes();
+        renderStream (*reader, *writer);
+        auto seconds = (juce::Time::getMillisecondCounterHiRes() - startTime) / 1000.0;
+        auto duration = (double) reader->lengthInSamples / reader->sampleRate;
+
+        printLine (input.getFileName() + ": " + juce::String (duration, 1) + " s in " + juce::String (seconds, 2)
+                   + " s (" + juce::String (duration / juce::jmax (seconds, 1.0e-6), 1) + "x real time)");
+        return true;
+    }
+
+    // Streams the file through processBlock a block at a time, so nothing
+    // bigger than one block is ever held in memory. The processor's output,
+    // the resynthesis alone, is late by its latency, which is trimmed from
+    // the start and flushed out with silence at the end.
+    void renderStream (juce::AudioFormatReader& reader, juce::AudioFormatWriter& writer)
+    {
+        auto blockSize = settings.blockSize;
+
+        processor.setNonRealtime (true);
+        processor.setRateAndBufferSizeDetails (reader.sampleRate, blockSize);
+        processor.prepareToPlay (reader.sampleRate, blockSize);
+        processor.reset();
+
+        auto numChannels = juce::jmax (processor.getTotalNumInputChannels(), processor.getTotalNumOutputChannels());
+        juce::AudioBuffer<float> buffer (numChannels, blockSize);
+        juce::MidiBuffer midi;
+
+        auto latency = (juce::int64) processor.getLatencySamples();
+        auto length = reader.lengthInSamples;
+
+        for (juce::int64 position = 0; position < length + latency; position += blockSize)
+        {
+            auto numSamples = (int) juce::jmin ((juce::int64) blockSize, length + latency - position);
+            buffer.setSize (numChannels, numSamples, false, false, true);
+            buffer.clear();
+
+            if (position < length)
+            {
+                auto numToRead = (int) juce::jmin ((juce::int64) numSamples, length - position);
+                reader.read (&buffer, 0, numToRead, position, true, true);
+
+                // Mono files feed every input
+                if (reader.numChannels == 1)
+                    for (int channel = 1; channel < processor.getTotalNumInputChannels(); ++channel)
+                        buffer.copyFrom (channel, 0, buffer, 0, 0, numToRead);
+            }
+
+            midi.clear();
+            processor.processBlock (buffer, midi);
+
+            auto skip = (int) juce::jlimit ((juce::int64) 0, (juce::int64) numSamples, latency - position);
+            writer.writeFromAudioSampleBuffer (buffer, skip, numSamples - skip);
+        }
+
+        processor.releaseResources();
+    }
+
+    // Analyses the file on its own, mixed to mono, with the analyser's
+    // default settings, and writes every frame's fundamental and peaks to a
+    // snapshot library. The samples go to the analyser a hop at a time and
+    // each frame is taken as soon as it is analysed, so its rings can't
+    // overflow whatever --block is; a library missing a frame would have the
+    // rest played at the wrong times, so if one is lost anyway the capture
+    // fails.
+    bool captureSnapshot (juce::AudioFormatReader& reader, const juce::File& output, juce::String& error)
+    {
+        auto blockSize = settings.blockSize;
+        auto analyser = std::make_unique<SpectralAnalyser>();
+        analyser->setMaxPeaks (PeakFrame::maxPeaks);
+        analyser->prepare (reader.sampleRate, juce::jmin (blockSize, SpectralAnalyser::defaultHopSize), true);
+
+        SpectralSnapshotWriter writer (output, reader.sampleRate, SpectralAnalyser::defaultHopSize, PeakFrame::maxPeaks);
+        juce::AudioBuffer<float> buffer ((int) reader.numChannels, blockSize);
+        std::vector<float> mono ((size_t) blockSize);
+
+        for (juce::int64 position = 0; position < reader.lengthInSamples && writer.isOpen(); position += blockSize)
+        {
+            auto numSamples = (int) juce::jmin ((juce::int64) blockSize, reader.lengthInSamples - position);
+            reader.read (&buffer, 0, numSamples, position, true, true);
+
+            std::fill (mono.begin(), mono.end(), 0.0f);
+
+            for (int channel = 0; channel < buffer.getNumChannels(); ++channel)
+                juce::FloatVectorOperations::addWithMultiply (mono.data(), buffer.getReadPointer (channel),
+                                                              1.0f / (float) buffer.getNumChannels(), numSamples);
+
+            for (int offset = 0; offset < numSamples; offset += SpectralAnalyser::defaultHopSize)
+            {
+                analyser->pushSamples (mono.data() + offset, juce::jmin (SpectralAnalyser::defaultHopSize, numSamples - offset));
+                analyser->analysePendingFrames();
+
+                for (AnalysisResult result; analyser->popResult (result);)
+                {
+                    for (auto* frame = analyser->beginReadingPeaks(); frame != nullptr && frame->frameIndex <= result.frameIndex;
+                         frame = analyser->beginReadingPeaks())
+                    {
+                        if (! result.fastTier && frame->frameIndex == result.frameIndex)
+                            writer.addFrame (result.fundamental, result.confidence, frame->peaks.data(), frame->numPeaks);
+
+                        analyser->finishReadingPeaks();
+                    }
+                }
+            }
+        }
+
+        if (! writer.finish())
+        {
+            error = "can't write " + output.getFullPathName();
+            return false;
+        }
+
+        if (analyser->getNumDroppedFrames() > 0)
+        {
+            output.deleteFile();
+            error = juce::String ((int) analyser->getNumDroppedFrames()) + " analysis frames lost capturing " + output.getFullPathName();
+            return false;
+        }
+
+        return true;
+    }
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RenderWorker)
+};
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    juce::ScopedJuceInitialiser_GUI juceInitialiser;
+    juce::ArgumentList args (argc, argv);
+
+    RenderSettings settings;
+    auto numThreads = juce::SystemStats::getNumCpus();
+    juce::Array<juce::File> files;
+
+    for (int i = 0; i < args.size(); ++i)
+    {
+        auto& arg = args[i];
+        auto hasValue = i + 1 < args.size();
+
+        if (arg == "--threads" && hasValue)
+        {
+            numThreads = juce::jmax (1, args[++i].text.getIntValue());
+        }
+        else if (arg == "--block" && hasValue)
+        {
+            settings.blockSize = juce::jmax (1, args[++i].text.getIntValue());
+        }
+        else if (arg == "--output" && hasValue)
+        {
+            settings.outputDirectory = args[++i].resolveAsFile();
+        }
+        else if (arg == "--snapshot")
+        {
+            settings.captureSnapshots = true;
+        }
+        else if (arg == "--load-snapshot" && hasValue)
+        {
+            settings.snapshotLibrary = args[++i].resolveAsFile();
+        }
+        else if (arg == "--set" && hasValue)
+        {
+            auto assignment = args[++i].text;
+            settings.parameterValues.set (assignment.upToFirstOccurrenceOf ("=", false, false),
+                                          assignment.fromFirstOccurrenceOf ("=", false, false));
+        }
+        else
+        {
+            files.add (arg.resolveAsFile());
+        }
+    }
+
+    if (files.isEmpty())
+    {
+        std::cout << "Usage: " << args.executableName << " [--threads N] [--block N] [--output DIR] [--set id=value] [--snapshot] [--load-snapshot FILE] file..." << std::endl;
+        return 1;
+    }
+
+    if (settings.outputDirectory != juce::File() && ! settings.outputDirectory.createDirectory())
+    {
+        std::cout << "Can't create " << settings.outputDirectory.getFullPathName() << std::endl;
+        return 1;
+    }
+
+    // Processors are built here, on the message thread, then left to their workers
+    std::atomic<int> nextFile { 0 };
+    juce::OwnedArray<RenderWorker> workers;
+
+    for (int i = 0; i < juce::jmin (numThreads, files.size()); ++i)
+        workers.add (new RenderWorker (files, nextFile, settings, i));
+
+    auto startTime = juce::Time::getMillisecondCounterHiRes();
+
+    for (auto* worker : workers)
+        worker->startThread();
+
+    int numFailures = 0;
+
+    for (auto* worker : workers)
+    {
+        worker->waitForThreadToExit (-1);
+        numFailures += worker->getNumFailures();
+    }
+
+    printLine ("Rendered " + juce::String (files.size() - numFailures) + " of " + juce::String (files.size())
+               + " files on " + juce::String (workers.size()) + " threads in "
+               + juce::String ((juce::Time::getMillisecondCounterHiRes() - startTime) / 1000.0, 2) + " s");
+
+    return numFailures == 0 ? 0 : 1;
+}